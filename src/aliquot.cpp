@@ -1,3 +1,4 @@
+#include <chrono>
 #include <iostream>
 #include <span>
 #include <tuple>
@@ -18,20 +19,16 @@ SumOfDivisors(
 )
 {
     // Get prime factors of N
-    auto factors = GetPrimeFactors(N, Cache);
-    // Cache the factors
-    if (Cache.IsOpen()) {
-        Cache.Write(factors);
-    }
-    // Convert the prime factors to a vector of composite factors
-    auto composites = factors.GetComposite();
-    // Sum the composite factors excluding n itself
-    mpz_class sum = 0;
-    for (const auto& comp : composites) {
-        if (comp != N) {
-            sum += comp;
-        }
-    }
+    const auto start = std::chrono::steady_clock::now();
+    FactorMethod method;
+    auto factors = GetPrimeFactors(N, Cache, NumThreads, &method);
+    // Offer the factors to the cache, which keeps the quick ones in its
+    // in-memory tier only. That tier is still filled when the cache has
+    // no path.
+    Cache.Admit(factors, method, std::chrono::steady_clock::now() - start);
+    // The sum of the proper divisors is sigma(N) - N, computed from the
+    // factors without building any divisor
+    mpz_class sum = factors.Sigma() - N;
     return {sum, factors};
 }
 
@@ -63,10 +60,17 @@ AliquotSequence(
     const mpz_class& N,
     const std::string_view CachePath,
     const bool Verbose,
-    const size_t NumThreads
+    const size_t NumThreads,
+    const std::string_view CacheSocket,
+    std::ostream* Stats,
+    const std::chrono::nanoseconds AdmitThreshold
 )
 {
     PrimeFactorCache<> cache(CachePath);
+    cache.SetAdmitThreshold(AdmitThreshold);
+    if (!CacheSocket.empty()) {
+        cache.Connect(CacheSocket);
+    }
     std::vector<mpz_class> sequence;
     mpz_class current = N;
     size_t index = 0;
@@ -95,5 +99,9 @@ AliquotSequence(
         current = sum;
         index++;
     }
+    if (Stats != nullptr) {
+        cache.WriteStats(*Stats);
+        *Stats << std::endl;
+    }
     return sequence;
 }
\ No newline at end of file
@@ -1,6 +1,8 @@
 #pragma once
 
+#include <chrono>
 #include <cinttypes>
+#include <ostream>
 #include <string_view>
 #include <thread>
 #include <tuple>
@@ -28,5 +30,8 @@ AliquotSequence(
     const mpz_class& N,
     const std::string_view CachePath = "",
     const bool Verbose = false,
-    const size_t NumThreads = std::thread::hardware_concurrency()
+    const size_t NumThreads = std::thread::hardware_concurrency(),
+    const std::string_view CacheSocket = "",
+    std::ostream* Stats = nullptr,
+    const std::chrono::nanoseconds AdmitThreshold = kDefaultAdmitThreshold
 );
\ No newline at end of file
@@ -0,0 +1,277 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <span>
+#include <utility>
+#include <vector>
+
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+// Reads a batch keeps in flight at once
+constexpr unsigned kAsyncReadDepth = 64;
+
+// One read of a batch: Size bytes at Offset of Fd into Buffer
+struct ReadRequest {
+    int Fd;
+    uint64_t Offset;
+    uint32_t Size;
+    uint8_t* Buffer;
+};
+
+// Performs batches of reads through an io_uring, so a batch costs about
+// as long as its slowest read rather than the sum of them. The ring is
+// set up with raw system calls. Where io_uring is unavailable, too old to
+// read, or disabled for the process, and on systems other than Linux, the
+// reads fall back to pread one at a time. Not safe to share between
+// threads.
+class AsyncReader {
+public:
+    // A Depth of 0 always uses pread
+    AsyncReader(
+        [[maybe_unused]] const unsigned Depth = kAsyncReadDepth
+    ) {
+#ifdef __linux__
+        if (Depth > 0) {
+            Setup(Depth);
+        }
+#endif
+    }
+
+    AsyncReader(
+        const AsyncReader&
+    ) = delete;
+
+    AsyncReader&
+    operator=(
+        const AsyncReader&
+    ) = delete;
+
+    ~AsyncReader() {
+#ifdef __linux__
+        Teardown();
+#endif
+    }
+
+    bool
+    UsesRing(
+        void
+    ) const {
+        return m_Ring >= 0;
+    }
+
+    // Fill every buffer. Returns false if any read failed or hit the end
+    // of its file.
+    bool
+    Read(
+        const std::span<const ReadRequest> Reads
+    ) {
+#ifdef __linux__
+        if (m_Ring >= 0) {
+            return ReadRing(Reads);
+        }
+#endif
+        return ReadSync(Reads);
+    }
+
+private:
+    static bool
+    ReadSync(
+        const std::span<const ReadRequest> Reads
+    ) {
+        for (const ReadRequest& read : Reads) {
+            uint32_t done = 0;
+            while (done < read.Size) {
+                const ssize_t count = pread(read.Fd, read.Buffer + done, read.Size - done, read.Offset + done);
+                if (count < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (count <= 0) {
+                    return false;
+                }
+                done += static_cast<uint32_t>(count);
+            }
+        }
+        return true;
+    }
+
+    int m_Ring = -1;
+
+#ifdef __linux__
+    bool
+    ReadRing(
+        const std::span<const ReadRequest> Reads
+    ) {
+        // Bytes read so far of each request, which may take several reads
+        std::vector<uint32_t> done(Reads.size(), 0);
+        std::vector<uint32_t> queue;
+        queue.reserve(Reads.size());
+        for (size_t i = Reads.size(); i-- > 0;) {
+            queue.push_back(static_cast<uint32_t>(i));
+        }
+        bool ok = true;
+        // Set once the ring fails, after which the reads it accepted are
+        // waited for and the rest use pread
+        bool broken = false;
+        size_t in_flight = 0;
+        while ((!queue.empty() && !broken) || in_flight > 0) {
+            unsigned tail = *m_SqTail;
+            while (!broken && !queue.empty() && in_flight < m_Entries) {
+                const uint32_t index = queue.back();
+                queue.pop_back();
+                const ReadRequest& read = Reads[index];
+                io_uring_sqe& sqe = m_Sqes[tail & m_SqMask];
+                sqe = {};
+                sqe.opcode = IORING_OP_READ;
+                sqe.fd = read.Fd;
+                sqe.off = read.Offset + done[index];
+                sqe.addr = reinterpret_cast<uint64_t>(read.Buffer + done[index]);
+                sqe.len = read.Size - done[index];
+                sqe.user_data = index;
+                m_SqArray[tail & m_SqMask] = tail & m_SqMask;
+                tail++;
+                in_flight++;
+            }
+            std::atomic_ref<unsigned>(*m_SqTail).store(tail, std::memory_order_release);
+            const unsigned head = std::atomic_ref<unsigned>(*m_SqHead).load(std::memory_order_acquire);
+            if (syscall(__NR_io_uring_enter, m_Ring, tail - head, 1, IORING_ENTER_GETEVENTS, nullptr, 0) < 0 &&
+                errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                if (broken) {
+                    // Cannot wait for the accepted reads, so the ring is
+                    // left to the destructor
+                    return false;
+                }
+                // Take back the reads the kernel has not accepted
+                const unsigned accepted = std::atomic_ref<unsigned>(*m_SqHead).load(std::memory_order_acquire);
+                for (unsigned entry = accepted; entry != tail; ++entry) {
+                    queue.push_back(static_cast<uint32_t>(m_Sqes[entry & m_SqMask].user_data));
+                    in_flight--;
+                }
+                std::atomic_ref<unsigned>(*m_SqTail).store(accepted, std::memory_order_release);
+                broken = true;
+            }
+
+            unsigned completed = *m_CqHead;
+            const unsigned ready = std::atomic_ref<unsigned>(*m_CqTail).load(std::memory_order_acquire);
+            for (; completed != ready; ++completed) {
+                const io_uring_cqe& cqe = m_Cqes[completed & m_CqMask];
+                const uint32_t index = static_cast<uint32_t>(cqe.user_data);
+                in_flight--;
+                if (cqe.res > 0) {
+                    done[index] += static_cast<uint32_t>(cqe.res);
+                    if (done[index] < Reads[index].Size) {
+                        queue.push_back(index);
+                    }
+                } else if (cqe.res == -EAGAIN || cqe.res == -EINTR) {
+                    queue.push_back(index);
+                } else if (cqe.res == 0 || !ReadSync(Reads.subspan(index, 1))) {
+                    // The end of the file, or an error pread shares
+                    ok = false;
+                }
+            }
+            std::atomic_ref<unsigned>(*m_CqHead).store(completed, std::memory_order_release);
+        }
+        if (broken) {
+            Teardown();
+            for (const uint32_t index : queue) {
+                const ReadRequest& read = Reads[index];
+                const ReadRequest rest = {read.Fd, read.Offset + done[index], read.Size - done[index], read.Buffer + done[index]};
+                ok = ReadSync(std::span<const ReadRequest>(&rest, 1)) && ok;
+            }
+        }
+        return ok;
+    }
+
+    void
+    Setup(
+        const unsigned Depth
+    ) {
+        io_uring_params params = {};
+        const int ring = static_cast<int>(syscall(__NR_io_uring_setup, Depth, &params));
+        if (ring < 0) {
+            return;
+        }
+        // IORING_OP_READ needs 5.6, which also added this feature flag
+        if ((params.features & IORING_FEAT_RW_CUR_POS) == 0) {
+            close(ring);
+            return;
+        }
+        m_SqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        m_CqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        const bool single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (single) {
+            m_SqRingSize = m_CqRingSize = std::max(m_SqRingSize, m_CqRingSize);
+        }
+        m_SqRing = mmap(nullptr, m_SqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQ_RING);
+        m_CqRing = single ? m_SqRing : mmap(nullptr, m_CqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_CQ_RING);
+        m_SqesSize = params.sq_entries * sizeof(io_uring_sqe);
+        void* sqes = mmap(nullptr, m_SqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQES);
+        m_Ring = ring;
+        if (m_SqRing == MAP_FAILED || m_CqRing == MAP_FAILED || sqes == MAP_FAILED) {
+            if (sqes != MAP_FAILED) {
+                munmap(sqes, m_SqesSize);
+            }
+            Teardown();
+            return;
+        }
+        uint8_t* sq = static_cast<uint8_t*>(m_SqRing);
+        uint8_t* cq = static_cast<uint8_t*>(m_CqRing);
+        m_SqHead = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        m_SqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        m_SqMask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        m_SqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        m_CqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        m_CqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        m_CqMask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        m_Cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+        m_Sqes = static_cast<io_uring_sqe*>(sqes);
+        m_Entries = params.sq_entries;
+    }
+
+    void
+    Teardown(
+        void
+    ) {
+        if (m_Sqes != nullptr) {
+            munmap(m_Sqes, m_SqesSize);
+        }
+        if (m_CqRing != MAP_FAILED && m_CqRing != m_SqRing) {
+            munmap(m_CqRing, m_CqRingSize);
+        }
+        if (m_SqRing != MAP_FAILED) {
+            munmap(m_SqRing, m_SqRingSize);
+        }
+        if (m_Ring >= 0) {
+            close(m_Ring);
+        }
+        m_Ring = -1;
+        m_SqRing = MAP_FAILED;
+        m_CqRing = MAP_FAILED;
+        m_Sqes = nullptr;
+    }
+
+    void* m_SqRing = MAP_FAILED;
+    void* m_CqRing = MAP_FAILED;
+    size_t m_SqRingSize = 0;
+    size_t m_CqRingSize = 0;
+    size_t m_SqesSize = 0;
+    unsigned* m_SqHead = nullptr;
+    unsigned* m_SqTail = nullptr;
+    unsigned m_SqMask = 0;
+    unsigned* m_SqArray = nullptr;
+    unsigned* m_CqHead = nullptr;
+    unsigned* m_CqTail = nullptr;
+    unsigned m_CqMask = 0;
+    io_uring_cqe* m_Cqes = nullptr;
+    io_uring_sqe* m_Sqes = nullptr;
+    unsigned m_Entries = 0;
+#endif
+};
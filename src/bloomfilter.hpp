@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cstdint>
+#include <span>
+
+// A blocked Bloom filter. Each key sets kBloomHashes bits inside a single
+// cache line, chosen by its hash, so a query touches one line. At
+// kBloomBitsPerKey this gives a false positive rate of about 1%.
+constexpr uint64_t kBloomBitsPerKey = 10;
+constexpr uint32_t kBloomHashes = 7;
+
+struct alignas(64) BloomBlock {
+    uint64_t Words[8];
+};
+static_assert(sizeof(BloomBlock) == 64);
+
+inline uint64_t
+BloomBlockCount(
+    const uint64_t Keys
+)
+{
+    return Keys * kBloomBitsPerKey / 512 + 1;
+}
+
+// The block comes from the high bits of Hash and the bit positions from a
+// remix of it, nine bits each
+inline void
+BloomAdd(
+    std::span<BloomBlock> Blocks,
+    const uint64_t Hash
+)
+{
+    BloomBlock& block = Blocks[static_cast<uint64_t>((static_cast<unsigned __int128>(Hash) * Blocks.size()) >> 64)];
+    uint64_t bits = Hash * 0x9e3779b97f4a7c15ull;
+    for (uint32_t i = 0; i < kBloomHashes; ++i) {
+        const uint32_t bit = bits & 511;
+        block.Words[bit >> 6] |= 1ull << (bit & 63);
+        bits >>= 9;
+    }
+}
+
+// An empty filter has nothing to rule out
+inline bool
+BloomMayContain(
+    const std::span<const BloomBlock> Blocks,
+    const uint64_t Hash
+)
+{
+    if (Blocks.empty()) {
+        return true;
+    }
+    const BloomBlock& block = Blocks[static_cast<uint64_t>((static_cast<unsigned __int128>(Hash) * Blocks.size()) >> 64)];
+    uint64_t bits = Hash * 0x9e3779b97f4a7c15ull;
+    for (uint32_t i = 0; i < kBloomHashes; ++i) {
+        const uint32_t bit = bits & 511;
+        if ((block.Words[bit >> 6] & (1ull << (bit & 63))) == 0) {
+            return false;
+        }
+        bits >>= 9;
+    }
+    return true;
+}
@@ -1,22 +1,131 @@
 
+#include <chrono>
+#include <iomanip>
+#include <string>
 #include <string_view>
+#include <vector>
 
 #include "primefactorcache.hpp"
 
+// Values looked up together in --stdin mode
+constexpr size_t kCheckBatch = 4096;
+
+// Look up one value per line of stdin, printing "<value> <factors>" for
+// hits and "<value> -" for misses, and report throughput and hit rate to
+// stderr. Returns false if any factors did not multiply out to the value.
+static bool
+CheckStream(
+    PrimeFactorCache<>& Cache
+)
+{
+    std::vector<mpz_class> values;
+    size_t queries = 0;
+    size_t hits = 0;
+    size_t mismatches = 0;
+    size_t invalid = 0;
+    const auto start = std::chrono::steady_clock::now();
+
+    auto check = [&]() {
+        const auto results = Cache.ProductExistsBatch(values);
+        for (size_t i = 0; i < values.size(); ++i) {
+            std::cout << values[i] << " ";
+            if (!results[i].has_value()) {
+                std::cout << "-\n";
+                continue;
+            }
+            hits++;
+            if (results[i]->Product() != values[i]) {
+                mismatches++;
+                std::cout << "MISMATCH " << results[i]->GetString() << "\n";
+                continue;
+            }
+            std::cout << results[i]->GetString() << "\n";
+        }
+        queries += values.size();
+        values.clear();
+    };
+
+    std::string line;
+    mpz_class value;
+    while (std::getline(std::cin, line)) {
+        if (line.empty()) {
+            continue;
+        }
+        if (value.set_str(line, 10) != 0 || value < 1) {
+            invalid++;
+            std::cerr << "Invalid value: " << line << std::endl;
+            continue;
+        }
+        values.push_back(value);
+        if (values.size() == kCheckBatch) {
+            check();
+        }
+    }
+    check();
+    std::cout << std::flush;
+
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cerr << "Checked " << queries << " values in " << std::fixed << std::setprecision(2) << seconds << "s ("
+        << std::setprecision(0) << (seconds > 0 ? queries / seconds : 0) << " per second)" << std::endl;
+    std::cerr << "Hits: " << hits << " (" << std::setprecision(2)
+        << (queries > 0 ? 100.0 * hits / queries : 0) << "%)" << std::endl;
+    if (mismatches > 0 || invalid > 0) {
+        std::cerr << "Mismatches: " << mismatches << ", invalid lines: " << invalid << std::endl;
+    }
+    return mismatches == 0;
+}
+
 int main(
     int argc,
     char* argv[]
 )
 {
-    if (argc < 3) {
-        std::cerr << "Usage: cachecheck <cache_path> value" << std::endl;
+    static const std::string_view usage =
+        "Usage: cachecheck [--cache-socket <socket>] <cache_path> value\n"
+        "       cachecheck --cache-socket <socket> value\n"
+        "       cachecheck [--cache-socket <socket>] [<cache_path>] --stdin\n"
+        "With --stdin, values are read one per line and checked in batches.";
+
+    std::string_view cache_socket;
+    bool from_stdin = false;
+    std::vector<std::string_view> positional;
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        if (arg == "--cache-socket" && i + 1 < argc) {
+            cache_socket = argv[++i];
+        } else if (arg == "--stdin") {
+            from_stdin = true;
+        } else {
+            positional.push_back(arg);
+        }
+    }
+    // The cache path may be left out when a daemon serves the cache
+    const size_t values = from_stdin ? 0 : 1;
+    if (positional.size() < values || positional.size() > values + 1 ||
+        (positional.size() == values && cache_socket.empty())) {
+        std::cerr << usage << std::endl;
         return 1;
     }
 
-    std::string_view cache_path = argv[1];
-    uint64_t value = static_cast<uint64_t>(std::stoull(argv[2]));
+    std::string_view cache_path = positional.size() > values ? positional[0] : "";
+    if (from_stdin) {
+        PrimeFactorCache cache(cache_path);
+        if (!cache_socket.empty()) {
+            cache.Connect(cache_socket);
+        }
+        return CheckStream(cache) ? 0 : 1;
+    }
+
+    mpz_class value;
+    if (value.set_str(std::string(positional.back()), 10) != 0 || value < 1) {
+        std::cerr << "Invalid value: " << positional.back() << std::endl;
+        return 1;
+    }
     
     PrimeFactorCache cache(cache_path);
+    if (!cache_socket.empty()) {
+        cache.Connect(cache_socket);
+    }
     auto result = cache.ProductExists(value);
     if (result.has_value()) {
         std::cout << "Product " << value << " exists in cache." << std::endl;
@@ -37,7 +146,7 @@ int main(
         std::cout << std::endl;
         
         // Verify the product
-        uint64_t computed_product = factors.Product64();
+        mpz_class computed_product = factors.Product();
         if (computed_product == value) {
             std::cout << "Verification: PASSED (product = " << computed_product << ")" << std::endl;
         } else {
@@ -0,0 +1,172 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <vector>
+
+#include <gmpxx.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "cacheformat.hpp"
+#include "cacheprotocol.hpp"
+#include "factors.hpp"
+
+// Writes buffered by a client before they are sent as one Insert
+constexpr size_t kCacheClientBatch = 1024;
+
+// A connection to an aliquot-cached daemon. Inserts are buffered and sent
+// in batches, and lookups see the buffered ones. Safe to share between
+// threads, which take turns on the connection.
+class CacheClient {
+public:
+    CacheClient(
+        const std::filesystem::path& SocketPath
+    ) {
+        sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+        if (SocketPath.native().size() >= sizeof(address.sun_path)) {
+            throw std::runtime_error("Cache socket path is too long: " + SocketPath.string());
+        }
+        std::memcpy(address.sun_path, SocketPath.c_str(), SocketPath.native().size());
+        m_Fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (m_Fd < 0) {
+            throw std::runtime_error("Failed to create cache socket.");
+        }
+        if (!PrepareDescriptor(m_Fd, true)) {
+            close(m_Fd);
+            m_Fd = -1;
+            throw std::runtime_error("Failed to create cache socket.");
+        }
+        if (connect(m_Fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0) {
+            close(m_Fd);
+            m_Fd = -1;
+            throw std::runtime_error("Failed to connect to cache daemon at: " + SocketPath.string());
+        }
+    }
+
+    CacheClient(
+        const CacheClient&
+    ) = delete;
+
+    CacheClient&
+    operator=(
+        const CacheClient&
+    ) = delete;
+
+    ~CacheClient() {
+        try {
+            Flush();
+        } catch (const std::exception& e) {
+            std::cerr << "Failed to send cached writes: " << e.what() << std::endl;
+        }
+        close(m_Fd);
+    }
+
+    std::vector<std::optional<PrimeFactors>>
+    Lookup(
+        const std::span<const mpz_class> Keys
+    ) {
+        std::vector<std::optional<PrimeFactors>> results(Keys.size());
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        std::vector<uint8_t> body;
+        std::vector<size_t> sent;
+        for (size_t i = 0; i < Keys.size(); ++i) {
+            auto pending = m_Pending.find(Keys[i]);
+            if (pending != m_Pending.end()) {
+                results[i] = pending->second;
+                continue;
+            }
+            AppendVarint(body, Keys[i]);
+            sent.push_back(i);
+        }
+        if (sent.empty()) {
+            return results;
+        }
+
+        SendMessage(m_Fd, CacheOp::Lookup, static_cast<uint32_t>(sent.size()), body);
+        CacheMessageHeader header;
+        if (!ReceiveMessage(m_Fd, header, body) ||
+            header.Op != static_cast<uint8_t>(CacheOp::Lookup) ||
+            header.Count != sent.size()) {
+            throw std::runtime_error("Bad lookup response from cache daemon.");
+        }
+        const uint8_t* cursor = body.data();
+        const uint8_t* end = cursor + body.size();
+        for (const size_t index : sent) {
+            if (cursor >= end) {
+                throw std::runtime_error("Bad lookup response from cache daemon.");
+            }
+            if (*cursor++ == 0) {
+                continue;
+            }
+            PrimeFactors factors;
+            if (!ReadFactorPayload(cursor, end, &factors)) {
+                throw std::runtime_error("Bad lookup response from cache daemon.");
+            }
+            results[index] = std::move(factors);
+        }
+        return results;
+    }
+
+    std::optional<PrimeFactors>
+    Lookup(
+        const mpz_class& Key
+    ) {
+        return std::move(Lookup(std::span<const mpz_class>(&Key, 1)).front());
+    }
+
+    void
+    Insert(
+        const mpz_class& Key,
+        const PrimeFactors& Factors
+    ) {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_Pending.insert_or_assign(Key, Factors);
+        if (m_Pending.size() >= kCacheClientBatch) {
+            FlushLocked();
+        }
+    }
+
+    // Send every buffered insert
+    void
+    Flush(
+        void
+    ) {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        FlushLocked();
+    }
+
+private:
+    void
+    FlushLocked(
+        void
+    ) {
+        if (m_Pending.empty()) {
+            return;
+        }
+        std::vector<uint8_t> body;
+        for (const auto& [key, factors] : m_Pending) {
+            AppendVarint(body, key);
+            AppendFactorPayload(body, factors);
+        }
+        SendMessage(m_Fd, CacheOp::Insert, static_cast<uint32_t>(m_Pending.size()), body);
+        CacheMessageHeader header;
+        if (!ReceiveMessage(m_Fd, header, body) || header.Op != static_cast<uint8_t>(CacheOp::Insert)) {
+            throw std::runtime_error("Bad insert response from cache daemon.");
+        }
+        m_Pending.clear();
+    }
+
+    int m_Fd = -1;
+    std::mutex m_Mutex;
+    std::map<mpz_class, PrimeFactors> m_Pending;
+};
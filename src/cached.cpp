@@ -0,0 +1,81 @@
+#include <csignal>
+#include <iostream>
+#include <string_view>
+#include <thread>
+
+#include <pthread.h>
+
+#include "cacheserver.hpp"
+#include "primefactorcache.hpp"
+
+static const std::string_view HELP_STRING = R"(
+Usage: aliquot-cached [options] <cache_path> <socket_path>
+Serves the cache at <cache_path> to aliquot, cachecheck and factorgen
+processes started with --cache-socket <socket_path>.
+Options:
+    -m <MiB>    Memory for recently used factorizations
+    -h, --help  Show this help message
+)";
+
+int main(
+    int argc,
+    char* argv[]
+)
+{
+    std::string_view cache_path;
+    std::string_view socket_path;
+    size_t hot_bytes = 0;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        if (arg == "-m" && i + 1 < argc) {
+            hot_bytes = static_cast<size_t>(std::stoull(argv[++i])) << 20;
+        } else if (arg == "-h" || arg == "--help") {
+            std::cout << HELP_STRING << std::endl;
+            return 0;
+        } else if (cache_path.empty()) {
+            cache_path = arg;
+        } else {
+            socket_path = arg;
+        }
+    }
+
+    if (cache_path.empty() || socket_path.empty()) {
+        std::cerr << HELP_STRING << std::endl;
+        return 1;
+    }
+
+    // Block the shutdown signals before any thread starts so that only the
+    // waiter below receives them
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+    try {
+        // Keep every segment in memory so lookups never touch the disk
+        PrimeFactorCache cache(cache_path, true);
+        if (hot_bytes > 0) {
+            cache.GetHotCache().SetBudget(hot_bytes);
+        }
+        CacheServer server(cache, socket_path);
+
+        std::thread waiter([&server, &signals]() {
+            int signal = 0;
+            sigwait(&signals, &signal);
+            server.Stop();
+        });
+        waiter.detach();
+
+        std::cerr << "Serving " << cache_path << " on " << socket_path << std::endl;
+        server.Run();
+        cache.Close();
+        std::cerr << "Cache closed." << std::endl;
+    } catch (const std::exception& ex) {
+        std::cerr << "Cache daemon failed: " << ex.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,1009 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <queue>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gmpxx.h>
+#include <unistd.h>
+
+#include "asyncreader.hpp"
+#include "bloomfilter.hpp"
+#include "cachestats.hpp"
+#include "factors.hpp"
+#include "mappedfile.hpp"
+
+// Version 2 cache segments are one or more files of variable width
+// records. A segment's keys are spread over its files by a hash of the
+// whole key (see ShardOfHash), and each file is sorted by key. Records are
+// packed into blocks of about kCacheBlockSize bytes. Each
+// block starts with a full key and the rest of its keys are deltas from
+// the previous one. After the blocks comes a fence index holding the
+// offset and first key of every block, which is loaded into memory so a
+// lookup decodes exactly one block.
+//
+// A blocked Bloom filter over the keys follows the fence index, so most
+// misses are answered without touching the blocks at all. Files written
+// before it have FilterBlocks of 0 and no filter.
+//
+// Record: varint key delta, varint number of distinct primes, then a
+// varint prime and a varint exponent for each. Exponents below 128 and
+// primes below 2^7k take one and k bytes.
+constexpr char kCacheFileMagic[8] = {'A', 'L', 'Q', 'C', 'A', 'C', 'H', '2'};
+constexpr uint32_t kCacheFileVersion = 2;
+constexpr uint32_t kCacheBlockSize = 256;
+constexpr const char* kCacheFileName = "segment.v2";
+// Files per segment unless the cache is told otherwise
+constexpr size_t kDefaultCacheShards = 8;
+
+struct CacheFileHeader {
+    char Magic[8];
+    uint32_t Version;
+    uint32_t BlockSize;
+    uint64_t Records;
+    uint64_t Blocks;
+    uint64_t FenceOffset;
+    uint64_t FenceSize;
+    uint64_t FilterOffset;
+    uint64_t FilterBlocks;
+};
+static_assert(sizeof(CacheFileHeader) == 64);
+
+// 64 bit finaliser from MurmurHash3, a bijection that mixes every bit
+inline uint64_t
+MixHash(
+    uint64_t Value
+)
+{
+    Value ^= Value >> 33;
+    Value *= 0xff51afd7ed558ccdull;
+    Value ^= Value >> 33;
+    Value *= 0xc4ceb9fe1a85ec53ull;
+    Value ^= Value >> 33;
+    return Value;
+}
+
+// Hash of a key's limbs. Keys that fit a word hash the same whether they
+// are given as a word or an mpz.
+inline uint64_t
+HashKey(
+    const uint64_t Key,
+    const uint64_t Seed = 0
+)
+{
+    return MixHash(Seed ^ MixHash(Key));
+}
+
+inline uint64_t
+HashKey(
+    const mpz_class& Key,
+    const uint64_t Seed = 0
+)
+{
+    const size_t limbs = mpz_size(Key.get_mpz_t());
+    if (limbs <= 1) {
+        return HashKey(static_cast<uint64_t>(Key.get_ui()), Seed);
+    }
+    uint64_t hash = Seed;
+    for (size_t i = 0; i < limbs; ++i) {
+        hash = MixHash(hash ^ MixHash(mpz_getlimbn(Key.get_mpz_t(), i) + i));
+    }
+    return hash;
+}
+
+// Map a hash uniformly onto [0, Range) without a division
+inline uint64_t
+ReduceHash(
+    const uint64_t Hash,
+    const uint64_t Range
+)
+{
+    return static_cast<uint64_t>((static_cast<unsigned __int128>(Hash) * Range) >> 64);
+}
+
+// The shard a key belongs to. The hash is remixed first because the Bloom
+// filter inside each file picks its block from the high bits of the plain
+// hash, and a shard only ever sees a narrow range of those.
+inline size_t
+ShardOfHash(
+    const uint64_t Hash,
+    const size_t Shards
+)
+{
+    return ReduceHash(MixHash(Hash ^ 0x9e3779b97f4a7c15ull), Shards);
+}
+
+// A segment of a single shard keeps the name it had before sharding
+inline std::string
+CacheFileName(
+    const size_t Shard,
+    const size_t Shards
+)
+{
+    if (Shards == 1) {
+        return kCacheFileName;
+    }
+    return "segment-" + std::to_string(Shard) + "-of-" + std::to_string(Shards) + ".v2";
+}
+
+// Call Work(shard) for every shard, spread over up to one thread per
+// core. Throws the first exception any call threw once all have finished.
+template <typename Work>
+void
+ForEachShard(
+    const size_t Shards,
+    Work&& Fn
+)
+{
+    const size_t num_threads = std::min<size_t>(Shards, std::max(1u, std::thread::hardware_concurrency()));
+    if (num_threads <= 1) {
+        for (size_t shard = 0; shard < Shards; ++shard) {
+            Fn(shard);
+        }
+        return;
+    }
+    std::atomic<size_t> next = 0;
+    std::mutex failure_mutex;
+    std::exception_ptr failure;
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < num_threads; ++t) {
+        threads.emplace_back([&]() {
+            for (size_t shard = next++; shard < Shards; shard = next++) {
+                try {
+                    Fn(shard);
+                } catch (...) {
+                    std::lock_guard<std::mutex> lock(failure_mutex);
+                    if (!failure) {
+                        failure = std::current_exception();
+                    }
+                }
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    if (failure) {
+        std::rethrow_exception(failure);
+    }
+}
+
+inline void
+AppendVarint(
+    std::vector<uint8_t>& Output,
+    uint64_t Value
+)
+{
+    while (Value >= 0x80) {
+        Output.push_back(static_cast<uint8_t>(Value | 0x80));
+        Value >>= 7;
+    }
+    Output.push_back(static_cast<uint8_t>(Value));
+}
+
+inline void
+AppendVarint(
+    std::vector<uint8_t>& Output,
+    const mpz_class& Value
+)
+{
+    if (mpz_fits_ulong_p(Value.get_mpz_t())) {
+        AppendVarint(Output, static_cast<uint64_t>(Value.get_ui()));
+        return;
+    }
+    mpz_class remaining = Value;
+    while (remaining >= 0x80) {
+        const uint64_t low = mpz_getlimbn(remaining.get_mpz_t(), 0) & 0x7F;
+        Output.push_back(static_cast<uint8_t>(low | 0x80));
+        mpz_tdiv_q_2exp(remaining.get_mpz_t(), remaining.get_mpz_t(), 7);
+    }
+    Output.push_back(static_cast<uint8_t>(remaining.get_ui()));
+}
+
+// Reads return false on a truncated or malformed varint
+inline bool
+ReadVarint(
+    const uint8_t*& Cursor,
+    const uint8_t* End,
+    uint64_t& Value
+)
+{
+    Value = 0;
+    for (uint32_t shift = 0; Cursor < End && shift < 64; shift += 7) {
+        const uint8_t byte = *Cursor++;
+        if (shift == 63 && byte > 1) {
+            // Does not fit in 64 bits
+            return false;
+        }
+        Value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+inline bool
+ReadVarint(
+    const uint8_t*& Cursor,
+    const uint8_t* End,
+    mpz_class& Value
+)
+{
+    // Nearly every value fits a machine word
+    uint64_t small = 0;
+    const uint8_t* start = Cursor;
+    for (uint32_t shift = 0; Cursor < End && shift < 63; shift += 7) {
+        const uint8_t byte = *Cursor++;
+        small |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0) {
+            Value = static_cast<unsigned long>(small);
+            return true;
+        }
+    }
+    Cursor = start;
+    Value = 0;
+    mpz_class part;
+    for (uint32_t shift = 0; Cursor < End; shift += 7) {
+        const uint8_t byte = *Cursor++;
+        part = byte & 0x7F;
+        mpz_mul_2exp(part.get_mpz_t(), part.get_mpz_t(), shift);
+        Value += part;
+        if ((byte & 0x80) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Encode the part of a record that follows its key
+inline void
+AppendFactorPayload(
+    std::vector<uint8_t>& Output,
+    const PrimeFactors& Factors
+)
+{
+    AppendVarint(Output, static_cast<uint64_t>(Factors.Size()));
+    for (const auto& [prime, count] : Factors.ToVector()) {
+        AppendVarint(Output, prime);
+        AppendVarint(Output, static_cast<uint64_t>(count));
+    }
+}
+
+// Skip over a payload, or decode it into Factors when it is given
+inline bool
+ReadFactorPayload(
+    const uint8_t*& Cursor,
+    const uint8_t* End,
+    PrimeFactors* Factors
+)
+{
+    uint64_t num_factors = 0;
+    if (!ReadVarint(Cursor, End, num_factors)) {
+        return false;
+    }
+    mpz_class prime;
+    uint64_t count = 0;
+    for (uint64_t i = 0; i < num_factors; ++i) {
+        if (Factors == nullptr) {
+            while (Cursor < End && (*Cursor & 0x80) != 0) {
+                Cursor++;
+            }
+            Cursor++;
+        } else if (!ReadVarint(Cursor, End, prime)) {
+            return false;
+        }
+        if (!ReadVarint(Cursor, End, count)) {
+            return false;
+        }
+        if (Factors != nullptr) {
+            for (uint64_t j = 0; j < count; ++j) {
+                Factors->AddFactor(prime);
+            }
+        }
+    }
+    return Cursor <= End;
+}
+
+// Sorted records from one source, used to merge segments
+class RecordCursor {
+public:
+    virtual ~RecordCursor() = default;
+
+    virtual bool
+    Valid(
+        void
+    ) const = 0;
+
+    virtual const mpz_class&
+    Key(
+        void
+    ) const = 0;
+
+    // The encoded payload of the current record
+    virtual std::span<const uint8_t>
+    Payload(
+        void
+    ) const = 0;
+
+    virtual void
+    Next(
+        void
+    ) = 0;
+};
+
+class CacheFileWriter {
+public:
+    CacheFileWriter(
+        const std::filesystem::path& Path,
+        const uint32_t BlockSize = kCacheBlockSize
+    ) : m_Path(Path), m_BlockSize(BlockSize) {
+        m_File = fopen(m_Path.c_str(), "wb");
+        if (m_File == nullptr) {
+            throw std::runtime_error("Failed to open cache file for writing: " + m_Path.string());
+        }
+        // Reserve the header, it is written once the fences are known
+        CacheFileHeader header = {};
+        Write(&header, sizeof(header));
+    }
+
+    CacheFileWriter(
+        const CacheFileWriter&
+    ) = delete;
+
+    CacheFileWriter&
+    operator=(
+        const CacheFileWriter&
+    ) = delete;
+
+    ~CacheFileWriter() {
+        if (m_File != nullptr) {
+            fclose(m_File);
+        }
+    }
+
+    // Keys must be strictly increasing, a key out of order would be delta
+    // coded wrongly so it throws instead
+    void
+    Add(
+        const mpz_class& Key,
+        const std::span<const uint8_t> Payload
+    ) {
+        if (m_Records > 0 && Key <= m_PreviousKey) {
+            throw std::runtime_error("Cache file keys out of order in " + m_Path.string() + ": " +
+                Key.get_str() + " after " + m_PreviousKey.get_str());
+        }
+        m_Record.clear();
+        if (!m_Block.empty()) {
+            m_Delta = Key - m_PreviousKey;
+            AppendVarint(m_Record, m_Delta);
+            if (m_Block.size() + m_Record.size() + Payload.size() > m_BlockSize) {
+                FlushBlock();
+                m_Record.clear();
+            }
+        }
+        if (m_Block.empty()) {
+            AppendVarint(m_Fences, m_Offset - m_PreviousBlock);
+            AppendVarint(m_Fences, Key);
+            m_PreviousBlock = m_Offset;
+            m_Blocks++;
+            AppendVarint(m_Record, Key);
+        }
+        m_Block.insert(m_Block.end(), m_Record.begin(), m_Record.end());
+        m_Block.insert(m_Block.end(), Payload.begin(), Payload.end());
+        m_PreviousKey = Key;
+        m_Records++;
+        m_Hashes.push_back(HashKey(Key));
+    }
+
+    void
+    Add(
+        const mpz_class& Key,
+        const PrimeFactors& Factors
+    ) {
+        m_Payload.clear();
+        AppendFactorPayload(m_Payload, Factors);
+        Add(Key, m_Payload);
+    }
+
+    uint64_t
+    Records(
+        void
+    ) const {
+        return m_Records;
+    }
+
+    void
+    Finish(
+        void
+    ) {
+        FlushBlock();
+        CacheFileHeader header = {};
+        std::memcpy(header.Magic, kCacheFileMagic, sizeof(header.Magic));
+        header.Version = kCacheFileVersion;
+        header.BlockSize = m_BlockSize;
+        header.Records = m_Records;
+        header.Blocks = m_Blocks;
+        header.FenceOffset = m_Offset;
+        header.FenceSize = m_Fences.size();
+        Write(m_Fences.data(), m_Fences.size());
+
+        // The filter starts on a cache line
+        std::vector<BloomBlock> filter(BloomBlockCount(m_Records));
+        std::memset(filter.data(), 0, filter.size() * sizeof(BloomBlock));
+        for (const uint64_t hash : m_Hashes) {
+            BloomAdd(filter, hash);
+        }
+        const std::vector<uint8_t> padding((64 - m_Offset % 64) % 64, 0);
+        Write(padding.data(), padding.size());
+        header.FilterOffset = m_Offset;
+        header.FilterBlocks = filter.size();
+        Write(filter.data(), filter.size() * sizeof(BloomBlock));
+
+        if (fseek(m_File, 0, SEEK_SET) != 0) {
+            throw std::runtime_error("Failed to write cache file header: " + m_Path.string());
+        }
+        Write(&header, sizeof(header));
+        // The file must be on disk before a manifest can point at it
+        const bool synced = fflush(m_File) == 0 && fsync(fileno(m_File)) == 0;
+        const bool closed = fclose(m_File) == 0;
+        m_File = nullptr;
+        if (!synced || !closed) {
+            throw std::runtime_error("Failed to write cache file: " + m_Path.string());
+        }
+    }
+
+private:
+    void
+    Write(
+        const void* Data,
+        const size_t Size
+    ) {
+        if (Size > 0 && fwrite(Data, Size, 1, m_File) != 1) {
+            throw std::runtime_error("Failed to write cache file: " + m_Path.string());
+        }
+        m_Offset += Size;
+    }
+
+    void
+    FlushBlock(
+        void
+    ) {
+        Write(m_Block.data(), m_Block.size());
+        m_Block.clear();
+    }
+
+    std::filesystem::path m_Path;
+    uint32_t m_BlockSize;
+    FILE* m_File = nullptr;
+    uint64_t m_Offset = 0;
+    uint64_t m_PreviousBlock = 0;
+    uint64_t m_Records = 0;
+    uint64_t m_Blocks = 0;
+    mpz_class m_PreviousKey;
+    mpz_class m_Delta;
+    std::vector<uint8_t> m_Block;
+    std::vector<uint8_t> m_Record;
+    std::vector<uint8_t> m_Payload;
+    std::vector<uint8_t> m_Fences;
+    std::vector<uint64_t> m_Hashes;
+};
+
+// A mapped version 2 segment file
+class CacheFile {
+public:
+    bool
+    Open(
+        const std::filesystem::path& Path,
+        const bool Resident = false
+    ) {
+        m_BlockOffsets.clear();
+        m_FenceKeys.clear();
+        m_FenceWords.clear();
+        m_Filter = {};
+        m_Resident = Resident;
+        if (!m_Map.Open(Path, Resident)) {
+            return false;
+        }
+        if (Resident) {
+            m_Map.Lock();
+        }
+        const auto data = m_Map.Data();
+        if (data.size() < sizeof(CacheFileHeader)) {
+            throw std::runtime_error("Cache file is truncated: " + Path.string());
+        }
+        std::memcpy(&m_Header, data.data(), sizeof(m_Header));
+        if (std::memcmp(m_Header.Magic, kCacheFileMagic, sizeof(kCacheFileMagic)) != 0 ||
+            m_Header.Version != kCacheFileVersion ||
+            m_Header.FenceOffset + m_Header.FenceSize > data.size() ||
+            m_Header.FilterOffset % 64 != 0 ||
+            m_Header.FilterOffset + m_Header.FilterBlocks * sizeof(BloomBlock) > data.size()) {
+            throw std::runtime_error("Unsupported cache file: " + Path.string());
+        }
+        m_Filter = std::span<const BloomBlock>(reinterpret_cast<const BloomBlock*>(data.data() + m_Header.FilterOffset), m_Header.FilterBlocks);
+
+        const uint8_t* cursor = data.data() + m_Header.FenceOffset;
+        const uint8_t* end = cursor + m_Header.FenceSize;
+        m_BlockOffsets.reserve(m_Header.Blocks);
+        m_FenceKeys.resize(m_Header.Blocks);
+        uint64_t offset = 0;
+        for (uint64_t i = 0; i < m_Header.Blocks; ++i) {
+            uint64_t delta = 0;
+            if (!ReadVarint(cursor, end, delta) || !ReadVarint(cursor, end, m_FenceKeys[i])) {
+                throw std::runtime_error("Corrupt fence index in cache file: " + Path.string());
+            }
+            offset += delta;
+            m_BlockOffsets.push_back(offset);
+            if (mpz_fits_ulong_p(m_FenceKeys[i].get_mpz_t())) {
+                m_FenceWords.push_back(m_FenceKeys[i].get_ui());
+            }
+        }
+        return true;
+    }
+
+    uint64_t
+    Records(
+        void
+    ) const {
+        return m_Header.Records;
+    }
+
+    size_t
+    Size(
+        void
+    ) const {
+        return m_Map.Size();
+    }
+
+    // Whether the file was opened to be kept in memory
+    bool
+    IsResident(
+        void
+    ) const {
+        return m_Resident;
+    }
+
+    std::optional<PrimeFactors>
+    Find(
+        const mpz_class& Key
+    ) const {
+        return Find(Key, HashKey(Key));
+    }
+
+    // Hash is HashKey(Key), for callers that already have it
+    std::optional<PrimeFactors>
+    Find(
+        const mpz_class& Key,
+        const uint64_t Hash
+    ) const {
+        if (!BloomMayContain(m_Filter, Hash)) {
+            return std::nullopt;
+        }
+        if (mpz_fits_ulong_p(Key.get_mpz_t())) {
+            return FindSmall(Key.get_ui());
+        }
+
+        // The last block whose first key is <= Key
+        auto fence = std::upper_bound(m_FenceKeys.begin(), m_FenceKeys.end(), Key);
+        if (fence == m_FenceKeys.begin()) {
+            return std::nullopt;
+        }
+        const size_t block = (fence - m_FenceKeys.begin()) - 1;
+        const uint8_t* start = m_Map.Data().data() + m_BlockOffsets[block];
+        ThreadBytesRead() += BlockBytes(block);
+        return FindInBlock(std::span<const uint8_t>(start, BlockEnd(block)), Key);
+    }
+
+    // Search the records of one block, which may be a copy of it
+    static std::optional<PrimeFactors>
+    FindInBlock(
+        const std::span<const uint8_t> Block,
+        const mpz_class& Key
+    ) {
+        const uint8_t* cursor = Block.data();
+        const uint8_t* end = cursor + Block.size();
+        mpz_class key;
+        mpz_class delta;
+        while (cursor < end) {
+            if (!ReadVarint(cursor, end, delta)) {
+                return std::nullopt;
+            }
+            key += delta;
+            if (key == Key) {
+                PrimeFactors factors;
+                if (!ReadFactorPayload(cursor, end, &factors)) {
+                    return std::nullopt;
+                }
+                return factors;
+            }
+            if (key > Key || !ReadFactorPayload(cursor, end, nullptr)) {
+                return std::nullopt;
+            }
+        }
+        return std::nullopt;
+    }
+
+    // For batched lookups that read blocks themselves: set Blocks[i] to
+    // the block that would hold *Keys[i], or kNoBlock if the filter or the
+    // fences rule the key out. Keys must be in increasing order.
+    static constexpr size_t kNoBlock = SIZE_MAX;
+
+    void
+    LocateSorted(
+        const std::span<const mpz_class* const> Keys,
+        const std::span<const uint64_t> Hashes,
+        std::vector<size_t>& Blocks
+    ) const {
+        Blocks.assign(Keys.size(), kNoBlock);
+        auto first = m_FenceKeys.begin();
+        for (size_t i = 0; i < Keys.size(); ++i) {
+            if (!BloomMayContain(m_Filter, Hashes[i])) {
+                continue;
+            }
+            const auto fence = std::upper_bound(first, m_FenceKeys.end(), *Keys[i]);
+            if (fence == m_FenceKeys.begin()) {
+                continue;
+            }
+            first = fence - 1;
+            Blocks[i] = first - m_FenceKeys.begin();
+        }
+    }
+
+    // The read that copies Block into Buffer, which must hold
+    // BlockBytes(Block) bytes
+    ReadRequest
+    BlockRead(
+        const size_t Block,
+        uint8_t* Buffer
+    ) const {
+        return ReadRequest{m_Map.Fd(), m_BlockOffsets[Block], BlockBytes(Block), Buffer};
+    }
+
+    uint32_t
+    BlockBytes(
+        const size_t Block
+    ) const {
+        return static_cast<uint32_t>(BlockEnd(Block) - (m_Map.Data().data() + m_BlockOffsets[Block]));
+    }
+
+    // Look up Keys, which must be in increasing order, in one forward
+    // pass over the file that decodes each block at most once. Hashes[i]
+    // is HashKey(*Keys[i]). Calls Found(i, factors) for each key present.
+    template <typename Visitor>
+    void
+    FindSorted(
+        const std::span<const mpz_class* const> Keys,
+        const std::span<const uint64_t> Hashes,
+        Visitor&& Found
+    ) const {
+        size_t block = m_FenceKeys.size();
+        const uint8_t* cursor = nullptr;
+        const uint8_t* end = nullptr;
+        const uint8_t* payload = nullptr;
+        mpz_class key;
+        mpz_class delta;
+        // Whether key and payload hold a decoded record
+        bool loaded = false;
+        for (size_t i = 0; i < Keys.size(); ++i) {
+            if (!BloomMayContain(m_Filter, Hashes[i])) {
+                continue;
+            }
+            const mpz_class& target = *Keys[i];
+            // The last block whose first key is <= target, which is never
+            // before the current one
+            const auto first = m_FenceKeys.begin() + (block < m_FenceKeys.size() ? block : 0);
+            const auto fence = std::upper_bound(first, m_FenceKeys.end(), target);
+            if (fence == m_FenceKeys.begin()) {
+                continue;
+            }
+            const size_t next = (fence - m_FenceKeys.begin()) - 1;
+            if (next != block) {
+                block = next;
+                cursor = m_Map.Data().data() + m_BlockOffsets[block];
+                end = BlockEnd(block);
+                ThreadBytesRead() += BlockBytes(block);
+                key = 0;
+                loaded = false;
+            }
+            while ((!loaded || key < target) && cursor < end) {
+                if (!ReadVarint(cursor, end, delta)) {
+                    cursor = end;
+                    break;
+                }
+                key += delta;
+                payload = cursor;
+                loaded = ReadFactorPayload(cursor, end, nullptr);
+                if (!loaded) {
+                    cursor = end;
+                }
+            }
+            if (loaded && key == target) {
+                const uint8_t* record = payload;
+                PrimeFactors factors;
+                if (ReadFactorPayload(record, end, &factors)) {
+                    Found(i, std::move(factors));
+                }
+            }
+        }
+    }
+
+    class Cursor : public RecordCursor {
+    public:
+        Cursor(
+            const CacheFile& File
+        ) : m_File(File) {
+            Load();
+        }
+
+        bool
+        Valid(
+            void
+        ) const override {
+            return m_Block < m_File.m_BlockOffsets.size();
+        }
+
+        const mpz_class&
+        Key(
+            void
+        ) const override {
+            return m_Key;
+        }
+
+        std::span<const uint8_t>
+        Payload(
+            void
+        ) const override {
+            return m_Payload;
+        }
+
+        void
+        Next(
+            void
+        ) override {
+            if (m_Cursor >= m_End) {
+                m_Block++;
+                m_Key = 0;
+                if (!Valid()) {
+                    return;
+                }
+                m_Cursor = m_File.m_Map.Data().data() + m_File.m_BlockOffsets[m_Block];
+                m_End = m_File.BlockEnd(m_Block);
+            }
+            Load();
+        }
+
+    private:
+        void
+        Load(
+            void
+        ) {
+            if (m_Cursor == nullptr) {
+                if (!Valid()) {
+                    return;
+                }
+                m_Cursor = m_File.m_Map.Data().data() + m_File.m_BlockOffsets[0];
+                m_End = m_File.BlockEnd(0);
+            }
+            if (!ReadVarint(m_Cursor, m_End, m_Delta)) {
+                throw std::runtime_error("Corrupt record in cache file.");
+            }
+            const uint8_t* payload = m_Cursor;
+            if (!ReadFactorPayload(m_Cursor, m_End, nullptr)) {
+                throw std::runtime_error("Corrupt record in cache file.");
+            }
+            m_Key += m_Delta;
+            m_Payload = std::span<const uint8_t>(payload, m_Cursor);
+        }
+
+        const CacheFile& m_File;
+        size_t m_Block = 0;
+        const uint8_t* m_Cursor = nullptr;
+        const uint8_t* m_End = nullptr;
+        mpz_class m_Key;
+        mpz_class m_Delta;
+        std::span<const uint8_t> m_Payload;
+    };
+
+private:
+    // Search in machine words. Small keys sort first so their fences are a
+    // prefix of the fence index and every key up to Key fits.
+    std::optional<PrimeFactors>
+    FindSmall(
+        const uint64_t Key
+    ) const {
+        auto fence = std::upper_bound(m_FenceWords.begin(), m_FenceWords.end(), Key);
+        if (fence == m_FenceWords.begin()) {
+            return std::nullopt;
+        }
+        const size_t block = (fence - m_FenceWords.begin()) - 1;
+        const uint8_t* Cursor = m_Map.Data().data() + m_BlockOffsets[block];
+        const uint8_t* End = BlockEnd(block);
+        ThreadBytesRead() += BlockBytes(block);
+
+        uint64_t key = 0;
+        uint64_t delta = 0;
+        while (Cursor < End) {
+            if (!ReadVarint(Cursor, End, delta) || __builtin_add_overflow(key, delta, &key) || key > Key) {
+                return std::nullopt;
+            }
+            if (key == Key) {
+                PrimeFactors factors;
+                if (!ReadFactorPayload(Cursor, End, &factors)) {
+                    return std::nullopt;
+                }
+                return factors;
+            }
+            if (!ReadFactorPayload(Cursor, End, nullptr)) {
+                return std::nullopt;
+            }
+        }
+        return std::nullopt;
+    }
+
+    const uint8_t*
+    BlockEnd(
+        const size_t Block
+    ) const {
+        const uint64_t end = Block + 1 < m_BlockOffsets.size() ? m_BlockOffsets[Block + 1] : m_Header.FenceOffset;
+        return m_Map.Data().data() + end;
+    }
+
+    MappedFile m_Map;
+    bool m_Resident = false;
+    CacheFileHeader m_Header = {};
+    std::vector<uint64_t> m_BlockOffsets;
+    std::vector<mpz_class> m_FenceKeys;
+    std::vector<uint64_t> m_FenceWords;
+    std::span<const BloomBlock> m_Filter;
+};
+
+// Writes one segment as Shards files in Dir, sending each key to the file
+// of its shard. Keys must be strictly increasing.
+class ShardedCacheWriter {
+public:
+    ShardedCacheWriter(
+        const std::filesystem::path& Dir,
+        const size_t Shards = kDefaultCacheShards
+    ) {
+        if (Shards == 0) {
+            throw std::invalid_argument("A cache segment needs at least one shard.");
+        }
+        for (size_t i = 0; i < Shards; ++i) {
+            m_Writers.push_back(std::make_unique<CacheFileWriter>(Dir / CacheFileName(i, Shards)));
+        }
+    }
+
+    size_t
+    Shards(
+        void
+    ) const {
+        return m_Writers.size();
+    }
+
+    // Write to one shard directly, for merges that are already split
+    CacheFileWriter&
+    Shard(
+        const size_t Index
+    ) {
+        return *m_Writers[Index];
+    }
+
+    void
+    Add(
+        const mpz_class& Key,
+        const std::span<const uint8_t> Payload
+    ) {
+        m_Writers[ShardOfHash(HashKey(Key), m_Writers.size())]->Add(Key, Payload);
+    }
+
+    void
+    Add(
+        const mpz_class& Key,
+        const PrimeFactors& Factors
+    ) {
+        m_Writers[ShardOfHash(HashKey(Key), m_Writers.size())]->Add(Key, Factors);
+    }
+
+    uint64_t
+    Records(
+        void
+    ) const {
+        uint64_t records = 0;
+        for (const auto& writer : m_Writers) {
+            records += writer->Records();
+        }
+        return records;
+    }
+
+    // Shards build their filters and sync in parallel
+    void
+    Finish(
+        void
+    ) {
+        ForEachShard(m_Writers.size(), [this](const size_t Shard) {
+            m_Writers[Shard]->Finish();
+        });
+    }
+
+private:
+    std::vector<std::unique_ptr<CacheFileWriter>> m_Writers;
+};
+
+// Beyond this many inputs a merge keeps them in a heap rather than
+// scanning them all for every record
+constexpr size_t kMergeScanInputs = 8;
+
+// Merge sorted cursors, ordered newest first, into Writer. Only the newest
+// copy of a key is written. Writer is anything with the Add(Key, Payload)
+// of CacheFileWriter.
+template <typename Sink>
+uint64_t
+MergeCursors(
+    const std::vector<RecordCursor*>& Inputs,
+    Sink& Writer
+)
+{
+    uint64_t written = 0;
+    mpz_class key;
+    if (Inputs.size() > kMergeScanInputs) {
+        // Smallest key on top, and the newest input among equal keys
+        auto later = [&Inputs](const size_t A, const size_t B) {
+            const int order = cmp(Inputs[A]->Key(), Inputs[B]->Key());
+            return order > 0 || (order == 0 && A > B);
+        };
+        std::priority_queue<size_t, std::vector<size_t>, decltype(later)> heap(later);
+        for (size_t i = 0; i < Inputs.size(); ++i) {
+            if (Inputs[i]->Valid()) {
+                heap.push(i);
+            }
+        }
+        while (!heap.empty()) {
+            const size_t newest = heap.top();
+            key = Inputs[newest]->Key();
+            Writer.Add(key, Inputs[newest]->Payload());
+            written++;
+            while (!heap.empty() && Inputs[heap.top()]->Key() == key) {
+                const size_t input = heap.top();
+                heap.pop();
+                Inputs[input]->Next();
+                if (Inputs[input]->Valid()) {
+                    heap.push(input);
+                }
+            }
+        }
+        return written;
+    }
+    while (true) {
+        RecordCursor* smallest = nullptr;
+        for (RecordCursor* input : Inputs) {
+            if (input->Valid() && (smallest == nullptr || input->Key() < smallest->Key())) {
+                smallest = input;
+            }
+        }
+        if (smallest == nullptr) {
+            break;
+        }
+        key = smallest->Key();
+        Writer.Add(key, smallest->Payload());
+        written++;
+        for (RecordCursor* input : Inputs) {
+            while (input->Valid() && input->Key() == key) {
+                input->Next();
+            }
+        }
+    }
+    return written;
+}
@@ -0,0 +1,134 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+// The live segments of a cache directory, kept in a small text file named
+// kManifestName in the cache root:
+//
+//     ALQMANIFEST 1
+//     generation 12
+//     next 9
+//     base base-11
+//     run 0 7
+//     run 8 8
+//
+// Segments never change once written. A writer publishes a new version by
+// writing the whole manifest under a temporary name and renaming it over
+// the old one, so readers always see a complete manifest without locking.
+constexpr const char* kManifestName = "CURRENT";
+constexpr const char* kManifestMagic = "ALQMANIFEST";
+constexpr uint32_t kManifestVersion = 1;
+
+// Make renames into Dir durable
+inline void
+SyncDirectory(
+    const std::filesystem::path& Dir
+)
+{
+    const int fd = open(Dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+struct CacheManifest {
+    struct Run {
+        size_t First = 0;
+        size_t Last = 0;
+    };
+
+    // Bumped by every publish
+    uint64_t Generation = 0;
+    // Number of the next flushed run
+    size_t NextRun = 0;
+    // Directory of the base segment, relative to the cache root. "." is
+    // the root itself, where caches from before base directories keep it.
+    std::string Base = ".";
+    // Oldest first
+    std::vector<Run> Runs;
+
+    // Returns nothing if the cache has no manifest yet
+    static std::optional<CacheManifest>
+    Read(
+        const std::filesystem::path& Dir
+    ) {
+        std::ifstream file(Dir / kManifestName);
+        if (!file.is_open()) {
+            return std::nullopt;
+        }
+        CacheManifest manifest;
+        std::string magic;
+        uint32_t version = 0;
+        if (!(file >> magic >> version) || magic != kManifestMagic || version != kManifestVersion) {
+            throw std::runtime_error("Unsupported cache manifest: " + (Dir / kManifestName).string());
+        }
+        std::string line;
+        while (std::getline(file, line)) {
+            std::istringstream fields(line);
+            std::string key;
+            if (!(fields >> key)) {
+                continue;
+            }
+            bool valid = true;
+            if (key == "generation") {
+                valid = static_cast<bool>(fields >> manifest.Generation);
+            } else if (key == "next") {
+                valid = static_cast<bool>(fields >> manifest.NextRun);
+            } else if (key == "base") {
+                valid = static_cast<bool>(fields >> manifest.Base);
+            } else if (key == "run") {
+                Run run;
+                valid = static_cast<bool>(fields >> run.First >> run.Last);
+                manifest.Runs.push_back(run);
+            }
+            if (!valid) {
+                throw std::runtime_error("Corrupt cache manifest: " + (Dir / kManifestName).string());
+            }
+        }
+        return manifest;
+    }
+
+    // Only one process may write at a time, callers hold the cache's
+    // writer lock
+    void
+    Write(
+        const std::filesystem::path& Dir
+    ) const {
+        std::ostringstream text;
+        text << kManifestMagic << " " << kManifestVersion << "\n";
+        text << "generation " << Generation << "\n";
+        text << "next " << NextRun << "\n";
+        text << "base " << Base << "\n";
+        for (const Run& run : Runs) {
+            text << "run " << run.First << " " << run.Last << "\n";
+        }
+        const std::string data = text.str();
+
+        const std::filesystem::path path = Dir / kManifestName;
+        std::filesystem::path temp = path;
+        temp += ".tmp";
+        const int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            throw std::runtime_error("Failed to write cache manifest: " + temp.string());
+        }
+        const bool written = write(fd, data.data(), data.size()) == static_cast<ssize_t>(data.size()) && fsync(fd) == 0;
+        close(fd);
+        if (!written) {
+            throw std::runtime_error("Failed to write cache manifest: " + temp.string());
+        }
+        std::filesystem::rename(temp, path);
+        SyncDirectory(Dir);
+    }
+};
@@ -0,0 +1,53 @@
+#include <filesystem>
+#include <iostream>
+#include <string_view>
+
+#include "primefactorcache.hpp"
+
+static uintmax_t
+DirectorySize(
+    const std::filesystem::path& Path
+)
+{
+    uintmax_t size = 0;
+    std::error_code error;
+    for (const auto& entry : std::filesystem::recursive_directory_iterator(Path, error)) {
+        if (entry.is_regular_file(error)) {
+            size += entry.file_size(error);
+        }
+    }
+    return size;
+}
+
+int main(
+    int argc,
+    char* argv[]
+)
+{
+    if (argc < 2) {
+        std::cerr << "Usage: cachemigrate <cache_path>" << std::endl;
+        std::cerr << "Rewrites a cache in the version 2 segment format." << std::endl;
+        return 1;
+    }
+
+    std::string_view cache_path = argv[1];
+    if (!std::filesystem::exists(cache_path)) {
+        std::cerr << "Cache not found: " << cache_path << std::endl;
+        return 1;
+    }
+
+    const uintmax_t before = DirectorySize(cache_path);
+    size_t entries = 0;
+    {
+        PrimeFactorCache cache(cache_path);
+        std::cout << "Migrating cache at: " << cache_path << std::endl;
+        // Sorting merges every legacy shard and run into a single segment
+        cache.Sort();
+        entries = CacheSegment<>(cache.GetBasePath()).Entries();
+    }
+    const uintmax_t after = DirectorySize(cache_path);
+
+    std::cout << "Entries: " << entries << std::endl;
+    std::cout << "Size: " << before << " -> " << after << " bytes" << std::endl;
+    return 0;
+}
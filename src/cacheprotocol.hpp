@@ -0,0 +1,159 @@
+#pragma once
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <span>
+#include <stdexcept>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "cacheformat.hpp"
+
+// The wire protocol between aliquot-cached and its clients. Every request
+// and response is a CacheMessageHeader followed by Size bytes of body,
+// and each request gets exactly one response with the same Op.
+//
+// Lookup: the body holds Count varint keys. The response body has a byte
+// for each key, 1 if it was found followed by its factor payload (see
+// AppendFactorPayload), or 0.
+//
+// Insert: the body holds Count records, each a varint key followed by its
+// factor payload. The response has no body and Count is the number of
+// records stored.
+constexpr uint32_t kCacheProtocolMagic = 0x31514C41;  // "ALQ1"
+// Larger messages are a protocol error
+constexpr uint32_t kCacheMaxMessage = 64 << 20;
+
+enum class CacheOp : uint8_t {
+    Lookup = 1,
+    Insert = 2,
+};
+
+struct CacheMessageHeader {
+    uint32_t Magic;
+    uint8_t Op;
+    uint8_t Reserved[3];
+    uint32_t Count;
+    uint32_t Size;
+};
+static_assert(sizeof(CacheMessageHeader) == 16);
+
+// Mark a new descriptor close-on-exec, and for a socket stop a closed
+// peer raising SIGPIPE where sends cannot ask for that. pipe2, accept4
+// and SOCK_CLOEXEC would do it atomically but are Linux only. Returns
+// false on failure.
+inline bool
+PrepareDescriptor(
+    const int Fd,
+    const bool Socket
+)
+{
+#ifdef SO_NOSIGPIPE
+    const int on = 1;
+    if (Socket && setsockopt(Fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on)) != 0) {
+        return false;
+    }
+#else
+    (void)Socket;
+#endif
+    return fcntl(Fd, F_SETFD, FD_CLOEXEC) == 0;
+}
+
+// Send all of Data, or throw
+inline void
+SendAll(
+    const int Fd,
+    const void* Data,
+    size_t Size
+)
+{
+#ifdef MSG_NOSIGNAL
+    const int flags = MSG_NOSIGNAL;
+#else
+    const int flags = 0;
+#endif
+    const uint8_t* cursor = static_cast<const uint8_t*>(Data);
+    while (Size > 0) {
+        const ssize_t sent = send(Fd, cursor, Size, flags);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            throw std::runtime_error("Cache connection closed while sending.");
+        }
+        cursor += sent;
+        Size -= static_cast<size_t>(sent);
+    }
+}
+
+// Fill all of Data. Returns false if the peer closed the connection
+// before the first byte, and throws if it closed part way.
+inline bool
+ReceiveAll(
+    const int Fd,
+    void* Data,
+    const size_t Size
+)
+{
+    uint8_t* cursor = static_cast<uint8_t*>(Data);
+    size_t received = 0;
+    while (received < Size) {
+        const ssize_t count = recv(Fd, cursor + received, Size - received, 0);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count == 0 && received == 0) {
+            return false;
+        }
+        if (count <= 0) {
+            throw std::runtime_error("Cache connection closed while receiving.");
+        }
+        received += static_cast<size_t>(count);
+    }
+    return true;
+}
+
+inline void
+SendMessage(
+    const int Fd,
+    const CacheOp Op,
+    const uint32_t Count,
+    const std::span<const uint8_t> Body
+)
+{
+    if (Body.size() > kCacheMaxMessage) {
+        throw std::runtime_error("Cache message is too large.");
+    }
+    CacheMessageHeader header = {};
+    header.Magic = kCacheProtocolMagic;
+    header.Op = static_cast<uint8_t>(Op);
+    header.Count = Count;
+    header.Size = static_cast<uint32_t>(Body.size());
+    SendAll(Fd, &header, sizeof(header));
+    SendAll(Fd, Body.data(), Body.size());
+}
+
+// Returns false once the peer has closed the connection
+inline bool
+ReceiveMessage(
+    const int Fd,
+    CacheMessageHeader& Header,
+    std::vector<uint8_t>& Body
+)
+{
+    if (!ReceiveAll(Fd, &Header, sizeof(Header))) {
+        return false;
+    }
+    if (Header.Magic != kCacheProtocolMagic || Header.Size > kCacheMaxMessage) {
+        throw std::runtime_error("Malformed cache message.");
+    }
+    Body.resize(Header.Size);
+    if (Header.Size > 0 && !ReceiveAll(Fd, Body.data(), Body.size())) {
+        throw std::runtime_error("Cache connection closed while receiving.");
+    }
+    return true;
+}
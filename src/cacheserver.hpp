@@ -0,0 +1,219 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "cacheprotocol.hpp"
+#include "primefactorcache.hpp"
+
+// Serves a PrimeFactorCache to CacheClients over a Unix socket, see
+// cacheprotocol.hpp. Each connection gets its own thread, and requests on
+// a connection are answered in order.
+class CacheServer {
+public:
+    CacheServer(
+        PrimeFactorCache<>& Cache,
+        const std::filesystem::path& SocketPath
+    ) : m_Cache(Cache), m_SocketPath(SocketPath) {
+        sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+        if (SocketPath.native().size() >= sizeof(address.sun_path)) {
+            throw std::runtime_error("Cache socket path is too long: " + SocketPath.string());
+        }
+        std::memcpy(address.sun_path, SocketPath.c_str(), SocketPath.native().size());
+        if (pipe(m_StopPipe) != 0) {
+            throw std::runtime_error("Failed to create stop pipe.");
+        }
+        // Stop writes from a signal handler, so must never block
+        for (const int fd : m_StopPipe) {
+            if (!PrepareDescriptor(fd, false) || fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) != 0) {
+                throw std::runtime_error("Failed to create stop pipe.");
+            }
+        }
+        m_Listener = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (m_Listener < 0 || !PrepareDescriptor(m_Listener, false)) {
+            throw std::runtime_error("Failed to create cache socket.");
+        }
+        // Left behind by a daemon that did not shut down cleanly
+        unlink(SocketPath.c_str());
+        if (bind(m_Listener, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0 ||
+            listen(m_Listener, SOMAXCONN) != 0) {
+            throw std::runtime_error("Failed to listen on cache socket: " + SocketPath.string());
+        }
+    }
+
+    CacheServer(
+        const CacheServer&
+    ) = delete;
+
+    CacheServer&
+    operator=(
+        const CacheServer&
+    ) = delete;
+
+    ~CacheServer() {
+        if (m_Listener >= 0) {
+            close(m_Listener);
+            unlink(m_SocketPath.c_str());
+        }
+        close(m_StopPipe[0]);
+        close(m_StopPipe[1]);
+    }
+
+    // Accept connections until Stop, then wait for the open ones to close
+    void
+    Run(
+        void
+    ) {
+        while (true) {
+            pollfd fds[2] = {
+                {m_Listener, POLLIN, 0},
+                {m_StopPipe[0], POLLIN, 0},
+            };
+            if (poll(fds, 2, -1) < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::runtime_error("Failed to poll cache socket.");
+            }
+            if (fds[1].revents != 0) {
+                break;
+            }
+            if ((fds[0].revents & POLLIN) == 0) {
+                continue;
+            }
+            const int fd = accept(m_Listener, nullptr, nullptr);
+            if (fd < 0) {
+                continue;
+            }
+            if (!PrepareDescriptor(fd, true)) {
+                close(fd);
+                continue;
+            }
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            m_Connections.insert(fd);
+            std::thread([this, fd]() { Serve(fd); }).detach();
+        }
+
+        std::unique_lock<std::mutex> lock(m_Mutex);
+        for (const int fd : m_Connections) {
+            shutdown(fd, SHUT_RDWR);
+        }
+        m_Closed.wait(lock, [this]() { return m_Connections.empty(); });
+    }
+
+    // Safe to call from a signal handler
+    void
+    Stop(
+        void
+    ) {
+        const uint8_t byte = 0;
+        [[maybe_unused]] const ssize_t written = write(m_StopPipe[1], &byte, 1);
+    }
+
+private:
+    void
+    Serve(
+        const int Fd
+    ) {
+        try {
+            CacheMessageHeader header;
+            std::vector<uint8_t> request;
+            std::vector<uint8_t> response;
+            while (ReceiveMessage(Fd, header, request)) {
+                response.clear();
+                switch (static_cast<CacheOp>(header.Op)) {
+                    case CacheOp::Lookup:
+                        Lookup(header.Count, request, response);
+                        SendMessage(Fd, CacheOp::Lookup, header.Count, response);
+                        break;
+                    case CacheOp::Insert:
+                        SendMessage(Fd, CacheOp::Insert, Insert(header.Count, request), response);
+                        break;
+                    default:
+                        throw std::runtime_error("Unknown cache request.");
+                }
+            }
+        } catch (const std::exception& e) {
+            std::cerr << "Dropping cache connection: " << e.what() << std::endl;
+        }
+        // Closed only once it is out of the set, under the lock, so accept
+        // cannot hand the number to a new connection while it is listed
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_Connections.erase(Fd);
+        close(Fd);
+        m_Closed.notify_all();
+    }
+
+    void
+    Lookup(
+        const uint32_t Count,
+        const std::vector<uint8_t>& Request,
+        std::vector<uint8_t>& Response
+    ) {
+        const uint8_t* cursor = Request.data();
+        const uint8_t* end = cursor + Request.size();
+        // Every key takes at least a byte
+        if (Count > Request.size()) {
+            throw std::runtime_error("Malformed lookup request.");
+        }
+        std::vector<mpz_class> keys(Count);
+        for (mpz_class& key : keys) {
+            if (!ReadVarint(cursor, end, key)) {
+                throw std::runtime_error("Malformed lookup request.");
+            }
+        }
+        for (const auto& factors : m_Cache.ProductExistsBatch(keys)) {
+            Response.push_back(factors.has_value() ? 1 : 0);
+            if (factors.has_value()) {
+                AppendFactorPayload(Response, factors.value());
+            }
+        }
+    }
+
+    // Returns the number of records stored. Records whose factors do not
+    // multiply out to their key are dropped.
+    uint32_t
+    Insert(
+        const uint32_t Count,
+        const std::vector<uint8_t>& Request
+    ) {
+        const uint8_t* cursor = Request.data();
+        const uint8_t* end = cursor + Request.size();
+        mpz_class key;
+        uint32_t stored = 0;
+        for (uint32_t i = 0; i < Count; ++i) {
+            PrimeFactors factors;
+            if (!ReadVarint(cursor, end, key) || !ReadFactorPayload(cursor, end, &factors)) {
+                throw std::runtime_error("Malformed insert request.");
+            }
+            if (factors.Product() == key) {
+                m_Cache.Write(factors);
+                stored++;
+            }
+        }
+        return stored;
+    }
+
+    PrimeFactorCache<>& m_Cache;
+    std::filesystem::path m_SocketPath;
+    int m_Listener = -1;
+    int m_StopPipe[2] = {-1, -1};
+    std::mutex m_Mutex;
+    std::condition_variable m_Closed;
+    std::set<int> m_Connections;
+};
@@ -0,0 +1,26 @@
+#include <iostream>
+#include <string_view>
+
+#include "primefactorcache.hpp"
+
+int main(
+    int argc,
+    char* argv[]
+)
+{
+    if (argc < 3) {
+        std::cerr << "Usage: cachesnapshot <cache_path> <snapshot>" << std::endl;
+        std::cerr << "Writes a read-only snapshot of a cache that aliquot -c can open." << std::endl;
+        return 1;
+    }
+
+    std::string_view cache_path = argv[1];
+    std::string_view snapshot_path = argv[2];
+
+    PrimeFactorCache cache(cache_path);
+    std::cout << "Exporting cache at: " << cache_path << std::endl;
+    const uint64_t keys = cache.ExportSnapshot(snapshot_path);
+    std::cout << "Wrote " << keys << " entries to " << snapshot_path << std::endl;
+
+    return 0;
+}
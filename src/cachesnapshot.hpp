@@ -0,0 +1,362 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <vector>
+
+#include <gmpxx.h>
+
+#include "cacheformat.hpp"
+#include "factors.hpp"
+#include "mappedfile.hpp"
+
+// A read-only snapshot of a whole cache in one file, addressed by a
+// minimal perfect hash over the keys. Keys are hashed into buckets, and
+// each bucket stores the seed that sends all of its keys to free slots,
+// so every key owns exactly one of Keys slots (CHD/PTHash style). Slots
+// are kSnapshotSlotSize bytes and hold a fingerprint plus the record in
+// the version 2 encoding, so a lookup is one hash, one seed and one
+// cache line. Records too big for a slot live in an overflow area after
+// the slots.
+constexpr char kSnapshotMagic[8] = {'A', 'L', 'Q', 'S', 'N', 'A', 'P', '1'};
+constexpr uint32_t kSnapshotVersion = 1;
+constexpr uint32_t kSnapshotSlotSize = 32;
+// Average keys per bucket, more is smaller but slower to build
+constexpr uint64_t kSnapshotBucketLoad = 3;
+
+struct SnapshotHeader {
+    char Magic[8];
+    uint32_t Version;
+    uint32_t SlotSize;
+    uint64_t Keys;
+    uint64_t Buckets;
+    uint64_t HashSeed;
+    uint64_t SlotsOffset;
+    uint64_t OverflowOffset;
+    uint64_t OverflowSize;
+};
+static_assert(sizeof(SnapshotHeader) == 64);
+
+struct SnapshotSlot {
+    uint16_t Fingerprint;
+    // Bytes used in Data, or 0 when Data holds an overflow offset
+    uint8_t Length;
+    uint8_t Reserved;
+    uint8_t Data[kSnapshotSlotSize - 4];
+};
+static_assert(sizeof(SnapshotSlot) == kSnapshotSlotSize);
+
+inline uint16_t
+SnapshotFingerprint(
+    const uint64_t Hash
+)
+{
+    return static_cast<uint16_t>(MixHash(Hash ^ 0x5bd1e9955bd1e995ull));
+}
+
+inline uint64_t
+SnapshotPosition(
+    const uint64_t Hash,
+    const uint32_t Seed,
+    const uint64_t Keys
+)
+{
+    return ReduceHash(MixHash(Hash + (static_cast<uint64_t>(Seed) + 1) * 0x9e3779b97f4a7c15ull), Keys);
+}
+
+// Collects merged records and writes them out as a snapshot. Keys must be
+// unique, which they are when they come from MergeCursors.
+class SnapshotWriter {
+public:
+    void
+    Add(
+        const mpz_class& Key,
+        const std::span<const uint8_t> Payload
+    ) {
+        m_Keys.push_back(Key);
+        m_Offsets.push_back(m_Records.size());
+        AppendVarint(m_Records, Key);
+        m_Records.insert(m_Records.end(), Payload.begin(), Payload.end());
+    }
+
+    void
+    Add(
+        const mpz_class& Key,
+        const PrimeFactors& Factors
+    ) {
+        std::vector<uint8_t> payload;
+        AppendFactorPayload(payload, Factors);
+        Add(Key, payload);
+    }
+
+    uint64_t
+    Keys(
+        void
+    ) const {
+        return m_Keys.size();
+    }
+
+    void
+    Finish(
+        const std::filesystem::path& Path
+    ) {
+        const uint64_t keys = m_Keys.size();
+        const uint64_t buckets = keys / kSnapshotBucketLoad + 1;
+        std::vector<uint32_t> seeds(buckets, 0);
+        std::vector<uint64_t> slot_of(keys, 0);
+
+        // A 64 bit collision between two keys in one bucket can never be
+        // placed, so start again with another hash seed
+        uint64_t hash_seed = 0;
+        while (!Place(hash_seed, buckets, seeds, slot_of)) {
+            hash_seed++;
+        }
+
+        std::vector<SnapshotSlot> slots(keys);
+        std::vector<uint8_t> overflow;
+        for (uint64_t i = 0; i < keys; ++i) {
+            SnapshotSlot& slot = slots[slot_of[i]];
+            std::memset(&slot, 0, sizeof(slot));
+            slot.Fingerprint = SnapshotFingerprint(HashKey(m_Keys[i], hash_seed));
+            const size_t begin = m_Offsets[i];
+            const size_t end = i + 1 < keys ? m_Offsets[i + 1] : m_Records.size();
+            if (end - begin <= sizeof(slot.Data)) {
+                slot.Length = static_cast<uint8_t>(end - begin);
+                std::memcpy(slot.Data, m_Records.data() + begin, end - begin);
+            } else {
+                const uint64_t offset = overflow.size();
+                std::memcpy(slot.Data, &offset, sizeof(offset));
+                overflow.insert(overflow.end(), m_Records.begin() + begin, m_Records.begin() + end);
+            }
+        }
+
+        SnapshotHeader header = {};
+        std::memcpy(header.Magic, kSnapshotMagic, sizeof(header.Magic));
+        header.Version = kSnapshotVersion;
+        header.SlotSize = kSnapshotSlotSize;
+        header.Keys = keys;
+        header.Buckets = buckets;
+        header.HashSeed = hash_seed;
+        // Seeds follow the header and the slots start on a cache line
+        header.SlotsOffset = (sizeof(header) + buckets * sizeof(uint32_t) + 63) / 64 * 64;
+        header.OverflowOffset = header.SlotsOffset + keys * sizeof(SnapshotSlot);
+        header.OverflowSize = overflow.size();
+
+        FILE* file = fopen(Path.c_str(), "wb");
+        if (file == nullptr) {
+            throw std::runtime_error("Failed to open snapshot for writing: " + Path.string());
+        }
+        const std::vector<uint8_t> padding(header.SlotsOffset - sizeof(header) - buckets * sizeof(uint32_t), 0);
+        const bool written =
+            fwrite(&header, sizeof(header), 1, file) == 1 &&
+            fwrite(seeds.data(), sizeof(uint32_t), buckets, file) == buckets &&
+            fwrite(padding.data(), 1, padding.size(), file) == padding.size() &&
+            fwrite(slots.data(), sizeof(SnapshotSlot), keys, file) == keys &&
+            fwrite(overflow.data(), 1, overflow.size(), file) == overflow.size();
+        if (fclose(file) != 0 || !written) {
+            throw std::runtime_error("Failed to write snapshot: " + Path.string());
+        }
+    }
+
+private:
+    // Find a seed for every bucket, largest buckets first while the table
+    // is still empty
+    bool
+    Place(
+        const uint64_t HashSeed,
+        const uint64_t Buckets,
+        std::vector<uint32_t>& Seeds,
+        std::vector<uint64_t>& SlotOf
+    ) const {
+        const uint64_t keys = m_Keys.size();
+        std::vector<uint64_t> hashes(keys);
+        std::vector<uint64_t> bucket_start(Buckets + 1, 0);
+        for (uint64_t i = 0; i < keys; ++i) {
+            hashes[i] = HashKey(m_Keys[i], HashSeed);
+            bucket_start[ReduceHash(hashes[i], Buckets) + 1]++;
+        }
+        for (uint64_t b = 0; b < Buckets; ++b) {
+            bucket_start[b + 1] += bucket_start[b];
+        }
+        std::vector<uint64_t> members(keys);
+        std::vector<uint64_t> fill(bucket_start.begin(), bucket_start.end() - 1);
+        for (uint64_t i = 0; i < keys; ++i) {
+            members[fill[ReduceHash(hashes[i], Buckets)]++] = i;
+        }
+        std::vector<uint64_t> order(Buckets);
+        for (uint64_t b = 0; b < Buckets; ++b) {
+            order[b] = b;
+        }
+        std::stable_sort(order.begin(), order.end(), [&](const uint64_t a, const uint64_t b) {
+            return bucket_start[a + 1] - bucket_start[a] > bucket_start[b + 1] - bucket_start[b];
+        });
+
+        std::vector<uint8_t> taken(keys, 0);
+        std::vector<uint64_t> positions;
+        for (const uint64_t bucket : order) {
+            const std::span<const uint64_t> bucket_keys(members.data() + bucket_start[bucket], bucket_start[bucket + 1] - bucket_start[bucket]);
+            if (bucket_keys.empty()) {
+                break;
+            }
+            for (size_t i = 1; i < bucket_keys.size(); ++i) {
+                for (size_t j = 0; j < i; ++j) {
+                    if (hashes[bucket_keys[i]] == hashes[bucket_keys[j]]) {
+                        return false;
+                    }
+                }
+            }
+            for (uint32_t seed = 0;; ++seed) {
+                positions.clear();
+                bool free = true;
+                for (const uint64_t key : bucket_keys) {
+                    const uint64_t position = SnapshotPosition(hashes[key], seed, keys);
+                    if (taken[position] || std::find(positions.begin(), positions.end(), position) != positions.end()) {
+                        free = false;
+                        break;
+                    }
+                    positions.push_back(position);
+                }
+                if (free) {
+                    Seeds[bucket] = seed;
+                    for (size_t i = 0; i < bucket_keys.size(); ++i) {
+                        taken[positions[i]] = 1;
+                        SlotOf[bucket_keys[i]] = positions[i];
+                    }
+                    break;
+                }
+                if (seed == UINT32_MAX) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    std::vector<mpz_class> m_Keys;
+    std::vector<uint64_t> m_Offsets;
+    std::vector<uint8_t> m_Records;
+};
+
+class CacheSnapshot {
+public:
+    // Returns false if Path is not a snapshot
+    bool
+    Open(
+        const std::filesystem::path& Path,
+        const bool Resident = false
+    ) {
+        if (!m_Map.Open(Path, Resident)) {
+            return false;
+        }
+        const auto data = m_Map.Data();
+        if (data.size() < sizeof(SnapshotHeader)) {
+            m_Map.Close();
+            return false;
+        }
+        std::memcpy(&m_Header, data.data(), sizeof(m_Header));
+        if (std::memcmp(m_Header.Magic, kSnapshotMagic, sizeof(kSnapshotMagic)) != 0) {
+            m_Map.Close();
+            return false;
+        }
+        if (m_Header.Version != kSnapshotVersion ||
+            m_Header.SlotSize != kSnapshotSlotSize ||
+            m_Header.OverflowOffset + m_Header.OverflowSize > data.size() ||
+            m_Header.SlotsOffset + m_Header.Keys * sizeof(SnapshotSlot) > m_Header.OverflowOffset) {
+            throw std::runtime_error("Unsupported snapshot: " + Path.string());
+        }
+        if (Resident) {
+            m_Map.Lock();
+        }
+        m_Seeds = reinterpret_cast<const uint32_t*>(data.data() + sizeof(SnapshotHeader));
+        m_Slots = reinterpret_cast<const SnapshotSlot*>(data.data() + m_Header.SlotsOffset);
+        return true;
+    }
+
+    static bool
+    IsSnapshot(
+        const std::filesystem::path& Path
+    ) {
+        std::error_code error;
+        if (!std::filesystem::is_regular_file(Path, error)) {
+            return false;
+        }
+        char magic[sizeof(kSnapshotMagic)] = {};
+        FILE* file = fopen(Path.c_str(), "rb");
+        if (file == nullptr) {
+            return false;
+        }
+        const bool read = fread(magic, sizeof(magic), 1, file) == 1;
+        fclose(file);
+        return read && std::memcmp(magic, kSnapshotMagic, sizeof(magic)) == 0;
+    }
+
+    uint64_t
+    Keys(
+        void
+    ) const {
+        return m_Header.Keys;
+    }
+
+    size_t
+    Size(
+        void
+    ) const {
+        return m_Map.Size();
+    }
+
+    std::optional<PrimeFactors>
+    Find(
+        const mpz_class& Key
+    ) const {
+        if (m_Header.Keys == 0) {
+            return std::nullopt;
+        }
+        const uint64_t hash = HashKey(Key, m_Header.HashSeed);
+        const uint32_t seed = m_Seeds[ReduceHash(hash, m_Header.Buckets)];
+        const SnapshotSlot& slot = m_Slots[SnapshotPosition(hash, seed, m_Header.Keys)];
+        // Most keys that are not in the snapshot stop here
+        if (slot.Fingerprint != SnapshotFingerprint(hash)) {
+            return std::nullopt;
+        }
+
+        const uint8_t* cursor = slot.Data;
+        const uint8_t* end = slot.Data + slot.Length;
+        if (slot.Length == 0) {
+            uint64_t offset = 0;
+            std::memcpy(&offset, slot.Data, sizeof(offset));
+            const auto data = m_Map.Data();
+            cursor = data.data() + m_Header.OverflowOffset + offset;
+            end = data.data() + m_Header.OverflowOffset + m_Header.OverflowSize;
+        }
+
+        // The fingerprint can match by chance, so compare the stored key
+        if (mpz_fits_ulong_p(Key.get_mpz_t())) {
+            uint64_t key = 0;
+            if (!ReadVarint(cursor, end, key) || key != Key.get_ui()) {
+                return std::nullopt;
+            }
+        } else {
+            mpz_class key;
+            if (!ReadVarint(cursor, end, key) || key != Key) {
+                return std::nullopt;
+            }
+        }
+        PrimeFactors factors;
+        if (!ReadFactorPayload(cursor, end, &factors)) {
+            return std::nullopt;
+        }
+        return factors;
+    }
+
+private:
+    MappedFile m_Map;
+    SnapshotHeader m_Header = {};
+    const uint32_t* m_Seeds = nullptr;
+    const SnapshotSlot* m_Slots = nullptr;
+};
@@ -19,7 +19,12 @@ int main(
     PrimeFactorCache cache(cache_path);
     
     std::cout << "Sorting cache at: " << cache_path << std::endl;
-    cache.Sort();
+    cache.Sort([](const std::string_view Stage, const size_t Done, const size_t Total) {
+        std::cerr << "\r" << Stage << ": " << Done << "/" << Total << std::flush;
+        if (Done == Total) {
+            std::cerr << std::endl;
+        }
+    });
     std::cout << "Done sorting cache." << std::endl;
     
     return 0;
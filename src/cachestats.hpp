@@ -0,0 +1,375 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <iomanip>
+#include <ostream>
+#include <string_view>
+
+// Power of two latency buckets, the last one also holds anything longer
+// than about 9 minutes
+constexpr size_t kLatencyBuckets = 40;
+// Lookups are counted per shard for up to this many shards
+constexpr size_t kStatsShards = 64;
+// Probe depths counted separately, deeper lookups share the last count
+constexpr size_t kProbeDepths = 16;
+
+// Bytes of segment files the calling thread's lookups have decoded. A
+// cache reads it before and after a lookup to count what that lookup
+// read, whichever segment files it went through.
+inline uint64_t&
+ThreadBytesRead(
+    void
+)
+{
+    thread_local uint64_t bytes = 0;
+    return bytes;
+}
+
+// Counts of durations in power of two buckets of nanoseconds. Bucket b
+// holds durations below 2^b ns and at least 2^(b-1) ns. Safe to record
+// from any number of threads.
+class LatencyHistogram {
+public:
+    void
+    Record(
+        const std::chrono::nanoseconds Elapsed
+    ) {
+        const uint64_t nanos = static_cast<uint64_t>(std::max<int64_t>(Elapsed.count(), 0));
+        const size_t bucket = std::min<size_t>(std::bit_width(nanos), kLatencyBuckets - 1);
+        m_Buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+        m_Nanos.fetch_add(nanos, std::memory_order_relaxed);
+    }
+
+    uint64_t
+    Count(
+        void
+    ) const {
+        uint64_t count = 0;
+        for (const auto& bucket : m_Buckets) {
+            count += bucket.load(std::memory_order_relaxed);
+        }
+        return count;
+    }
+
+    uint64_t
+    Bucket(
+        const size_t Index
+    ) const {
+        return m_Buckets[Index].load(std::memory_order_relaxed);
+    }
+
+    uint64_t
+    MeanNanos(
+        void
+    ) const {
+        const uint64_t count = Count();
+        return count == 0 ? 0 : m_Nanos.load(std::memory_order_relaxed) / count;
+    }
+
+    // An upper bound on quantile Q, the top of the bucket it falls in
+    uint64_t
+    QuantileNanos(
+        const double Q
+    ) const {
+        const uint64_t count = Count();
+        if (count == 0) {
+            return 0;
+        }
+        const uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(Q * count)));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < kLatencyBuckets; ++i) {
+            seen += Bucket(i);
+            if (seen >= rank) {
+                return uint64_t(1) << i;
+            }
+        }
+        return uint64_t(1) << (kLatencyBuckets - 1);
+    }
+
+    void
+    WriteJson(
+        std::ostream& Output
+    ) const {
+        Output << "{\"count\":" << Count() << ",\"mean\":" << MeanNanos() <<
+            ",\"p50\":" << QuantileNanos(0.5) << ",\"p90\":" << QuantileNanos(0.9) <<
+            ",\"p99\":" << QuantileNanos(0.99) << ",\"buckets\":[";
+        for (size_t i = 0; i < kLatencyBuckets; ++i) {
+            Output << (i == 0 ? "" : ",") << Bucket(i);
+        }
+        Output << "]}";
+    }
+
+private:
+    std::array<std::atomic<uint64_t>, kLatencyBuckets> m_Buckets = {};
+    std::atomic<uint64_t> m_Nanos = 0;
+};
+
+// Where a lookup was answered
+enum class CacheTier : uint8_t {
+    Hot,
+    Memtable,
+    Segment,
+    Daemon,
+    Miss,
+};
+constexpr size_t kCacheTiers = 5;
+
+// How a factorization offered to a cache was found
+enum class FactorMethod : uint8_t {
+    Cache,
+    Linear,
+    Wheel,
+};
+constexpr size_t kFactorMethods = 3;
+
+// What a cache's lookups and inserts have done since it was opened: hits
+// by tier, misses, bytes decoded from segment files, how many segments
+// each lookup probed, per shard and overall, latency histograms, and the
+// factorizations offered for admission by how they were found. Lookups
+// made through ProductExistsBatch count their keys but time the whole
+// batch. Safe to update from any number of threads.
+class CacheStats {
+public:
+    void
+    RecordLookup(
+        const CacheTier Tier,
+        const std::chrono::nanoseconds Elapsed
+    ) {
+        Count(Tier, 1);
+        m_LookupLatency.Record(Elapsed);
+    }
+
+    void
+    RecordBatch(
+        const std::array<uint64_t, kCacheTiers>& Tiers,
+        const std::chrono::nanoseconds Elapsed
+    ) {
+        for (size_t i = 0; i < Tiers.size(); ++i) {
+            Count(static_cast<CacheTier>(i), Tiers[i]);
+        }
+        m_BatchLatency.Record(Elapsed);
+    }
+
+    void
+    RecordInsert(
+        const std::chrono::nanoseconds Elapsed
+    ) {
+        m_InsertLatency.Record(Elapsed);
+    }
+
+    // A factorization found by Method in Elapsed, and whether it was
+    // admitted to disk. Those found in the cache and not admitted were
+    // already there.
+    void
+    RecordFactorization(
+        const FactorMethod Method,
+        const std::chrono::nanoseconds Elapsed,
+        const bool Admitted
+    ) {
+        m_Methods[static_cast<size_t>(Method)].fetch_add(1, std::memory_order_relaxed);
+        if (Admitted) {
+            m_Admitted.fetch_add(1, std::memory_order_relaxed);
+        }
+        if (Method != FactorMethod::Cache) {
+            m_Declined.fetch_add(!Admitted, std::memory_order_relaxed);
+            m_FactorLatency.Record(Elapsed);
+        }
+    }
+
+    // A lookup of a key in Shard that probed Segments segments on disk
+    void
+    RecordProbes(
+        const size_t Shard,
+        const size_t Segments
+    ) {
+        m_ProbeDepths[std::min(Segments, kProbeDepths - 1)].fetch_add(1, std::memory_order_relaxed);
+        if (Shard < kStatsShards) {
+            m_ShardLookups[Shard].fetch_add(1, std::memory_order_relaxed);
+            m_ShardProbes[Shard].fetch_add(Segments, std::memory_order_relaxed);
+        }
+    }
+
+    void
+    RecordBytesRead(
+        const uint64_t Bytes
+    ) {
+        m_BytesRead.fetch_add(Bytes, std::memory_order_relaxed);
+    }
+
+    uint64_t
+    Hits(
+        const CacheTier Tier
+    ) const {
+        return m_Tiers[static_cast<size_t>(Tier)].load(std::memory_order_relaxed);
+    }
+
+    uint64_t
+    Lookups(
+        void
+    ) const {
+        uint64_t lookups = 0;
+        for (const auto& tier : m_Tiers) {
+            lookups += tier.load(std::memory_order_relaxed);
+        }
+        return lookups;
+    }
+
+    uint64_t
+    BytesRead(
+        void
+    ) const {
+        return m_BytesRead.load(std::memory_order_relaxed);
+    }
+
+    uint64_t
+    Factorizations(
+        const FactorMethod Method
+    ) const {
+        return m_Methods[static_cast<size_t>(Method)].load(std::memory_order_relaxed);
+    }
+
+    uint64_t
+    Admitted(
+        void
+    ) const {
+        return m_Admitted.load(std::memory_order_relaxed);
+    }
+
+    uint64_t
+    Declined(
+        void
+    ) const {
+        return m_Declined.load(std::memory_order_relaxed);
+    }
+
+    const LatencyHistogram&
+    LookupLatency(
+        void
+    ) const {
+        return m_LookupLatency;
+    }
+
+    const LatencyHistogram&
+    InsertLatency(
+        void
+    ) const {
+        return m_InsertLatency;
+    }
+
+    // Human readable, for the first Shards shards
+    void
+    Print(
+        std::ostream& Output,
+        const size_t Shards
+    ) const {
+        const uint64_t lookups = Lookups();
+        const uint64_t misses = Hits(CacheTier::Miss);
+        Output << "Lookups: " << lookups << std::endl;
+        if (lookups > 0) {
+            Output << "Hit rate: " << std::fixed << std::setprecision(2) <<
+                100.0 * (lookups - misses) / lookups << "%" << std::defaultfloat << std::endl;
+        }
+        for (size_t i = 0; i < kTierNames.size(); ++i) {
+            Output << "  " << kTierNames[i] << ": " << m_Tiers[i].load(std::memory_order_relaxed) << std::endl;
+        }
+        Output << "Bytes read: " << BytesRead() << std::endl;
+        Output << "Segments probed per disk lookup, by shard:";
+        for (size_t shard = 0; shard < std::min(Shards, kStatsShards); ++shard) {
+            const uint64_t shard_lookups = m_ShardLookups[shard].load(std::memory_order_relaxed);
+            const uint64_t probes = m_ShardProbes[shard].load(std::memory_order_relaxed);
+            Output << " " << std::fixed << std::setprecision(2) <<
+                (shard_lookups == 0 ? 0.0 : static_cast<double>(probes) / shard_lookups) << std::defaultfloat;
+        }
+        Output << std::endl;
+        Output << "Factorizations:";
+        for (size_t i = 0; i < kMethodNames.size(); ++i) {
+            Output << " " << kMethodNames[i] << " " << m_Methods[i].load(std::memory_order_relaxed);
+        }
+        Output << ", " << Admitted() << " admitted, " << Declined() << " held in memory" << std::endl;
+        PrintLatency(Output, "Lookup latency", m_LookupLatency);
+        PrintLatency(Output, "Batch latency", m_BatchLatency);
+        PrintLatency(Output, "Insert latency", m_InsertLatency);
+        PrintLatency(Output, "Factor time", m_FactorLatency);
+    }
+
+    // One JSON object, for the first Shards shards
+    void
+    WriteJson(
+        std::ostream& Output,
+        const size_t Shards
+    ) const {
+        Output << "{\"lookups\":" << Lookups() << ",\"hits\":{";
+        for (size_t i = 0; i < kTierNames.size(); ++i) {
+            Output << (i == 0 ? "" : ",") << "\"" << kTierNames[i] << "\":" << m_Tiers[i].load(std::memory_order_relaxed);
+        }
+        Output << "},\"misses\":" << Hits(CacheTier::Miss) << ",\"bytes_read\":" << BytesRead() << ",\"probe_depths\":[";
+        for (size_t i = 0; i < kProbeDepths; ++i) {
+            Output << (i == 0 ? "" : ",") << m_ProbeDepths[i].load(std::memory_order_relaxed);
+        }
+        Output << "],\"shards\":[";
+        for (size_t shard = 0; shard < std::min(Shards, kStatsShards); ++shard) {
+            Output << (shard == 0 ? "" : ",") << "{\"lookups\":" << m_ShardLookups[shard].load(std::memory_order_relaxed) <<
+                ",\"probes\":" << m_ShardProbes[shard].load(std::memory_order_relaxed) << "}";
+        }
+        Output << "],\"factorizations\":{";
+        for (size_t i = 0; i < kMethodNames.size(); ++i) {
+            Output << (i == 0 ? "" : ",") << "\"" << kMethodNames[i] << "\":" << m_Methods[i].load(std::memory_order_relaxed);
+        }
+        Output << "},\"admitted\":" << Admitted() << ",\"declined\":" << Declined() << ",\"lookup_latency_ns\":";
+        m_LookupLatency.WriteJson(Output);
+        Output << ",\"batch_latency_ns\":";
+        m_BatchLatency.WriteJson(Output);
+        Output << ",\"insert_latency_ns\":";
+        m_InsertLatency.WriteJson(Output);
+        Output << ",\"factor_time_ns\":";
+        m_FactorLatency.WriteJson(Output);
+        Output << "}";
+    }
+
+private:
+    // Hit tiers, in CacheTier order
+    static constexpr std::array<std::string_view, 4> kTierNames = {"hot", "memtable", "segment", "daemon"};
+    // In FactorMethod order
+    static constexpr std::array<std::string_view, kFactorMethods> kMethodNames = {"cache", "linear", "wheel"};
+
+    void
+    Count(
+        const CacheTier Tier,
+        const uint64_t Lookups
+    ) {
+        m_Tiers[static_cast<size_t>(Tier)].fetch_add(Lookups, std::memory_order_relaxed);
+    }
+
+    static void
+    PrintLatency(
+        std::ostream& Output,
+        const std::string_view Name,
+        const LatencyHistogram& Histogram
+    ) {
+        if (Histogram.Count() == 0) {
+            return;
+        }
+        Output << Name << ": " << Histogram.Count() << " timed, mean " << Histogram.MeanNanos() <<
+            " ns, p50 < " << Histogram.QuantileNanos(0.5) << " ns, p90 < " << Histogram.QuantileNanos(0.9) <<
+            " ns, p99 < " << Histogram.QuantileNanos(0.99) << " ns" << std::endl;
+    }
+
+    std::array<std::atomic<uint64_t>, kCacheTiers> m_Tiers = {};
+    std::atomic<uint64_t> m_BytesRead = 0;
+    std::array<std::atomic<uint64_t>, kProbeDepths> m_ProbeDepths = {};
+    std::array<std::atomic<uint64_t>, kStatsShards> m_ShardLookups = {};
+    std::array<std::atomic<uint64_t>, kStatsShards> m_ShardProbes = {};
+    std::array<std::atomic<uint64_t>, kFactorMethods> m_Methods = {};
+    std::atomic<uint64_t> m_Admitted = 0;
+    std::atomic<uint64_t> m_Declined = 0;
+    LatencyHistogram m_LookupLatency;
+    LatencyHistogram m_BatchLatency;
+    LatencyHistogram m_InsertLatency;
+    LatencyHistogram m_FactorLatency;
+};
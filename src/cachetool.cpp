@@ -0,0 +1,371 @@
+#include <atomic>
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "factors.hpp"
+#include "isprime.hpp"
+#include "mappedfile.hpp"
+#include "primefactorcache.hpp"
+
+static const std::string_view HELP_STRING = R"(
+Usage: cachetool <command> [options] <cache_path>...
+Commands:
+    verify <cache_path>
+        Check that every record's factors are prime and multiply out to
+        its key, and that every file is in order. Files are checked in
+        parallel, each in one pass.
+    merge [-s <N>] <output> <input>...
+        Merge the caches <input>... into <output>, which is created if it
+        does not exist, keeping one copy of each key. The result is a
+        single segment, merged shard by shard in parallel.
+    compact [-s <N>] <cache_path>
+        Rewrite the cache as a single segment, merged shard by shard in
+        parallel.
+    import <cache_path> <dump>...
+        Load factorizations from text files with lines of the form
+        "n = p^a * q^b" into the cache, which is created if it does not
+        exist, as one new run. The files are parsed in parallel. A line
+        whose factors are not probable primes or do not multiply out to
+        n is reported and skipped. Empty lines and lines starting with
+        '#' are ignored.
+Options:
+    -s <N>      Files per segment written (default 8)
+    -h, --help  Show this help message
+)";
+
+// Problems verify and import print before they only count them
+constexpr uint64_t kReportedProblems = 20;
+// Bytes of a dump import parses as one piece of work
+constexpr size_t kImportChunk = size_t(64) << 20;
+
+static void
+PrintProgress(
+    const std::string_view Stage,
+    const size_t Done,
+    const size_t Total
+)
+{
+    std::cerr << "\r" << Stage << ": " << Done << "/" << Total << std::flush;
+    if (Done == Total) {
+        std::cerr << std::endl;
+    }
+}
+
+static size_t
+CountEntries(
+    PrimeFactorCache<>& Cache
+)
+{
+    size_t entries = 0;
+    for (const auto& segment : Cache.Segments()) {
+        entries += segment->Entries();
+    }
+    return entries;
+}
+
+static int
+Verify(
+    const std::string_view CachePath
+)
+{
+    if (!std::filesystem::exists(CachePath)) {
+        std::cerr << "Cache not found: " << CachePath << std::endl;
+        return 1;
+    }
+    PrimeFactorCache cache(CachePath);
+    const auto segments = cache.Segments();
+
+    struct File {
+        const CacheSegment<>* Segment;
+        size_t Index;
+        std::unique_ptr<RecordCursor> Cursor;
+    };
+    std::vector<File> files;
+    for (const auto& segment : segments) {
+        auto cursors = segment->FileCursors();
+        for (size_t i = 0; i < cursors.size(); ++i) {
+            files.push_back(File{segment.get(), i, std::move(cursors[i])});
+        }
+    }
+
+    // Built before the threads start, it is only read after
+    const IsPrime& is_prime = GetPrimeChecker();
+    std::atomic<uint64_t> records = 0;
+    std::atomic<uint64_t> problems = 0;
+    std::atomic<size_t> finished = 0;
+    std::mutex output_mutex;
+    auto report = [&](const File& Source, const std::string& Problem) {
+        if (problems++ < kReportedProblems) {
+            std::lock_guard<std::mutex> lock(output_mutex);
+            std::cerr << "\r" << Source.Segment->GetPath().string() << " file " << Source.Index << ": " << Problem << std::endl;
+        }
+    };
+
+    ForEachShard(files.size(), [&](const size_t Index) {
+        File& file = files[Index];
+        // Legacy files in the cache root are only sorted by cachesort
+        const bool sharded = !file.Segment->IsLegacy();
+        const size_t shards = file.Segment->Shards();
+        mpz_class previous = -1;
+        uint64_t checked = 0;
+        try {
+            for (RecordCursor& cursor = *file.Cursor; cursor.Valid(); cursor.Next()) {
+                const mpz_class& key = cursor.Key();
+                checked++;
+                if (sharded) {
+                    if (key <= previous) {
+                        report(file, key.get_str() + " is out of order");
+                    }
+                    if (ShardOfHash(HashKey(key), shards) != file.Index) {
+                        report(file, key.get_str() + " is in the wrong shard");
+                    }
+                    previous = key;
+                }
+                const auto payload = cursor.Payload();
+                const uint8_t* end = payload.data() + payload.size();
+                const uint8_t* position = payload.data();
+                PrimeFactors factors;
+                if (!ReadFactorPayload(position, end, &factors) || position != end) {
+                    report(file, key.get_str() + " has a corrupt record");
+                    continue;
+                }
+                if (factors.Product() != key) {
+                    report(file, key.get_str() + " does not match its factors " + factors.GetString());
+                }
+                for (const auto& [prime, count] : factors.ToVector()) {
+                    if (!is_prime.Check(prime)) {
+                        report(file, key.get_str() + " has a composite factor " + prime.get_str());
+                    }
+                }
+            }
+        } catch (const std::exception& e) {
+            report(file, std::string("stops early: ") + e.what());
+        }
+        records += checked;
+        std::lock_guard<std::mutex> lock(output_mutex);
+        PrintProgress("Verifying files", ++finished, files.size());
+    });
+
+    std::cout << "Segments: " << segments.size() << std::endl;
+    std::cout << "Files: " << files.size() << std::endl;
+    std::cout << "Records: " << records << std::endl;
+    std::cout << "Problems: " << problems << std::endl;
+    return problems == 0 ? 0 : 1;
+}
+
+static int
+Merge(
+    const size_t Shards,
+    const std::string_view Output,
+    const std::vector<std::string_view>& Inputs
+)
+{
+    std::vector<std::unique_ptr<PrimeFactorCache<>>> sources;
+    std::vector<std::shared_ptr<const CacheSegment<>>> held;
+    std::vector<const CacheSegment<>*> segments;
+    for (const std::string_view input : Inputs) {
+        std::error_code error;
+        if (!std::filesystem::exists(input)) {
+            std::cerr << "Cache not found: " << input << std::endl;
+            return 1;
+        }
+        if (std::filesystem::equivalent(input, Output, error)) {
+            std::cerr << "Cannot merge a cache into itself: " << input << std::endl;
+            return 1;
+        }
+        auto& source = sources.emplace_back(std::make_unique<PrimeFactorCache<>>(input));
+        for (const auto& segment : source->Segments()) {
+            if (segment->IsLegacy() && segment->GetPath() == source->GetPath() && segment->Entries() > 0) {
+                std::cerr << "Cache has unsorted legacy files, run cachesort on it first: " << input << std::endl;
+                return 1;
+            }
+            segments.push_back(segment.get());
+            held.push_back(segment);
+        }
+    }
+
+    PrimeFactorCache cache(Output);
+    if (Shards != 0) {
+        cache.SetShards(Shards);
+    }
+    std::cout << "Merging " << Inputs.size() << " caches into: " << Output << std::endl;
+    cache.MergeFrom(segments, PrintProgress);
+    std::cout << "Entries: " << CountEntries(cache) << std::endl;
+    return 0;
+}
+
+static int
+Compact(
+    const size_t Shards,
+    const std::string_view CachePath
+)
+{
+    if (!std::filesystem::exists(CachePath)) {
+        std::cerr << "Cache not found: " << CachePath << std::endl;
+        return 1;
+    }
+    PrimeFactorCache cache(CachePath);
+    if (Shards != 0) {
+        cache.SetShards(Shards);
+    }
+    const size_t before = cache.Segments().size();
+    std::cout << "Compacting cache at: " << CachePath << std::endl;
+    cache.Sort(PrintProgress);
+    std::cout << "Segments: " << before << " -> " << cache.Segments().size() << std::endl;
+    std::cout << "Entries: " << CountEntries(cache) << std::endl;
+    return 0;
+}
+
+static int
+Import(
+    const std::string_view CachePath,
+    const std::vector<std::string_view>& Dumps
+)
+{
+    std::vector<MappedFile> files(Dumps.size());
+    for (size_t i = 0; i < Dumps.size(); ++i) {
+        if (!files[i].Open(Dumps[i])) {
+            std::cerr << "Failed to open dump: " << Dumps[i] << std::endl;
+            return 1;
+        }
+    }
+
+    // Split each file into chunks that end at the end of a line
+    struct Chunk {
+        size_t File;
+        size_t Begin;
+        size_t End;
+    };
+    std::vector<Chunk> chunks;
+    for (size_t i = 0; i < files.size(); ++i) {
+        const std::string_view text(reinterpret_cast<const char*>(files[i].Data().data()), files[i].Size());
+        for (size_t begin = 0; begin < text.size();) {
+            size_t end = text.find('\n', std::min(begin + kImportChunk, text.size()) - 1);
+            end = end == std::string_view::npos ? text.size() : end + 1;
+            chunks.push_back(Chunk{i, begin, end});
+            begin = end;
+        }
+    }
+
+    PrimeFactorCache cache(CachePath);
+    PrimeFactorCache<>::BulkWriter bulk(cache);
+    // Built before the threads start, it is only read after
+    const IsPrime& is_prime = GetPrimeChecker();
+    std::atomic<uint64_t> lines = 0;
+    std::atomic<uint64_t> problems = 0;
+    std::atomic<size_t> finished = 0;
+    std::mutex output_mutex;
+    auto report = [&](const Chunk& Source, const size_t Offset, const std::string& Problem) {
+        if (problems++ < kReportedProblems) {
+            std::lock_guard<std::mutex> lock(output_mutex);
+            std::cerr << "\r" << Dumps[Source.File] << " byte " << Offset << ": " << Problem << std::endl;
+        }
+    };
+
+    std::cout << "Importing " << Dumps.size() << " files into: " << CachePath << std::endl;
+    ForEachShard(chunks.size(), [&](const size_t Index) {
+        const Chunk& chunk = chunks[Index];
+        const std::string_view text(reinterpret_cast<const char*>(files[chunk.File].Data().data()), chunk.End);
+        mpz_class number;
+        PrimeFactors factors;
+        uint64_t parsed = 0;
+        for (size_t begin = chunk.Begin; begin < chunk.End;) {
+            const size_t newline = text.find('\n', begin);
+            const size_t end = newline == std::string_view::npos ? chunk.End : newline;
+            const std::string_view line = text.substr(begin, end - begin);
+            const size_t offset = begin;
+            begin = end + 1;
+            const size_t first = line.find_first_not_of(" \t\r");
+            if (first == std::string_view::npos || line[first] == '#') {
+                continue;
+            }
+            parsed++;
+            if (!ParseFactorLine(line, &number, &factors)) {
+                report(chunk, offset, "not of the form n = p^a * q^b");
+                continue;
+            }
+            if (factors.Product() != number || number < 2) {
+                report(chunk, offset, number.get_str() + " does not match its factors " + factors.GetString());
+                continue;
+            }
+            bool prime = true;
+            for (const auto& [factor, count] : factors.ToVector()) {
+                if (!is_prime.Check(factor)) {
+                    report(chunk, offset, number.get_str() + " has a composite factor " + factor.get_str());
+                    prime = false;
+                    break;
+                }
+            }
+            if (prime) {
+                bulk.Add(number, factors);
+            }
+        }
+        lines += parsed;
+        std::lock_guard<std::mutex> lock(output_mutex);
+        PrintProgress("Parsing chunks", ++finished, chunks.size());
+    });
+
+    const uint64_t imported = bulk.Records();
+    const uint64_t written = bulk.Finish();
+    cache.Close();
+    std::cout << "Lines: " << lines << std::endl;
+    std::cout << "Imported: " << imported << std::endl;
+    std::cout << "Rejected: " << problems << std::endl;
+    std::cout << "Distinct keys written: " << written << std::endl;
+    return problems == 0 ? 0 : 1;
+}
+
+int main(
+    int argc,
+    char* argv[]
+)
+{
+    if (argc < 2) {
+        std::cerr << HELP_STRING << std::endl;
+        return 1;
+    }
+
+    const std::string_view command = argv[1];
+    size_t shards = 0;
+    std::vector<std::string_view> paths;
+    for (int i = 2; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        if (arg == "-s" && i + 1 < argc) {
+            shards = static_cast<size_t>(std::stoul(argv[++i]));
+        } else if (arg == "-h" || arg == "--help") {
+            std::cout << HELP_STRING << std::endl;
+            return 0;
+        } else {
+            paths.push_back(arg);
+        }
+    }
+    if (command == "-h" || command == "--help") {
+        std::cout << HELP_STRING << std::endl;
+        return 0;
+    }
+
+    try {
+        if (command == "verify" && paths.size() == 1) {
+            return Verify(paths[0]);
+        }
+        if (command == "merge" && paths.size() >= 2) {
+            return Merge(shards, paths[0], std::vector<std::string_view>(paths.begin() + 1, paths.end()));
+        }
+        if (command == "compact" && paths.size() == 1) {
+            return Compact(shards, paths[0]);
+        }
+        if (command == "import" && paths.size() >= 2) {
+            return Import(paths[0], std::vector<std::string_view>(paths.begin() + 1, paths.end()));
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "cachetool " << command << " failed: " << e.what() << std::endl;
+        return 1;
+    }
+    std::cerr << HELP_STRING << std::endl;
+    return 1;
+}
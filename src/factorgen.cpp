@@ -1,10 +1,117 @@
+#include <algorithm>
+#include <atomic>
 #include <iostream>
-#include <cmath>
+#include <limits>
+#include <memory>
+#include <span>
 #include <string_view>
+#include <thread>
 
 #include "factors.hpp"
 #include "primefactorcache.hpp"
 #include "primefactors.hpp"
+#include "sieve.hpp"
+
+// Fill Tuple from position Level on with primes from index From, keeping
+// it non-decreasing. Products[i] is the product of the first i primes.
+template <typename Visitor>
+uint64_t
+ExtendFactorTuple(
+    const std::span<const uint64_t> Primes,
+    const size_t Level,
+    const size_t From,
+    const size_t StartIndex,
+    const mpz_class& MaxProduct,
+    std::vector<uint64_t>& Tuple,
+    std::vector<mpz_class>& Products,
+    Visitor& Emit
+)
+{
+    const size_t count = Tuple.size();
+    const bool last = Level + 1 == count;
+    // Only the last prime, the largest, has to reach StartIndex
+    const size_t begin = last ? std::max(From, StartIndex) : From;
+    thread_local mpz_class lowest;
+    uint64_t emitted = 0;
+    for (size_t index = begin; index < Primes.size(); ++index) {
+        Products[Level + 1] = Products[Level] * Primes[index];
+        if (MaxProduct != 0) {
+            // Every later prime is at least this one
+            mpz_ui_pow_ui(lowest.get_mpz_t(), Primes[index], count - Level - 1);
+            lowest *= Products[Level + 1];
+            if (lowest > MaxProduct) {
+                break;
+            }
+        }
+        Tuple[Level] = Primes[index];
+        if (last) {
+            Emit(std::span<const uint64_t>(Tuple), Products[count]);
+            emitted++;
+        } else {
+            emitted += ExtendFactorTuple(Primes, Level + 1, index, StartIndex, MaxProduct, Tuple, Products, Emit);
+        }
+    }
+    return emitted;
+}
+
+// Calls Emit(primes, product) for every non-decreasing tuple of Count
+// primes whose largest prime is at least SmallestFactor and whose product
+// is at most MaxProduct (0 for no bound). Each multiset is visited once,
+// where its permutations would be up to 24 records for 4 factors. Tuples
+// are split by their smallest prime over NumThreads threads, which each
+// take the next one when they finish since small primes have the most.
+template <typename Visitor>
+uint64_t
+ForEachFactorTuple(
+    const std::span<const uint64_t> Primes,
+    const size_t Count,
+    const uint64_t SmallestFactor,
+    const mpz_class& MaxProduct,
+    const size_t NumThreads,
+    Visitor&& Emit
+)
+{
+    const size_t start_index = static_cast<size_t>(
+        std::lower_bound(Primes.begin(), Primes.end(), SmallestFactor) - Primes.begin()
+    );
+    if (Count == 0) {
+        return 0;
+    }
+    std::atomic<size_t> next_first = 0;
+    std::atomic<uint64_t> emitted = 0;
+    auto work = [&]() {
+        std::vector<uint64_t> tuple(Count);
+        std::vector<mpz_class> products(Count + 1, 1);
+        mpz_class lowest;
+        for (size_t first = next_first++; first < Primes.size(); first = next_first++) {
+            const uint64_t prime = Primes[first];
+            if (MaxProduct != 0) {
+                mpz_ui_pow_ui(lowest.get_mpz_t(), prime, Count);
+                if (lowest > MaxProduct) {
+                    // Nor will any larger smallest prime
+                    break;
+                }
+            }
+            tuple[0] = prime;
+            products[1] = prime;
+            if (Count > 1) {
+                emitted += ExtendFactorTuple(Primes, 1, first, start_index, MaxProduct, tuple, products, Emit);
+            } else if (first >= start_index) {
+                Emit(std::span<const uint64_t>(tuple), products[1]);
+                emitted++;
+            }
+        }
+    };
+    std::vector<std::thread> threads;
+    for (size_t t = 1; t < NumThreads; ++t) {
+        threads.emplace_back(work);
+    }
+    work();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    return emitted;
+}
 
 const size_t
 GenerateFactors(
@@ -13,113 +120,64 @@ GenerateFactors(
     const size_t MinNumFactors,
     const size_t MaxNumFactors,
     const uint64_t SmallestFactor,
-    const std::string_view Output
+    const mpz_class& MaxProduct,
+    const size_t NumThreads,
+    const std::string_view Output,
+    const std::string_view CacheSocket
 )
 {
-    // First generate a list of primes in the range [min_prime, max_prime]
+    // Sieve the primes in [MinPrime, MaxPrime]
     std::vector<uint64_t> primes;
-    mpz_class candidate = MinPrime;
-    while (candidate <= MaxPrime) {
-        if (mpz_probab_prime_p(candidate.get_mpz_t(), 25)) {
-            primes.push_back(candidate.get_ui());
-        }
-        mpz_nextprime(candidate.get_mpz_t(), candidate.get_mpz_t());
-    }
-    const size_t num_primes = primes.size();
-    
-    // Now find the index of the SmallestFactor
-    size_t start_index = 0;
-    for (size_t i = 0; i < primes.size(); ++i) {
-        if (primes[i] >= SmallestFactor) {
-            start_index = i;
-            break;
+    for (const uint32_t prime : SieveBasePrimes(MaxPrime)) {
+        if (prime >= MinPrime) {
+            primes.push_back(prime);
         }
     }
 
     // Create the prime factor cache
     PrimeFactorCache cache(Output);
-
-    // Calculte the total number of products we will generate
-    size_t total_products = 0;
-    for (size_t n = MinNumFactors; n <= MaxNumFactors; ++n) {
-        total_products += static_cast<size_t>(std::pow(num_primes - start_index, n));
-    }
-    std::cerr << "Generating approximately " << total_products << " products..." << std::endl;
-
-    // Now generate products of factors
-    size_t calculated = 0;
-    size_t num_factors = 2;
-    PrimeFactors factors;
-    if (MinNumFactors >= 2) {
-        for (size_t a = start_index; a < num_primes; ++a) {
-            for (size_t b = 0; b < num_primes; ++b) {
-                factors.Clear();
-                factors.AddFactor(primes[a]);
-                factors.AddFactor(primes[b]);
-                cache.Write(factors);
-                calculated++;
-
-                if (calculated % 1000000 == 0) {
-                    std::cerr << "\r" << num_factors << "/" << MaxNumFactors << " "
-                    << calculated << "/" << total_products << "("
-                    << (static_cast<double>(calculated) / total_products) * 100 << "%)" << std::flush;
-                }
-            }
-        }
+    // Products arrive in no useful order, so they are bulk loaded unless
+    // a daemon owns the cache
+    std::unique_ptr<PrimeFactorCache<>::BulkWriter> bulk;
+    if (!CacheSocket.empty()) {
+        cache.Connect(CacheSocket);
+    } else {
+        bulk = std::make_unique<PrimeFactorCache<>::BulkWriter>(cache);
     }
 
-    // Handle three factors
-    if (MaxNumFactors >= 3) {
-        num_factors = 3;
-        for (size_t a = start_index; a < num_primes; ++a) {
-            for (size_t b = 0; b < num_primes; ++b) {
-                for (size_t c = 0; c < num_primes; ++c) {
-                    factors.Clear();
-                    factors.AddFactor(primes[a]);
-                    factors.AddFactor(primes[b]);
-                    factors.AddFactor(primes[c]);
-                    cache.Write(factors);
-                    calculated++;
-
-                    if (calculated % 1000000 == 0) {
-                        std::cerr << "\r" << num_factors << "/" << MaxNumFactors << " "
-                        << calculated << "/" << total_products << "("
-                        << (static_cast<double>(calculated) / total_products) * 100 << "%)" << std::flush;
-                    }
-                }
-            }
+    std::atomic<uint64_t> calculated = 0;
+    auto emit = [&](const std::span<const uint64_t> Tuple, const mpz_class& Product) {
+        thread_local PrimeFactors factors;
+        factors.Clear();
+        for (const uint64_t prime : Tuple) {
+            factors.AddFactor(prime);
+        }
+        if (bulk) {
+            bulk->Add(Product, factors);
+        } else {
+            cache.Write(factors);
+        }
+        if (++calculated % 1000000 == 0) {
+            std::cerr << "\r" << calculated << " products" << std::flush;
         }
+    };
+
+    std::cerr << "Generating products of " << MinNumFactors << " to " << MaxNumFactors << " of "
+        << primes.size() << " primes on " << NumThreads << " threads..." << std::endl;
+    for (size_t num_factors = MinNumFactors; num_factors <= MaxNumFactors; ++num_factors) {
+        const uint64_t count = ForEachFactorTuple(primes, num_factors, SmallestFactor, MaxProduct, NumThreads, emit);
+        std::cerr << "\r" << num_factors << " factors: " << count << " products" << std::endl;
     }
 
-    // Handle four factors
-    if (MaxNumFactors >= 4) {
-        num_factors = 4;
-        for (size_t a = start_index; a < num_primes; ++a) {
-            for (size_t b = 0; b < num_primes; ++b) {
-                for (size_t c = 0; c < num_primes; ++c) {
-                    for (size_t d = 0; d < num_primes; ++d) {
-                        factors.Clear();
-                        factors.AddFactor(primes[a]);
-                        factors.AddFactor(primes[b]);
-                        factors.AddFactor(primes[c]);
-                        factors.AddFactor(primes[d]);
-                        cache.Write(factors);
-                        calculated++;
-
-                        if (calculated % 1000000 == 0) {
-                            std::cerr << "\r" << num_factors << "/" << MaxNumFactors << " "
-                            << calculated << "/" << total_products << "("
-                            << (static_cast<double>(calculated) / total_products) * 100 << "%)" << std::flush;
-                        }
-                    }
-                }
-            }
-        }
+    if (bulk) {
+        bulk->Finish();
     }
-    
     cache.Close();
-    std::cerr << std::endl;
     std::cerr << "Generated " << calculated << " products." << std::endl;
+    // The daemon owns the files when writing through it
+    if (!CacheSocket.empty()) {
+        return 0;
+    }
     std::cerr << "Sorting cache files..." << std::endl;
     cache.Sort();
     std::cerr << "Done sorting cache files." << std::endl;
@@ -151,7 +209,10 @@ int main(
     uint64_t smallest_factor = 1007;
     size_t min_num_factors = 2;
     size_t max_num_factors = 4;
+    mpz_class max_product = 0;
+    size_t num_threads = std::thread::hardware_concurrency();
     std::string_view output;
+    std::string_view cache_socket;
 
     for (int i = 1; i < argc; ++i) {
         std::string_view arg = argv[i];
@@ -168,6 +229,15 @@ int main(
             smallest_factor = uint64_t(1) << power;
         } else if (arg == "-n" && i + 1 < argc) {
             smallest_factor = static_cast<uint64_t>(std::stoull(argv[++i]));
+        } else if (arg == "-B" && i + 1 < argc) {
+            if (max_product.set_str(argv[++i], 10) != 0 || max_product < 0) {
+                std::cerr << "Error: Invalid maximum product: " << argv[i] << std::endl;
+                return 1;
+            }
+        } else if (arg == "-t" && i + 1 < argc) {
+            num_threads = static_cast<size_t>(std::stoul(argv[++i]));
+        } else if (arg == "--cache-socket" && i + 1 < argc) {
+            cache_socket = argv[++i];
         } else if (arg == "-h" || arg == "--help") {
             std::cout << "Usage: factorgen [options] <output>" << std::endl;
             std::cout << "Options:" << std::endl;
@@ -177,6 +247,10 @@ int main(
             std::cout << "  -F <N>    Maximum number of factors (default 4)" << std::endl;
             std::cout << "  -2 <N>    Set smallest factor value to 2^N" << std::endl;
             std::cout << "  -n <N>    Set smallest factor value to N" << std::endl;
+            std::cout << "  -B <N>    Only generate products up to N" << std::endl;
+            std::cout << "  -t <N>    Number of threads (default all cores)" << std::endl;
+            std::cout << "  --cache-socket <path>" << std::endl;
+            std::cout << "            Write through aliquot-cached instead of to <output>" << std::endl;
             return 0;
         } else {
             output = arg;
@@ -189,7 +263,16 @@ int main(
         return 1;
     }
 
-    if (output.empty()) {
+    if (max_prime > std::numeric_limits<uint32_t>::max()) {
+        std::cerr << "Error: Maximum prime must be below 2^32." << std::endl;
+        return 1;
+    }
+
+    if (num_threads == 0) {
+        num_threads = 1;
+    }
+
+    if (output.empty() && cache_socket.empty()) {
         std::cerr << "Error: Output file not specified." << std::endl;
         return 1;
     }
@@ -221,7 +304,10 @@ int main(
         min_num_factors,
         max_num_factors,
         smallest_factor,
-        output
+        max_product,
+        num_threads,
+        output,
+        cache_socket
     );
 
 }
\ No newline at end of file
@@ -4,6 +4,8 @@
 #include <cinttypes>
 #include <map>
 #include <sstream>
+#include <string>
+#include <string_view>
 #include <vector>
 
 #include <gmpxx.h>
@@ -17,6 +19,13 @@ public:
         m_FactorCounts[Factor]++;
     }
 
+    void AddFactor(
+        const mpz_class& Factor,
+        const size_t Count
+    ) {
+        m_FactorCounts[Factor] += Count;
+    }
+
     void Update(
         const PrimeFactors& Other
     ) {
@@ -130,6 +139,24 @@ public:
         return prod;
     }
 
+    // The sum of all divisors of the product, including itself, as the
+    // product over p^k of (p^(k+1) - 1) / (p - 1), so no divisor is built
+    mpz_class
+    Sigma(
+        void
+    ) const {
+        std::vector<mpz_class> terms;
+        terms.reserve(m_FactorCounts.size());
+        for (const auto& [prime, count] : m_FactorCounts) {
+            mpz_class& term = terms.emplace_back();
+            mpz_pow_ui(term.get_mpz_t(), prime.get_mpz_t(), count + 1);
+            term -= 1;
+            const mpz_class divisor = prime - 1;
+            mpz_divexact(term.get_mpz_t(), term.get_mpz_t(), divisor.get_mpz_t());
+        }
+        return ProductTree(terms);
+    }
+
     uint64_t
     Product64(
         void
@@ -189,5 +216,92 @@ public:
             })->second;
     }
 private:
+    // Multiply Terms in pairs, level by level, so the large products are
+    // formed from operands of similar size where GMP multiplies fastest
+    static mpz_class
+    ProductTree(
+        std::vector<mpz_class>& Terms
+    ) {
+        if (Terms.empty()) {
+            return 1;
+        }
+        while (Terms.size() > 1) {
+            const size_t half = (Terms.size() + 1) / 2;
+            for (size_t i = 0; i < Terms.size() / 2; ++i) {
+                Terms[i] = Terms[2 * i] * Terms[2 * i + 1];
+            }
+            if (Terms.size() % 2 != 0) {
+                Terms[half - 1] = std::move(Terms.back());
+            }
+            Terms.resize(half);
+        }
+        return std::move(Terms.front());
+    }
+
     std::map<mpz_class, size_t> m_FactorCounts;
-};
\ No newline at end of file
+};
+
+// Parse a line of the form "n = p^a * q^b", a number followed by the
+// factors as GetString writes them. Exponents of 1 may be left out and
+// spaces and tabs are ignored. Nothing is checked beyond the form, the
+// factors need not be prime or multiply out to n.
+inline bool
+ParseFactorLine(
+    const std::string_view Line,
+    mpz_class* Number,
+    PrimeFactors* Factors
+)
+{
+    thread_local std::string digits;
+    size_t position = 0;
+    auto skip_space = [&]() {
+        while (position < Line.size() && (Line[position] == ' ' || Line[position] == '\t' || Line[position] == '\r')) {
+            position++;
+        }
+    };
+    auto read_number = [&](mpz_class* Value) {
+        skip_space();
+        const size_t start = position;
+        while (position < Line.size() && Line[position] >= '0' && Line[position] <= '9') {
+            position++;
+        }
+        if (position == start) {
+            return false;
+        }
+        digits.assign(Line.substr(start, position - start));
+        return Value->set_str(digits, 10) == 0;
+    };
+
+    Factors->Clear();
+    if (!read_number(Number)) {
+        return false;
+    }
+    skip_space();
+    if (position == Line.size() || Line[position++] != '=') {
+        return false;
+    }
+    mpz_class prime;
+    mpz_class exponent;
+    while (true) {
+        if (!read_number(&prime)) {
+            return false;
+        }
+        skip_space();
+        size_t count = 1;
+        if (position < Line.size() && Line[position] == '^') {
+            position++;
+            if (!read_number(&exponent) || exponent == 0 || !exponent.fits_ulong_p()) {
+                return false;
+            }
+            count = exponent.get_ui();
+        }
+        Factors->AddFactor(prime, count);
+        skip_space();
+        if (position == Line.size()) {
+            return true;
+        }
+        if (Line[position++] != '*') {
+            return false;
+        }
+    }
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cerrno>
+#include <filesystem>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+// An exclusive flock(2) on a file, held until the object is destroyed.
+// Every FileLock opens the file afresh and flock locks belong to the open
+// file, so threads of one process exclude each other as well as other
+// processes. The lock goes away with the process if it dies holding it.
+class FileLock {
+public:
+    // Without Wait the constructor gives up at once if the lock is taken,
+    // check Held afterwards
+    FileLock(
+        const std::filesystem::path& Path,
+        const bool Wait = true
+    ) {
+        m_Fd = open(Path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (m_Fd < 0) {
+            throw std::runtime_error("Failed to open lock file: " + Path.string());
+        }
+        int result = 0;
+        do {
+            result = flock(m_Fd, LOCK_EX | (Wait ? 0 : LOCK_NB));
+        } while (result != 0 && errno == EINTR);
+        if (result != 0) {
+            const int error = errno;
+            close(m_Fd);
+            m_Fd = -1;
+            if (!Wait && error == EWOULDBLOCK) {
+                return;
+            }
+            throw std::runtime_error("Failed to lock: " + Path.string());
+        }
+    }
+
+    FileLock(
+        const FileLock&
+    ) = delete;
+
+    FileLock&
+    operator=(
+        const FileLock&
+    ) = delete;
+
+    ~FileLock() {
+        if (m_Fd >= 0) {
+            close(m_Fd);
+        }
+    }
+
+    bool
+    Held(
+        void
+    ) const {
+        return m_Fd >= 0;
+    }
+
+private:
+    int m_Fd = -1;
+};
@@ -0,0 +1,228 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+#include <gmpxx.h>
+
+#include "cacheformat.hpp"
+#include "factors.hpp"
+
+constexpr size_t kHotCacheShards = 16;
+constexpr size_t kHotCacheDefaultBytes = 64 << 20;
+
+// Recently used factorisations held in memory in front of the on-disk
+// cache. Keys are spread over kHotCacheShards shards, each with its own
+// lock, and each shard evicts with the CLOCK algorithm once it passes its
+// share of the memory budget. Safe to use from any number of threads.
+class HotFactorCache {
+public:
+    HotFactorCache(
+        const size_t BudgetBytes = kHotCacheDefaultBytes
+    ) {
+        SetBudget(BudgetBytes);
+    }
+
+    // Lowering the budget evicts straight away
+    void
+    SetBudget(
+        const size_t BudgetBytes
+    ) {
+        m_ShardBudget.store(BudgetBytes / kHotCacheShards, std::memory_order_relaxed);
+        for (Shard& shard : m_Shards) {
+            std::lock_guard<std::mutex> lock(shard.Mutex);
+            Evict(shard, 0);
+        }
+    }
+
+    size_t
+    GetBudget(
+        void
+    ) const {
+        return m_ShardBudget.load(std::memory_order_relaxed) * kHotCacheShards;
+    }
+
+    std::optional<PrimeFactors>
+    Get(
+        const mpz_class& Key
+    ) {
+        const uint64_t hash = HashKey(Key);
+        Shard& shard = GetShard(hash);
+        {
+            std::lock_guard<std::mutex> lock(shard.Mutex);
+            auto found = shard.Index.find(Key);
+            if (found != shard.Index.end()) {
+                Entry& entry = shard.Entries[found->second];
+                entry.Referenced = true;
+                m_Hits.fetch_add(1, std::memory_order_relaxed);
+                return entry.Factors;
+            }
+        }
+        m_Misses.fetch_add(1, std::memory_order_relaxed);
+        return std::nullopt;
+    }
+
+    void
+    Put(
+        const mpz_class& Key,
+        const PrimeFactors& Factors
+    ) {
+        const size_t bytes = EstimateBytes(Key, Factors);
+        if (bytes > m_ShardBudget.load(std::memory_order_relaxed)) {
+            return;
+        }
+        Shard& shard = GetShard(HashKey(Key));
+        std::lock_guard<std::mutex> lock(shard.Mutex);
+        auto found = shard.Index.find(Key);
+        if (found != shard.Index.end()) {
+            Entry& entry = shard.Entries[found->second];
+            shard.Bytes -= entry.Bytes;
+            entry.Factors = Factors;
+            entry.Bytes = bytes;
+            entry.Referenced = true;
+            shard.Bytes += bytes;
+            return;
+        }
+        Evict(shard, bytes);
+        // New entries start unreferenced so a burst of one-off keys is
+        // evicted before anything that has been looked up
+        shard.Index.emplace(Key, shard.Entries.size());
+        shard.Entries.push_back(Entry{Key, Factors, bytes, false});
+        shard.Bytes += bytes;
+    }
+
+    void
+    Clear(
+        void
+    ) {
+        for (Shard& shard : m_Shards) {
+            std::lock_guard<std::mutex> lock(shard.Mutex);
+            shard.Entries.clear();
+            shard.Index.clear();
+            shard.Hand = 0;
+            shard.Bytes = 0;
+        }
+    }
+
+    uint64_t
+    Hits(
+        void
+    ) const {
+        return m_Hits.load(std::memory_order_relaxed);
+    }
+
+    uint64_t
+    Misses(
+        void
+    ) const {
+        return m_Misses.load(std::memory_order_relaxed);
+    }
+
+    size_t
+    Entries(
+        void
+    ) {
+        size_t entries = 0;
+        for (Shard& shard : m_Shards) {
+            std::lock_guard<std::mutex> lock(shard.Mutex);
+            entries += shard.Entries.size();
+        }
+        return entries;
+    }
+
+    size_t
+    Bytes(
+        void
+    ) {
+        size_t bytes = 0;
+        for (Shard& shard : m_Shards) {
+            std::lock_guard<std::mutex> lock(shard.Mutex);
+            bytes += shard.Bytes;
+        }
+        return bytes;
+    }
+
+private:
+    struct Entry {
+        mpz_class Key;
+        PrimeFactors Factors;
+        size_t Bytes;
+        bool Referenced;
+    };
+
+    struct KeyHash {
+        size_t
+        operator()(
+            const mpz_class& Key
+        ) const {
+            return HashKey(Key);
+        }
+    };
+
+    struct Shard {
+        std::mutex Mutex;
+        std::vector<Entry> Entries;
+        std::unordered_map<mpz_class, size_t, KeyHash> Index;
+        size_t Hand = 0;
+        size_t Bytes = 0;
+    };
+
+    // Rough heap footprint of an entry, counting map nodes and limbs
+    static size_t
+    EstimateBytes(
+        const mpz_class& Key,
+        const PrimeFactors& Factors
+    ) {
+        size_t bytes = sizeof(Entry) + 64 + mpz_size(Key.get_mpz_t()) * sizeof(mp_limb_t);
+        for (const auto& [prime, count] : Factors.ToVector()) {
+            bytes += 64 + mpz_size(prime.get_mpz_t()) * sizeof(mp_limb_t);
+        }
+        return bytes;
+    }
+
+    Shard&
+    GetShard(
+        const uint64_t Hash
+    ) {
+        return m_Shards[ReduceHash(Hash, kHotCacheShards)];
+    }
+
+    // Sweep the clock hand until Incoming more bytes fit. A referenced
+    // entry gets a second chance, anything else is evicted.
+    void
+    Evict(
+        Shard& shard,
+        const size_t Incoming
+    ) {
+        const size_t budget = m_ShardBudget.load(std::memory_order_relaxed);
+        while (!shard.Entries.empty() && shard.Bytes + Incoming > budget) {
+            if (shard.Hand >= shard.Entries.size()) {
+                shard.Hand = 0;
+            }
+            Entry& entry = shard.Entries[shard.Hand];
+            if (entry.Referenced) {
+                entry.Referenced = false;
+                shard.Hand++;
+                continue;
+            }
+            shard.Bytes -= entry.Bytes;
+            shard.Index.erase(entry.Key);
+            // Fill the hole with the last entry, the hand looks at it next
+            if (shard.Hand + 1 != shard.Entries.size()) {
+                entry = std::move(shard.Entries.back());
+                shard.Index[entry.Key] = shard.Hand;
+            }
+            shard.Entries.pop_back();
+        }
+    }
+
+    std::array<Shard, kHotCacheShards> m_Shards;
+    std::atomic<size_t> m_ShardBudget;
+    std::atomic<uint64_t> m_Hits = 0;
+    std::atomic<uint64_t> m_Misses = 0;
+};
@@ -75,44 +75,21 @@ private:
     ) {
         // Scan through to find the largest prime
         m_MaxPrime = 2;
-        size_t gap_index = 1; // Start after the first gap which is for prime 2
-        while (gap_index < PrimeGaps.size()) {
-            // Get the next VLE-encoded gap
-            uint64_t gap = 0;
-            uint8_t shift = 0;
-            uint8_t byte;
-            do {
-                if (gap_index >= PrimeGaps.size()) {
-                    throw std::runtime_error("Ran out of prime gaps");
-                }
-                byte = PrimeGaps[gap_index];
-                gap |= static_cast<uint64_t>(byte & 0x7F) << shift;
-                shift += 7;
-                gap_index++;
-            } while ((byte & 0x80) != 0);
-            m_MaxPrime += gap;
-        }
+        ForEachPrime(PrimeGaps, [this](const uint64_t Prime) {
+            m_MaxPrime = Prime;
+            return true;
+        });
         
         // Initialize the sieve. We don't store even numbers, so the number of entries is m_MaxPrime / 2 + 1
         m_SmallPrimes.resize(m_MaxPrime / 2 + 1, false);
         
-        // Now mark odd primes using the gaps (skip prime 2 since it's handled separately in check())
-        uint64_t prime = 2;
-        gap_index = 1; // Reset to start after the first gap
-        while (gap_index < PrimeGaps.size()) {
-            // Get the next VLE-encoded gap
-            uint64_t gap = 0;
-            uint8_t shift = 0;
-            uint8_t byte;
-            do {
-                byte = PrimeGaps[gap_index];
-                gap |= static_cast<uint64_t>(byte & 0x7F) << shift;
-                shift += 7;
-                gap_index++;
-            } while ((byte & 0x80) != 0);
-            prime += gap;
-            m_SmallPrimes[prime >> 1] = true;
-        }
+        // Now mark odd primes (skip prime 2 since it's handled separately in check())
+        ForEachPrime(PrimeGaps, [this](const uint64_t Prime) {
+            if (Prime != 2) {
+                m_SmallPrimes[Prime >> 1] = true;
+            }
+            return true;
+        });
     }
 
     std::vector<bool> m_SmallPrimes;
@@ -1,3 +1,4 @@
+#include <chrono>
 #include <iostream>
 #include <thread>
 
@@ -11,6 +12,14 @@ Usage: aliquot [options] <number>
 Options:
     -p <file>   Load prime gaps from file
     -c <path>   Path to prime factor cache
+    --cache-socket <path>
+                Use the cache served by aliquot-cached at this socket
+    --admit-us <N>
+                Only write factorizations that took at least N
+                microseconds to the cache, or that are seen twice
+                (default 100, 0 writes all)
+    --stats     Print cache hit rates, bytes read and latencies as JSON
+                to stderr when the sequence ends
     -h, --help  Show this help message
 )";
 
@@ -26,8 +35,11 @@ int main(
 
     std::string_view prime_gaps;
     std::string_view cache_path;
+    std::string_view cache_socket;
     mpz_class number;
     size_t num_threads = 0;
+    bool stats = false;
+    std::chrono::microseconds admit_threshold = kDefaultAdmitThreshold;
 
     for (int i = 1; i < argc; ++i) {
         std::string_view arg = argv[i];
@@ -39,6 +51,12 @@ int main(
             }
         } else if ((arg == "-c" || arg == "--cache") && i + 1 < argc) {
             cache_path = argv[++i];
+        } else if (arg == "--cache-socket" && i + 1 < argc) {
+            cache_socket = argv[++i];
+        } else if (arg == "--admit-us" && i + 1 < argc) {
+            admit_threshold = std::chrono::microseconds(std::stoull(argv[++i]));
+        } else if (arg == "--stats") {
+            stats = true;
         } else if ((arg == "-t" || arg == "--threads") && i + 1 < argc) {
             num_threads = static_cast<size_t>(std::stoul(argv[++i]));
         } else if (arg == "-h" || arg == "--help") {
@@ -60,7 +78,7 @@ int main(
 
     try {
         std::cout << "Aliquot sequence for " << number << ":" << std::endl;
-        auto sequence = AliquotSequence(number, cache_path, true, num_threads);
+        auto sequence = AliquotSequence(number, cache_path, true, num_threads, cache_socket, stats ? &std::cerr : nullptr, admit_threshold);
         return 0;
     } catch (const std::exception& ex) {
         std::cerr << "Error during prime factorization: " << ex.what() << std::endl;
@@ -0,0 +1,178 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <span>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// A read-only memory mapping of a whole file that stays valid until the
+// object is closed or destroyed. The file stays open too, for reads that
+// bypass the mapping.
+class MappedFile {
+public:
+    MappedFile(void) = default;
+
+    MappedFile(
+        const MappedFile&
+    ) = delete;
+
+    MappedFile&
+    operator=(
+        const MappedFile&
+    ) = delete;
+
+    MappedFile(
+        MappedFile&& Other
+    ) noexcept {
+        *this = std::move(Other);
+    }
+
+    MappedFile&
+    operator=(
+        MappedFile&& Other
+    ) noexcept {
+        if (this != &Other) {
+            Close();
+            m_Data = std::exchange(Other.m_Data, nullptr);
+            m_Size = std::exchange(Other.m_Size, 0);
+            m_Fd = std::exchange(Other.m_Fd, -1);
+            m_Open = std::exchange(Other.m_Open, false);
+            m_Locked = std::exchange(Other.m_Locked, false);
+        }
+        return *this;
+    }
+
+    ~MappedFile() {
+        Close();
+    }
+
+    // Populate pre-faults the whole mapping so the first lookups don't
+    // page fault
+    bool
+    Open(
+        const std::filesystem::path& Path,
+        const bool Populate = false
+    ) {
+        Close();
+        std::error_code error;
+        const size_t size = std::filesystem::file_size(Path, error);
+        if (error) {
+            return false;
+        }
+        const int fd = open(Path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return false;
+        }
+        if (size == 0) {
+            // Nothing to map but the file exists
+            m_Fd = fd;
+            m_Open = true;
+            return true;
+        }
+        int flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+        if (Populate) {
+            flags |= MAP_POPULATE;
+        }
+#endif
+        void* map = mmap(nullptr, size, PROT_READ, flags, fd, 0);
+        if (map == MAP_FAILED) {
+            close(fd);
+            return false;
+        }
+        m_Data = static_cast<const uint8_t*>(map);
+        m_Size = size;
+        m_Fd = fd;
+        m_Open = true;
+        return true;
+    }
+
+    void
+    Close(
+        void
+    ) {
+        if (m_Data != nullptr) {
+            if (m_Locked) {
+                munlock(m_Data, m_Size);
+            }
+            munmap(const_cast<uint8_t*>(m_Data), m_Size);
+        }
+        if (m_Fd >= 0) {
+            close(m_Fd);
+        }
+        m_Data = nullptr;
+        m_Fd = -1;
+        m_Size = 0;
+        m_Open = false;
+        m_Locked = false;
+    }
+
+    // Pin the mapping in RAM. Fails quietly if RLIMIT_MEMLOCK is too low,
+    // the mapping is still usable.
+    bool
+    Lock(
+        void
+    ) {
+        if (m_Data == nullptr || m_Locked) {
+            return m_Locked;
+        }
+        m_Locked = mlock(m_Data, m_Size) == 0;
+        return m_Locked;
+    }
+
+    const bool
+    IsOpen(
+        void
+    ) const {
+        return m_Open;
+    }
+
+    const bool
+    IsLocked(
+        void
+    ) const {
+        return m_Locked;
+    }
+
+    size_t
+    Size(
+        void
+    ) const {
+        return m_Size;
+    }
+
+    // -1 unless open
+    int
+    Fd(
+        void
+    ) const {
+        return m_Fd;
+    }
+
+    std::span<const uint8_t>
+    Data(
+        void
+    ) const {
+        return std::span<const uint8_t>(m_Data, m_Size);
+    }
+
+    template <typename T>
+    std::span<const T>
+    As(
+        void
+    ) const {
+        return std::span<const T>(reinterpret_cast<const T*>(m_Data), m_Size / sizeof(T));
+    }
+
+private:
+    const uint8_t* m_Data = nullptr;
+    size_t m_Size = 0;
+    int m_Fd = -1;
+    bool m_Open = false;
+    bool m_Locked = false;
+};
@@ -0,0 +1,242 @@
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "primecount.hpp"
+#include "sieve.hpp"
+
+// phi(x, a) for a <= kPhiTinyA repeats with period 2*3*5*7*11*13
+constexpr size_t kPhiTinyA = 6;
+constexpr uint64_t kPhiTinyPeriod = 30030;
+
+// phi(x, a) results are cached for small x and a, which is where the
+// recursion spends nearly all of its calls
+constexpr uint64_t kPhiCacheX = 1 << 16;
+constexpr size_t kPhiCacheA = 100;
+
+// Largest table of primes kept in memory, beyond sqrt(X) this only
+// saves recursion so it is capped
+constexpr uint64_t kMaxPrimeTable = 1ull << 27;
+
+static uint64_t
+IntegerRoot(
+    const uint64_t X,
+    const int Root
+)
+{
+    uint64_t r = static_cast<uint64_t>(std::pow(static_cast<double>(X), 1.0 / Root));
+    auto power = [Root](const uint64_t Base) {
+        // Saturating Base^Root
+        unsigned __int128 result = 1;
+        for (int i = 0; i < Root; ++i) {
+            result *= Base;
+            if (result > UINT64_MAX) {
+                return static_cast<unsigned __int128>(UINT64_MAX) + 1;
+            }
+        }
+        return result;
+    };
+    while (r > 0 && power(r) > X) {
+        r--;
+    }
+    while (power(r + 1) <= X) {
+        r++;
+    }
+    return r;
+}
+
+class LehmerCounter {
+public:
+    LehmerCounter(
+        const uint64_t X
+    ) {
+        const uint64_t root = IntegerRoot(X, 2);
+        const uint64_t cbrt = IntegerRoot(X, 3);
+        m_Limit = std::max<uint64_t>({root + 1, std::min(cbrt * cbrt, kMaxPrimeTable), 1 << 16});
+        m_Primes = SieveBasePrimes(m_Limit);
+
+        // Tabulate phi(n, a) for a <= kPhiTinyA over one period
+        for (size_t a = 0; a <= kPhiTinyA; ++a) {
+            m_PhiTiny[a].resize(kPhiTinyPeriod + 1);
+            uint32_t count = 0;
+            for (uint64_t n = 0; n <= kPhiTinyPeriod; ++n) {
+                bool coprime = n > 0;
+                for (size_t i = 0; i < a && coprime; ++i) {
+                    coprime = n % m_Primes[i] != 0;
+                }
+                count += coprime;
+                m_PhiTiny[a][n] = count;
+            }
+        }
+        m_PhiCache.resize(kPhiCacheA);
+    }
+
+    uint64_t
+    Pi(
+        const uint64_t X
+    ) {
+        if (X <= m_Limit) {
+            return std::upper_bound(m_Primes.begin(), m_Primes.end(), X) - m_Primes.begin();
+        }
+
+        const uint64_t a = Pi(IntegerRoot(X, 4));
+        const uint64_t b = Pi(IntegerRoot(X, 2));
+        const uint64_t c = Pi(IntegerRoot(X, 3));
+
+        int64_t sum = Phi(X, a) + static_cast<int64_t>((b + a - 2) * (b - a + 1) / 2);
+        for (uint64_t i = a + 1; i <= b; ++i) {
+            const uint64_t w = X / Prime(i);
+            sum -= Pi(w);
+            if (i <= c) {
+                const uint64_t bi = Pi(IntegerRoot(w, 2));
+                for (uint64_t j = i; j <= bi; ++j) {
+                    sum -= Pi(w / Prime(j)) - (j - 1);
+                }
+            }
+        }
+        return static_cast<uint64_t>(sum);
+    }
+
+private:
+    // Primes are 1-indexed to match the formula
+    uint64_t
+    Prime(
+        const uint64_t Index
+    ) const {
+        return m_Primes[Index - 1];
+    }
+
+    // Count of 1 <= n <= X with no prime factor among the first A primes
+    int64_t
+    Phi(
+        const uint64_t X,
+        const uint64_t A
+    ) {
+        if (A <= kPhiTinyA) {
+            const uint64_t period = m_PhiTiny[A][kPhiTinyPeriod];
+            return (X / kPhiTinyPeriod) * period + m_PhiTiny[A][X % kPhiTinyPeriod];
+        }
+        // Nothing but 1 survives below the next prime
+        const uint64_t next = Prime(A + 1);
+        if (X < next) {
+            return X > 0 ? 1 : 0;
+        }
+        // Everything that survives below next^2 is 1 or a prime
+        if (X <= m_Limit && X < next * next) {
+            return static_cast<int64_t>(Pi(X)) - static_cast<int64_t>(A) + 1;
+        }
+
+        const bool cacheable = X < kPhiCacheX && A < kPhiCacheA;
+        if (cacheable) {
+            auto& cache = m_PhiCache[A];
+            if (cache.empty()) {
+                cache.resize(kPhiCacheX, 0);
+            }
+            if (cache[X] != 0) {
+                return cache[X];
+            }
+        }
+
+        const int64_t result = Phi(X, A - 1) - Phi(X / Prime(A), A - 1);
+        if (cacheable) {
+            m_PhiCache[A][X] = static_cast<uint16_t>(result);
+        }
+        return result;
+    }
+
+    uint64_t m_Limit;
+    std::vector<uint32_t> m_Primes;
+    std::array<std::vector<uint32_t>, kPhiTinyA + 1> m_PhiTiny;
+    std::vector<std::vector<uint16_t>> m_PhiCache;
+};
+
+uint64_t
+PrimePi(
+    const uint64_t X
+)
+{
+    if (X < 2) {
+        return 0;
+    }
+    LehmerCounter counter(X);
+    return counter.Pi(X);
+}
+
+// Expand a sieved chunk back into its primes
+static std::vector<uint64_t>
+ChunkPrimes(
+    const PrimeGapChunk& Chunk
+)
+{
+    std::vector<uint64_t> primes;
+    if (Chunk.Count == 0) {
+        return primes;
+    }
+    primes.reserve(Chunk.Count);
+    uint64_t prime = Chunk.First;
+    primes.push_back(prime);
+    uint64_t gap = 0;
+    uint8_t shift = 0;
+    for (const uint8_t byte : Chunk.Gaps) {
+        gap |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        shift += 7;
+        if ((byte & 0x80) == 0) {
+            prime += gap;
+            primes.push_back(prime);
+            gap = 0;
+            shift = 0;
+        }
+    }
+    return primes;
+}
+
+uint64_t
+NthPrime(
+    const uint64_t N
+)
+{
+    if (N == 0) {
+        return 0;
+    }
+    if (N < 6) {
+        constexpr std::array<uint64_t, 6> small = {0, 2, 3, 5, 7, 11};
+        return small[N];
+    }
+
+    // Cipolla's estimate, usually within a fraction of a percent
+    const double n = static_cast<double>(N);
+    const double ln = std::log(n);
+    const double lnln = std::log(ln);
+    const uint64_t estimate = static_cast<uint64_t>(n * (ln + lnln - 1.0 + (lnln - 2.0) / ln));
+    uint64_t count = PrimePi(estimate);
+
+    // Sieve from the estimate towards the answer a segment at a time
+    const std::vector<uint32_t> base_primes = SieveBasePrimes(IntegerRoot(PrimeUpperBound(N), 2) + 1);
+    if (count >= N) {
+        // p_N <= estimate, walk down
+        uint64_t high = estimate + 1;
+        while (true) {
+            const uint64_t low = high > kSieveSegmentSize ? high - kSieveSegmentSize : 0;
+            const auto primes = ChunkPrimes(SieveSegment(low, high, base_primes));
+            if (count - primes.size() < N) {
+                return primes[N - (count - primes.size()) - 1];
+            }
+            count -= primes.size();
+            high = low;
+        }
+    }
+
+    // p_N > estimate, walk up
+    uint64_t low = estimate + 1;
+    while (true) {
+        const uint64_t high = low + kSieveSegmentSize;
+        const auto primes = ChunkPrimes(SieveSegment(low, high, base_primes));
+        if (count + primes.size() >= N) {
+            return primes[N - count - 1];
+        }
+        count += primes.size();
+        low = high;
+    }
+}
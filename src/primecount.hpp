@@ -0,0 +1,17 @@
+#pragma once
+
+#include <cstdint>
+
+// Number of primes <= X using Lehmer's formula, in roughly O(X^(3/4)) time
+// rather than visiting every prime
+uint64_t
+PrimePi(
+    const uint64_t X
+);
+
+// The Nth prime, counting from NthPrime(1) == 2. Lands near the answer
+// with an analytic estimate and PrimePi, then sieves the rest of the way.
+uint64_t
+NthPrime(
+    const uint64_t N
+);
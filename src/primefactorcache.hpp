@@ -1,19 +1,52 @@
 #pragma once
 
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
 #include <cinttypes>
+#include <condition_variable>
+#include <cstdio>
 #include <cstring>
+#include <deque>
 #include <filesystem>
 #include <fstream>
+#include <functional>
 #include <iostream>
+#include <iterator>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <optional>
+#include <signal.h>
 #include <span>
-#include <sys/mman.h>
 #include <string_view>
+#include <thread>
 #include <vector>
 
+#include "asyncreader.hpp"
+#include "cacheclient.hpp"
+#include "cacheformat.hpp"
+#include "cachestats.hpp"
+#include "cachemanifest.hpp"
+#include "cachesnapshot.hpp"
 #include "factors.hpp"
+#include "filelock.hpp"
+#include "hotcache.hpp"
+#include "mappedfile.hpp"
+#include "recordsort.hpp"
+
+// Factorizations found faster than this are only held in memory by Admit
+// until they are seen a second time
+constexpr std::chrono::microseconds kDefaultAdmitThreshold{100};
+
+// Reports how far a Sort has got, Done of Total steps of Stage
+using SortProgress = std::function<void(
+    const std::string_view Stage,
+    const size_t Done,
+    const size_t Total
+)>;
 
 template<size_t N = 1024> 
 struct BigNum {
@@ -85,23 +118,577 @@ struct FactorRecord {
     Factor<N> factors[0];  // Flexible array member
 };
 
+template<size_t N = 512>
+size_t
+FactorRecordSize(
+    const size_t NumFactors
+)
+{
+    return sizeof(FactorRecord<N>) + NumFactors * sizeof(Factor<N>);
+}
+
+// Reads a sorted version 1 factor file as version 2 records
+template<size_t N = 512>
+class LegacyFactorCursor : public RecordCursor {
+public:
+    LegacyFactorCursor(
+        const std::span<const uint8_t> Data,
+        const size_t NumFactors
+    ) : m_Data(Data), m_RecordSize(FactorRecordSize<N>(NumFactors)), m_NumFactors(NumFactors) {
+        Load();
+    }
+
+    bool
+    Valid(
+        void
+    ) const override {
+        return m_Offset + m_RecordSize <= m_Data.size();
+    }
+
+    const mpz_class&
+    Key(
+        void
+    ) const override {
+        return m_Key;
+    }
+
+    std::span<const uint8_t>
+    Payload(
+        void
+    ) const override {
+        return m_Payload;
+    }
+
+    void
+    Next(
+        void
+    ) override {
+        m_Offset += m_RecordSize;
+        Load();
+    }
+
+private:
+    void
+    Load(
+        void
+    ) {
+        if (!Valid()) {
+            return;
+        }
+        const FactorRecord<N>* record = reinterpret_cast<const FactorRecord<N>*>(m_Data.data() + m_Offset);
+        m_Key = record->product.ToMPZ();
+        m_Payload.clear();
+        AppendVarint(m_Payload, static_cast<uint64_t>(m_NumFactors));
+        for (size_t i = 0; i < m_NumFactors; ++i) {
+            AppendVarint(m_Payload, record->factors[i].value.ToMPZ());
+            AppendVarint(m_Payload, static_cast<uint64_t>(record->factors[i].count));
+        }
+    }
+
+    std::span<const uint8_t> m_Data;
+    size_t m_RecordSize;
+    size_t m_NumFactors;
+    size_t m_Offset = 0;
+    mpz_class m_Key;
+    std::vector<uint8_t> m_Payload;
+};
+
+// One immutable, sorted segment on disk. The base segment lives in base/
+// and every flushed or compacted run is another segment. A segment is a
+// directory of version 2 files, one per shard (see cacheformat.hpp),
+// except in caches written before that format, which keep an index file
+// per low byte and a fixed width factor file per number of distinct
+// primes in the cache root until they are migrated.
+template<size_t N = 512>
+class CacheSegment {
+public:
+    CacheSegment(
+        const std::filesystem::path& Path,
+        const bool Resident = false
+    ) : m_Path(Path) {
+        if (OpenShards(Resident)) {
+            return;
+        }
+        m_Legacy = true;
+        for (size_t i = 0; i < 256; ++i) {
+            MapIndex(static_cast<uint8_t>(i), Resident);
+        }
+        std::error_code error;
+        for (const auto& file : std::filesystem::directory_iterator(m_Path, error)) {
+            const std::string name = file.path().filename().string();
+            size_t num_factors = 0;
+            if (sscanf(name.c_str(), "factors_%zu.dat", &num_factors) == 1 &&
+                name == FactorPath(m_Path, num_factors).filename().string()) {
+                MapFactors(num_factors);
+            }
+        }
+    }
+
+    static std::filesystem::path
+    IndexPath(
+        const std::filesystem::path& Dir,
+        const uint8_t LowByte
+    ) {
+        return Dir / "index" / (std::to_string(LowByte) + ".idx");
+    }
+
+    static std::filesystem::path
+    FactorPath(
+        const std::filesystem::path& Dir,
+        const size_t NumFactors
+    ) {
+        return Dir / ("factors_" + std::to_string(NumFactors) + ".dat");
+    }
+
+    // A cursor over each file of the segment, a shard or, in a legacy
+    // segment, a factor file, reading it front to back
+    std::vector<std::unique_ptr<RecordCursor>>
+    FileCursors(
+        void
+    ) const {
+        std::vector<std::unique_ptr<RecordCursor>> cursors;
+        for (const CacheFile& file : m_Files) {
+            cursors.push_back(std::make_unique<CacheFile::Cursor>(file));
+        }
+        for (const auto& [num_factors, map] : m_FactorMaps) {
+            cursors.push_back(std::make_unique<LegacyFactorCursor<N>>(map.Data(), num_factors));
+        }
+        return cursors;
+    }
+
+    // Merge segments, ordered newest first, into Writer
+    template <typename Sink>
+    static uint64_t
+    Merge(
+        const std::vector<const CacheSegment<N>*>& Segments,
+        Sink& Writer
+    ) {
+        std::vector<std::unique_ptr<RecordCursor>> cursors;
+        for (const CacheSegment<N>* segment : Segments) {
+            auto files = segment->FileCursors();
+            std::move(files.begin(), files.end(), std::back_inserter(cursors));
+        }
+        return MergeCursors(Cursors(cursors), Writer);
+    }
+
+    // When every segment is sharded the same way as Writer, each shard is
+    // merged on its own thread and only compares keys within that shard.
+    // ShardDone is told how many shards are finished, from those threads.
+    static uint64_t
+    Merge(
+        const std::vector<const CacheSegment<N>*>& Segments,
+        ShardedCacheWriter& Writer,
+        const std::function<void(size_t Done, size_t Total)>& ShardDone = nullptr
+    ) {
+        for (const CacheSegment<N>* segment : Segments) {
+            if (segment->m_Legacy || segment->m_Files.size() != Writer.Shards()) {
+                const uint64_t written = Merge<ShardedCacheWriter>(Segments, Writer);
+                if (ShardDone) {
+                    ShardDone(1, 1);
+                }
+                return written;
+            }
+        }
+        std::atomic<uint64_t> written = 0;
+        std::atomic<size_t> finished = 0;
+        ForEachShard(Writer.Shards(), [&](const size_t Shard) {
+            std::vector<std::unique_ptr<RecordCursor>> cursors;
+            for (const CacheSegment<N>* segment : Segments) {
+                cursors.push_back(std::make_unique<CacheFile::Cursor>(segment->m_Files[Shard]));
+            }
+            written += MergeCursors(Cursors(cursors), Writer.Shard(Shard));
+            if (ShardDone) {
+                ShardDone(++finished, Writer.Shards());
+            }
+        });
+        return written;
+    }
+
+    // Look up Keys, which must be in increasing order, with one pass over
+    // each shard. Hashes[i] is HashKey(*Keys[i]). Calls Found(i, factors)
+    // for each key present.
+    template <typename Visitor>
+    void
+    FindSorted(
+        const std::span<const mpz_class* const> Keys,
+        const std::span<const uint64_t> Hashes,
+        Visitor&& Found
+    ) const {
+        if (m_Legacy) {
+            for (size_t i = 0; i < Keys.size(); ++i) {
+                auto factors = Find(*Keys[i]);
+                if (factors.has_value()) {
+                    Found(i, std::move(factors.value()));
+                }
+            }
+            return;
+        }
+        ForEachShardPart(Keys, Hashes, [&](const size_t Shard, const auto Part, const auto PartHashes, const size_t* Order) {
+            m_Files[Shard].FindSorted(Part, PartHashes, [&](const size_t Index, PrimeFactors&& Factors) {
+                Found(Order[Index], std::move(Factors));
+            });
+        });
+    }
+
+    // Like FindSorted, but the blocks the keys need are copied through
+    // Reader with many reads in flight, rather than faulted in from the
+    // mapping one at a time. Segments kept in memory, and legacy ones, are
+    // searched in place.
+    template <typename Visitor>
+    void
+    FindBatched(
+        const std::span<const mpz_class* const> Keys,
+        const std::span<const uint64_t> Hashes,
+        AsyncReader& Reader,
+        Visitor&& Found
+    ) const {
+        if (m_Legacy || m_Files.front().IsResident()) {
+            FindSorted(Keys, Hashes, Found);
+            return;
+        }
+        // Keys in the same block are adjacent, so each block is read once
+        struct Probe {
+            size_t Key;
+            size_t Read;
+        };
+        std::vector<Probe> probes;
+        std::vector<ReadRequest> reads;
+        std::vector<size_t> offsets;
+        size_t bytes = 0;
+        std::vector<size_t> blocks;
+        ForEachShardPart(Keys, Hashes, [&](const size_t Shard, const auto Part, const auto PartHashes, const size_t* Order) {
+            const CacheFile& file = m_Files[Shard];
+            file.LocateSorted(Part, PartHashes, blocks);
+            size_t previous = CacheFile::kNoBlock;
+            for (size_t i = 0; i < Part.size(); ++i) {
+                if (blocks[i] == CacheFile::kNoBlock) {
+                    continue;
+                }
+                if (blocks[i] != previous) {
+                    previous = blocks[i];
+                    reads.push_back(file.BlockRead(blocks[i], nullptr));
+                    offsets.push_back(bytes);
+                    bytes += reads.back().Size;
+                }
+                probes.push_back(Probe{Order[i], reads.size() - 1});
+            }
+        });
+        if (reads.empty()) {
+            return;
+        }
+        std::vector<uint8_t> buffer(bytes);
+        ThreadBytesRead() += bytes;
+        for (size_t i = 0; i < reads.size(); ++i) {
+            reads[i].Buffer = buffer.data() + offsets[i];
+        }
+        if (!Reader.Read(reads)) {
+            // The mapping is still good for anything a read could not copy
+            FindSorted(Keys, Hashes, Found);
+            return;
+        }
+        for (const Probe& probe : probes) {
+            const ReadRequest& read = reads[probe.Read];
+            auto factors = CacheFile::FindInBlock(std::span<const uint8_t>(read.Buffer, read.Size), *Keys[probe.Key]);
+            if (factors.has_value()) {
+                Found(probe.Key, std::move(factors.value()));
+            }
+        }
+    }
+
+    const std::filesystem::path&
+    GetPath(
+        void
+    ) const {
+        return m_Path;
+    }
+
+    bool
+    IsLegacy(
+        void
+    ) const {
+        return m_Legacy;
+    }
+
+    // Files the keys are spread over, 0 for a legacy segment
+    size_t
+    Shards(
+        void
+    ) const {
+        return m_Files.size();
+    }
+
+    size_t
+    Entries(
+        void
+    ) const {
+        size_t entries = 0;
+        if (!m_Legacy) {
+            for (const CacheFile& file : m_Files) {
+                entries += file.Records();
+            }
+            return entries;
+        }
+        for (const auto& map : m_IndexMaps) {
+            entries += map.Size() / sizeof(IndexEntry<N>);
+        }
+        return entries;
+    }
+
+    size_t
+    Bytes(
+        void
+    ) const {
+        size_t bytes = 0;
+        for (const CacheFile& file : m_Files) {
+            bytes += file.Size();
+        }
+        for (const auto& map : m_IndexMaps) {
+            bytes += map.Size();
+        }
+        for (const auto& [num_factors, map] : m_FactorMaps) {
+            bytes += map.Size();
+        }
+        return bytes;
+    }
+
+    std::optional<PrimeFactors>
+    Find(
+        const mpz_class& Product
+    ) const {
+        if (!m_Legacy) {
+            const uint64_t hash = HashKey(Product);
+            return m_Files[ShardOfHash(hash, m_Files.size())].Find(Product, hash);
+        }
+        // Legacy records hold keys of at most N bits
+        if (mpz_sizeinbase(Product.get_mpz_t(), 2) > N) {
+            return std::nullopt;
+        }
+        BigNum<N> key;
+        key = Product;
+        const uint8_t LowByte = static_cast<uint8_t>(Product.get_ui() & 0xFF);
+
+        // Binary search in the index
+        const auto entries = m_IndexMaps[LowByte].template As<IndexEntry<N>>();
+        auto entry = std::lower_bound(
+            entries.begin(),
+            entries.end(),
+            key,
+            [](const IndexEntry<N>& Entry, const BigNum<N>& Key) {
+                return Entry.product < Key;
+            }
+        );
+        if (entry == entries.end() || !(entry->product == key)) {
+            return std::nullopt;
+        }
+        ThreadBytesRead() += sizeof(IndexEntry<N>);
+        const size_t num_factors = entry->num_factors;
+        if (num_factors == 0) {
+            return std::nullopt;
+        }
+
+        // Binary search the factor records, these are fixed size per file
+        auto factor_map = m_FactorMaps.find(num_factors);
+        if (factor_map == m_FactorMaps.end()) {
+            return std::nullopt;
+        }
+        const std::span<const uint8_t> data = factor_map->second.Data();
+        const size_t record_size = FactorRecordSize<N>(num_factors);
+        const size_t num_records = data.size() / record_size;
+
+        size_t low = 0;
+        size_t high = num_records;
+        while (low < high) {
+            const size_t mid = low + (high - low) / 2;
+            const FactorRecord<N>* record = reinterpret_cast<const FactorRecord<N>*>(data.data() + mid * record_size);
+            if (record->product < key) {
+                low = mid + 1;
+            } else {
+                high = mid;
+            }
+        }
+        if (low == num_records) {
+            return std::nullopt;
+        }
+        const FactorRecord<N>* record = reinterpret_cast<const FactorRecord<N>*>(data.data() + low * record_size);
+        if (!(record->product == key)) {
+            return std::nullopt;
+        }
+        ThreadBytesRead() += record_size;
+
+        PrimeFactors factors;
+        for (size_t i = 0; i < num_factors; ++i) {
+            mpz_class prime_value = record->factors[i].value.ToMPZ();
+            for (size_t j = 0; j < record->factors[i].count; ++j) {
+                factors.AddFactor(prime_value);
+            }
+        }
+        return factors;
+    }
+
+private:
+    // A file of every shard, named for the shard count, or a single
+    // segment.v2. Returns false when there are none.
+    bool
+    OpenShards(
+        const bool Resident
+    ) {
+        size_t shards = 0;
+        std::error_code error;
+        for (const auto& file : std::filesystem::directory_iterator(m_Path, error)) {
+            const std::string name = file.path().filename().string();
+            size_t shard = 0;
+            size_t count = 0;
+            int consumed = 0;
+            if (name == kCacheFileName) {
+                count = 1;
+            } else if (sscanf(name.c_str(), "segment-%zu-of-%zu.v2%n", &shard, &count, &consumed) != 2 ||
+                       static_cast<size_t>(consumed) != name.size()) {
+                continue;
+            }
+            if (shards != 0 && count != shards) {
+                throw std::runtime_error("Cache segment has files of different shard counts: " + m_Path.string());
+            }
+            shards = count;
+        }
+        if (shards == 0) {
+            return false;
+        }
+        m_Files.resize(shards);
+        for (size_t i = 0; i < shards; ++i) {
+            if (!m_Files[i].Open(m_Path / CacheFileName(i, shards), Resident)) {
+                throw std::runtime_error("Cache segment is missing a shard: " + (m_Path / CacheFileName(i, shards)).string());
+            }
+        }
+        return true;
+    }
+
+    // Split Keys, which are in increasing order, by shard and call
+    // Fn(shard, keys, hashes, order) for each shard that has any, where
+    // order maps a position in the part back to one in Keys
+    template <typename Fn>
+    void
+    ForEachShardPart(
+        const std::span<const mpz_class* const> Keys,
+        const std::span<const uint64_t> Hashes,
+        Fn&& Visit
+    ) const {
+        const size_t shards = m_Files.size();
+        std::vector<size_t> starts(shards + 1, 0);
+        std::vector<size_t> shard_of(Keys.size());
+        for (size_t i = 0; i < Keys.size(); ++i) {
+            shard_of[i] = ShardOfHash(Hashes[i], shards);
+            starts[shard_of[i] + 1]++;
+        }
+        for (size_t shard = 0; shard < shards; ++shard) {
+            starts[shard + 1] += starts[shard];
+        }
+        // A stable counting sort keeps each part in key order
+        std::vector<size_t> order(Keys.size());
+        std::vector<const mpz_class*> keys(Keys.size());
+        std::vector<uint64_t> hashes(Keys.size());
+        std::vector<size_t> filled(starts.begin(), starts.end() - 1);
+        for (size_t i = 0; i < Keys.size(); ++i) {
+            const size_t position = filled[shard_of[i]]++;
+            order[position] = i;
+            keys[position] = Keys[i];
+            hashes[position] = Hashes[i];
+        }
+        for (size_t shard = 0; shard < shards; ++shard) {
+            const size_t first = starts[shard];
+            const size_t count = starts[shard + 1] - first;
+            if (count == 0) {
+                continue;
+            }
+            Visit(
+                shard,
+                std::span<const mpz_class* const>(keys.data() + first, count),
+                std::span<const uint64_t>(hashes.data() + first, count),
+                order.data() + first
+            );
+        }
+    }
+
+    static std::vector<RecordCursor*>
+    Cursors(
+        const std::vector<std::unique_ptr<RecordCursor>>& Owned
+    ) {
+        std::vector<RecordCursor*> inputs;
+        for (const auto& cursor : Owned) {
+            inputs.push_back(cursor.get());
+        }
+        return inputs;
+    }
+
+    void
+    MapIndex(
+        const uint8_t LowByte,
+        const bool Resident
+    ) {
+        m_IndexMaps[LowByte].Open(IndexPath(m_Path, LowByte), Resident);
+        if (Resident) {
+            m_IndexMaps[LowByte].Lock();
+        }
+    }
+
+    void
+    MapFactors(
+        const size_t NumFactors
+    ) {
+        MappedFile map;
+        if (map.Open(FactorPath(m_Path, NumFactors))) {
+            m_FactorMaps[NumFactors] = std::move(map);
+        }
+    }
+
+    std::filesystem::path m_Path;
+    bool m_Legacy = false;
+    std::vector<CacheFile> m_Files;
+    std::array<MappedFile, 256> m_IndexMaps;
+    std::map<size_t, MappedFile> m_FactorMaps;
+};
+
+// Writes go to an in-memory memtable. A full memtable is sealed and
+// queued for a background thread, which writes it as a sorted, immutable
+// run under runs/<first>-<last>, so writers never wait on the disk unless
+// kFlushQueue memtables are already waiting. Lookups check the memtables,
+// then the runs newest first, then the base segment. Keys are whole
+// products of any size, and each segment spreads them over GetShards()
+// files by hash. A background thread merges runs of similar size so a
+// lookup only has a handful of segments to search, and Sort folds
+// everything into a new base segment. A path to a snapshot file opens
+// that snapshot read-only. A HotFactorCache of recent results sits in
+// front of all of it, and works even when there is no cache path.
+//
+// Any number of processes can share a cache directory. The live segments
+// are listed in a manifest (see cachemanifest.hpp) which writers replace
+// under a short flock on LOCK, and only the holder of COMPACT.LOCK merges
+// segments. Each handle pins a version of the segment list that lookups
+// read without any lock, and misses pick up versions published elsewhere
+// every kRefreshInterval.
 template<size_t N = 512>
 class PrimeFactorCache {
 public:
+    // Resident pre-faults and mlocks the segments so lookups never wait
+    // on the disk for them
     PrimeFactorCache(
-        const std::string_view path = ""
-    ) : m_CachePath(path) {
+        const std::string_view path = "",
+        const bool Resident = false
+    ) : m_CachePath(path), m_Resident(Resident) {
         if (m_CachePath.empty()) {
             return;
         }
 
+        if (CacheSnapshot::IsSnapshot(m_CachePath)) {
+            m_Snapshot = std::make_unique<CacheSnapshot>();
+            m_Snapshot->Open(m_CachePath, m_Resident);
+            return;
+        }
+
         if (!std::filesystem::exists(m_CachePath)) {
             std::filesystem::create_directories(m_CachePath);
         }
 
-        if (!std::filesystem::exists(GetIndexPath())) {
-            std::filesystem::create_directories(GetIndexPath());
-        }
+        Reload();
     };
 
     ~PrimeFactorCache() {
@@ -133,14 +720,51 @@ public:
     GetIndexPath(
         const uint8_t LowByte
     ) const {
-        return m_CachePath / "index" / (std::to_string(LowByte) + ".idx");
+        return CacheSegment<N>::IndexPath(m_CachePath, LowByte);
     }
 
     std::filesystem::path
     GetFactorPath(
         const size_t NumFactors
     ) const {
-        return m_CachePath / ("factors_" + std::to_string(NumFactors) + ".dat");
+        return CacheSegment<N>::FactorPath(m_CachePath, NumFactors);
+    }
+
+    std::filesystem::path
+    GetRunsPath(
+        void
+    ) const {
+        return m_CachePath / "runs";
+    }
+
+    // The base segment of the pinned version
+    std::filesystem::path
+    GetBasePath(
+        void
+    ) const {
+        const auto version = std::atomic_load(&m_Version);
+        if (!version) {
+            return m_CachePath;
+        }
+        return version->Base->GetPath();
+    }
+
+    // Segments written from now on are split into this many files
+    void
+    SetShards(
+        const size_t Shards
+    ) {
+        if (Shards == 0) {
+            throw std::invalid_argument("A cache segment needs at least one shard.");
+        }
+        m_Shards.store(Shards, std::memory_order_relaxed);
+    }
+
+    size_t
+    GetShards(
+        void
+    ) const {
+        return m_Shards.load(std::memory_order_relaxed);
     }
 
     std::filesystem::path
@@ -169,281 +793,1471 @@ public:
         }
     }
 
-    std::optional<PrimeFactors>
-    ProductExists(
-        const mpz_class& Product
+    // Pin the segments in the manifest, writing one first for caches that
+    // have none, drop anything a crash left behind, and start the
+    // flush and compaction threads
+    void
+    Reload(
+        void
     ) {
-        // Get the low bytes to find the correct index span
-        uint8_t LowByte = static_cast<uint8_t>(Product.get_ui() & 0xFF);
-        // Check if the index exists
-        if (std::filesystem::exists(GetIndexPath(LowByte)) == false) {
-            return std::nullopt;
-        }
-        // Get the file size
-        const size_t index_file_size = std::filesystem::file_size(GetIndexPath(LowByte));
-        const size_t num_entries = index_file_size / sizeof(IndexEntry<N>);
-        if (num_entries == 0) {
-            return std::nullopt;
-        }
-        // Open a handle to the index file
-        FILE* indexfd = fopen(GetIndexPath(LowByte).c_str(), "r");
-        if (indexfd == nullptr) {
-            throw std::runtime_error("Failed to open index file for reading: " + GetIndexPath(LowByte).string());
+        if (m_Snapshot) {
+            return;
         }
-
-        // Binary search in the index
-        ssize_t low = 0;
-        ssize_t high = static_cast<ssize_t>(num_entries) - 1;
-        size_t num_factors = 0;
-        while (low <= high) {
-            ssize_t mid = low + (high - low) / 2;
-            // Seek to the record position
-            if (fseek(indexfd, mid * sizeof(IndexEntry<N>), SEEK_SET) != 0) {
-                throw std::runtime_error("Failed to seek in index file.");
-            }
-            IndexEntry<N> entry;
-            // Read the record
-            if (fread(&entry, sizeof(IndexEntry<N>), 1, indexfd) != 1) {
-                throw std::runtime_error("Failed to read record from index file.");
-            }
-            if (entry.product == Product) {
-                num_factors = entry.num_factors;
-                break;
-            } else if (entry.product < Product) {
-                low = mid + 1;
-            } else {
-                high = mid - 1;
+        Close();
+        {
+            FileLock lock(GetLockPath());
+            std::optional<CacheManifest> manifest = CacheManifest::Read(m_CachePath);
+            if (!manifest.has_value()) {
+                manifest = ScanSegments();
+                manifest->Write(m_CachePath);
             }
+            RemoveUnlisted(manifest.value());
+            std::lock_guard<std::mutex> refresh(m_RefreshMutex);
+            StoreVersion(OpenVersion(manifest.value()));
         }
-        fclose(indexfd);
-    
-        if (num_factors == 0) {
-            return std::nullopt;
-        }
+        m_StopFlusher = false;
+        m_Flusher = std::thread([this]() {
+            FlusherLoop();
+        });
+        m_StopCompactor = false;
+        m_Compactor = std::thread([this]() {
+            CompactorLoop();
+        });
+    }
 
-        // Read the factor record from the appropriate factor file
-        std::filesystem::path factor_path = GetFactorPath(num_factors);
-        FILE* factor_fd = fopen(factor_path.c_str(), "r");
-        if (factor_fd == nullptr) {
-            throw std::runtime_error("Failed to open factor file for reading: " + factor_path.string());
-        }
-
-        // Get file size and calculate record parameters
-        const size_t factor_file_size = std::filesystem::file_size(GetFactorPath(num_factors));
-        const size_t record_size = sizeof(FactorRecord<N>) + num_factors * sizeof(Factor<N>);
-        size_t num_records = factor_file_size / record_size;
-        
-        // Allocate buffer for reading one record at a time
-        std::vector<char> record_buffer(record_size);
-        FactorRecord<N>* record = reinterpret_cast<FactorRecord<N>*>(record_buffer.data());
-        
-        ssize_t factor_low = 0;
-        ssize_t factor_high = static_cast<ssize_t>(num_records) - 1;
-        
-        while (factor_low <= factor_high) {
-            ssize_t mid = factor_low + (factor_high - factor_low) / 2;
-            
-            // Seek to the record position
-            if (fseek(factor_fd, mid * record_size, SEEK_SET) != 0) {
-                throw std::runtime_error("Failed to seek in factor file.");
-            }
-            
-            // Read the record
-            if (fread(record_buffer.data(), record_size, 1, factor_fd) != 1) {
-                throw std::runtime_error("Failed to read record from factor file.");
-            }
-            
-            if (record->product == Product) {
-                PrimeFactors factors;
-                for (size_t i = 0; i < num_factors; ++i) {
-                    mpz_class prime_value = record->factors[i].value.ToMPZ();
-                    for (size_t j = 0; j < record->factors[i].count; ++j) {
-                        factors.AddFactor(prime_value);
-                    }
-                }
-                fclose(factor_fd);
-                return factors;
-            } else if (record->product < Product) {
-                factor_low = mid + 1;
-            } else {
-                factor_high = mid - 1;
+    // Pin the newest version published by any process. Returns true if it
+    // changed.
+    bool
+    Refresh(
+        void
+    ) {
+        if (!IsOpen() || m_Snapshot) {
+            return false;
+        }
+        std::lock_guard<std::mutex> refresh(m_RefreshMutex);
+        for (size_t attempt = 0; attempt < kRefreshAttempts; ++attempt) {
+            const auto current = std::atomic_load(&m_Version);
+            const std::optional<CacheManifest> manifest = CacheManifest::Read(m_CachePath);
+            if (!current || !manifest.has_value() || manifest->Generation == current->Manifest.Generation) {
+                return false;
+            }
+            try {
+                StoreVersion(OpenVersion(manifest.value()));
+            } catch (const std::runtime_error&) {
+                // A segment was removed after the manifest was read, so a
+                // newer manifest is already in place
+                continue;
+            }
+            if (RunCount() >= kRunFanout) {
+                m_CompactWake.notify_one();
             }
+            return true;
         }
-        fclose(factor_fd);
-        return std::nullopt;
+        return false;
     }
 
-    void Write(
-        const PrimeFactors Factors
+    // Serve lookups and writes from an aliquot-cached daemon instead of
+    // the files. The hot tier still sits in front of it.
+    void
+    Connect(
+        const std::filesystem::path& SocketPath
     ) {
-        const size_t num_factors = Factors.Size();
-        const uint64_t product = Factors.Product64();
-        const uint8_t LowByte = static_cast<uint8_t>(product & 0xFF);
-        // Open a handle to the index file
-        FILE* indexfd = fopen(GetIndexPath(LowByte).c_str(), "a");
-        if (indexfd == nullptr) {
-            throw std::runtime_error("Failed to open index file for writing: " + GetIndexPath(LowByte).string());
-        }
-        // Write the index entry
-        IndexEntry<N> entry;
-        entry.product = product;
-        entry.num_factors = static_cast<uint8_t>(num_factors);
-        if (fwrite(&entry, sizeof(IndexEntry<N>), 1, indexfd) != 1) {
-            throw std::runtime_error("Failed to write index entry.");
-        }
-        fclose(indexfd);
-        // Sort this index file
-        SortIndex(LowByte);
-        
-        // Allocate buffer for FactorRecord with flexible array member
-        const size_t record_size = sizeof(FactorRecord<N>) + num_factors * sizeof(Factor<N>);
-        std::vector<char> buffer(record_size);
-        FactorRecord<N>* record = reinterpret_cast<FactorRecord<N>*>(buffer.data());
-        
-        record->product = product;
-        size_t i = 0;
-        for (const auto& [prime, count] : Factors.ToVector()) {
-            record->factors[i].value = prime;
-            record->factors[i].count = static_cast<uint8_t>(count);
-            i++;
-        }
-        
-        // Write to the appropriate factor file
-        std::filesystem::path factor_path = GetFactorPath(num_factors);
-        FILE* factor_fd = fopen(factor_path.c_str(), "a");
-        if (factor_fd == nullptr) {
-            throw std::runtime_error("Failed to open factor file for writing: " + factor_path.string());
-        }
-        if (fwrite(buffer.data(), record_size, 1, factor_fd) != 1) {
-            throw std::runtime_error("Failed to write factor record.");
-        }
-        fclose(factor_fd);
-        // Sort this factor file
-        SortFactors(num_factors);
+        m_Client = std::make_unique<CacheClient>(SocketPath);
     }
 
-    void Close(
+    bool
+    IsConnected(
         void
-    ) {}
-
-    bool SortIndex(
-        const size_t LowByte
     ) const {
-        std::filesystem::path index_path = GetIndexPath(static_cast<uint8_t>(LowByte));
-        if (!std::filesystem::exists(index_path)) {
-            return false;
+        return m_Client != nullptr;
+    }
+
+    std::optional<PrimeFactors>
+    ProductExists(
+        const mpz_class& Product
+    ) {
+        const auto start = std::chrono::steady_clock::now();
+        CacheTier tier = CacheTier::Miss;
+        auto factors = Lookup(Product, tier);
+        m_Stats.RecordLookup(tier, std::chrono::steady_clock::now() - start);
+        return factors;
+    }
+
+    // Look up many products at once. Keys missing from the memory tiers
+    // are sorted and merge-joined against each segment shard by shard, so
+    // each block is decoded once however many of the keys it holds.
+    std::vector<std::optional<PrimeFactors>>
+    ProductExistsBatch(
+        const std::span<const mpz_class> Products
+    ) {
+        const auto start = std::chrono::steady_clock::now();
+        std::array<uint64_t, kCacheTiers> tiers = {};
+        std::vector<std::optional<PrimeFactors>> results(Products.size());
+        std::vector<size_t> missing;
+        for (size_t i = 0; i < Products.size(); ++i) {
+            results[i] = m_Hot.Get(Products[i]);
+            if (!results[i].has_value()) {
+                missing.push_back(i);
+            }
         }
-        size_t file_size = std::filesystem::file_size(index_path);
-        if (file_size == 0) {
-            return false;  // Skip empty index files
+        tiers[static_cast<size_t>(CacheTier::Hot)] = Products.size() - missing.size();
+
+        if (missing.empty() || (!m_Client && !IsOpen())) {
+            // Nothing more to look in
+        } else if (m_Client) {
+            std::vector<mpz_class> keys;
+            for (const size_t index : missing) {
+                keys.push_back(Products[index]);
+            }
+            auto found = m_Client->Lookup(keys);
+            for (size_t i = 0; i < missing.size(); ++i) {
+                tiers[static_cast<size_t>(CacheTier::Daemon)] += found[i].has_value();
+                results[missing[i]] = std::move(found[i]);
+            }
+        } else {
+            FindBatchOnDisk(Products, missing, results, tiers);
+            // Another process may have written some since
+            std::erase_if(missing, [&results](const size_t Index) {
+                return results[Index].has_value();
+            });
+            if (!missing.empty() && RefreshDue() && Refresh()) {
+                FindBatchOnDisk(Products, missing, results, tiers);
+            }
         }
-        // Open and mmap the index file
-        FILE* fd = fopen(index_path.c_str(), "r+");
-        if (fd == nullptr) {
-            std::cerr << "Failed to open index file for sorting." << std::endl;
-            return false;
+        uint64_t found = 0;
+        for (size_t i = 0; i < Products.size(); ++i) {
+            if (results[i].has_value()) {
+                m_Hot.Put(Products[i], results[i].value());
+                found++;
+            }
+        }
+        tiers[static_cast<size_t>(CacheTier::Miss)] = Products.size() - found;
+        m_Stats.RecordBatch(tiers, std::chrono::steady_clock::now() - start);
+        return results;
+    }
+
+    void Write(
+        const PrimeFactors Factors
+    ) {
+        const auto start = std::chrono::steady_clock::now();
+        const mpz_class product = Factors.Product();
+        m_Hot.Put(product, Factors);
+        if (m_Client) {
+            m_Client->Insert(product, Factors);
+        } else if (IsOpen() && !m_Snapshot) {
+            // Snapshots are read-only
+            std::unique_lock<std::mutex> lock(m_Mutex);
+            m_Memtable.insert_or_assign(product, Factors);
+            if (m_Memtable.size() >= kMemtableEntries) {
+                SealLocked(lock);
+            }
+        }
+        m_Stats.RecordInsert(std::chrono::steady_clock::now() - start);
+    }
+
+    // Offer a factorization that Method found in Elapsed. It is written
+    // like Write if it took at least the admission threshold, or if it was
+    // offered before and only held in memory. Otherwise it only goes to
+    // the hot tier, so factorizations quicker to redo than to look up on
+    // disk do not grow the cache. Results found in the cache are written
+    // again only if they were held in memory.
+    void
+    Admit(
+        const PrimeFactors& Factors,
+        const FactorMethod Method,
+        const std::chrono::nanoseconds Elapsed
+    ) {
+        const mpz_class product = Factors.Product();
+        const uint64_t hash = HashKey(product);
+        std::atomic<uint64_t>& word = m_Offered[(hash >> 6) % kOfferedWords];
+        const uint64_t bit = uint64_t(1) << (hash & 63);
+        // Clearing the bit may forget another key sharing it, which then
+        // waits for one more offer
+        const bool offered = (word.fetch_and(~bit, std::memory_order_relaxed) & bit) != 0;
+        const bool admit = offered || (Method != FactorMethod::Cache && Elapsed >= m_AdmitThreshold);
+        if (admit) {
+            Write(Factors);
+        } else if (Method != FactorMethod::Cache) {
+            m_Hot.Put(product, Factors);
+            word.fetch_or(bit, std::memory_order_relaxed);
         }
-        void* map = mmap(nullptr, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fileno(fd), 0);
-        if (map == MAP_FAILED) {
-            std::cerr << "Failed to mmap index file for sorting." << std::endl;
-            fclose(fd);
+        m_Stats.RecordFactorization(Method, Elapsed, admit);
+    }
+
+    // A Threshold of 0 admits every factorization
+    void
+    SetAdmitThreshold(
+        const std::chrono::nanoseconds Threshold
+    ) {
+        m_AdmitThreshold = Threshold;
+    }
+
+    // Write the memtable out as a new run and wait for every queued run
+    void
+    Flush(
+        void
+    ) {
+        if (m_Client) {
+            m_Client->Flush();
+        }
+        if (!IsOpen()) {
+            return;
+        }
+        std::unique_lock<std::mutex> lock(m_Mutex);
+        SealLocked(lock);
+        // Without a flusher the queue is written once the cache reloads
+        if (m_Flusher.joinable()) {
+            m_FlushDone.wait(lock, [this]() {
+                return m_Sealed.empty();
+            });
+        }
+    }
+
+    void Close(
+        void
+    ) {
+        // Sends any writes it still holds
+        m_Client.reset();
+        if (m_Flusher.joinable()) {
+            {
+                std::unique_lock<std::mutex> lock(m_Mutex);
+                SealLocked(lock);
+                m_StopFlusher = true;
+            }
+            m_FlushWake.notify_all();
+            m_Flusher.join();
+        }
+        if (m_Compactor.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(m_Mutex);
+                m_StopCompactor = true;
+            }
+            m_CompactWake.notify_all();
+            m_Compactor.join();
+        }
+        if (!IsOpen()) {
+            return;
+        }
+        StoreVersion(nullptr);
+        // Drop this thread's pin along with the segments it maps
+        PinnedVersion();
+    }
+
+    // Legacy files are sorted into a copy which replaces the original by
+    // rename, so another process reading them never sees one half sorted.
+    // Files larger than Budget are sorted in chunks and merged.
+    bool SortIndex(
+        const size_t LowByte,
+        const size_t Budget = kRecordSortBudget
+    ) const {
+        std::filesystem::path index_path = GetIndexPath(static_cast<uint8_t>(LowByte));
+        if (!std::filesystem::exists(index_path) || std::filesystem::file_size(index_path) == 0) {
             return false;
         }
-        size_t num_entries = file_size / sizeof(IndexEntry<N>);
-        std::span<IndexEntry<N>> entries(static_cast<IndexEntry<N>*>(map), num_entries);
-        // Sort the entries by product
-        std::sort(entries.begin(), entries.end(), [](const IndexEntry<N>& a, const IndexEntry<N>& b) {
-            return a.product < b.product;
-        });
-        // Sync changes to disk
-        msync(map, file_size, MS_SYNC);
-        // Unmap and close the file
-        munmap(map, file_size);
-        fclose(fd);
-        return true;
+        return SortRecordFile(index_path, sizeof(IndexEntry<N>), N / 64, Budget);
     }
 
     bool SortFactors(
-        const size_t NumFactors
+        const size_t NumFactors,
+        const size_t Budget = kRecordSortBudget
     ) const {
         std::filesystem::path factor_path = GetFactorPath(NumFactors);
         if (!std::filesystem::exists(factor_path)) {
             return false;
         }
-        // Open and mmap the factor file
-        FILE* ffd = fopen(factor_path.c_str(), "r+");
-        if (ffd == nullptr) {
-            std::cerr << "Failed to open factor file for sorting: " << factor_path << std::endl;
-            return false;
-        }
-        size_t factor_file_size = std::filesystem::file_size(factor_path);
-        void* fmap = mmap(nullptr, factor_file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fileno(ffd), 0);
-        if (fmap == MAP_FAILED) {
-            std::cerr << "Failed to mmap factor file for sorting: " << factor_path << std::endl;
-            fclose(ffd);
-            return false;
-        }
-        
-        const size_t record_size = sizeof(FactorRecord<N>) + NumFactors * sizeof(Factor<N>);
-        size_t num_records = factor_file_size / record_size;
-        
-        // Comparison function for qsort_r
-        auto compare_records = [](const void* a, const void* b, void* arg) -> int {
-            const FactorRecord<N>* rec_a = static_cast<const FactorRecord<N>*>(a);
-            const FactorRecord<N>* rec_b = static_cast<const FactorRecord<N>*>(b);
-            if (rec_a->product < rec_b->product) return -1;
-            if (rec_a->product > rec_b->product) return 1;
-            return 0;
-        };
-        
-        // Sort in-place using qsort_r
-        qsort_r(fmap, num_records, record_size, compare_records, nullptr);
-        
-        // Sync changes to disk
-        msync(fmap, factor_file_size, MS_SYNC);
-        // Unmap and close the file
-        munmap(fmap, factor_file_size);
-        fclose(ffd);
-        return true;
+        return SortRecordFile(factor_path, FactorRecordSize<N>(NumFactors), N / 64, Budget);
     }
 
+    // Merge every run into a new base segment so the cache is a single
+    // sorted segment again, split into GetShards() files. Progress is
+    // called from the sorting threads, one at a time.
     void Sort(
+        const SortProgress& Progress = nullptr
+    ) {
+        Rebase({}, Progress);
+    }
+
+    // Sort, taking in the entries of Others as well, ordered newest first.
+    // Where a key is in both, this cache's entry is kept. Others must be
+    // sorted, as every segment of a migrated or sorted cache is.
+    void MergeFrom(
+        const std::vector<const CacheSegment<N>*>& Others,
+        const SortProgress& Progress = nullptr
+    ) {
+        Rebase(Others, Progress);
+    }
+
+    // The segments of the newest version, newest first, flushing this
+    // handle's writes first. They stay mapped while they are held.
+    std::vector<std::shared_ptr<const CacheSegment<N>>>
+    Segments(
         void
     ) {
-        // Sort index files
-        for (size_t i = 0; i < 256; ++i) {
-            SortIndex(i);
+        std::vector<std::shared_ptr<const CacheSegment<N>>> segments;
+        if (m_Snapshot || !IsOpen()) {
+            return segments;
+        }
+        if (!std::atomic_load(&m_Version)) {
+            Reload();
         }
+        Flush();
+        Refresh();
+        const auto version = std::atomic_load(&m_Version);
+        for (auto run = version->Runs.rbegin(); run != version->Runs.rend(); ++run) {
+            segments.push_back(run->Segment);
+        }
+        segments.push_back(version->Base);
+        return segments;
+    }
+
+    // Write every entry to a single read-only snapshot file, which can be
+    // opened by passing its path to the constructor
+    uint64_t
+    ExportSnapshot(
+        const std::filesystem::path& Output
+    ) {
+        if (!IsOpen() || m_Snapshot) {
+            throw std::runtime_error("Only an open cache directory can be exported.");
+        }
+        if (!std::atomic_load(&m_Version)) {
+            Reload();
+        }
+        Flush();
+        Refresh();
 
-        for (size_t num_factors = 1; num_factors <= 6; ++num_factors) {
-            SortFactors(num_factors);
+        const auto version = std::atomic_load(&m_Version);
+        std::vector<const CacheSegment<N>*> segments;
+        for (auto run = version->Runs.rbegin(); run != version->Runs.rend(); ++run) {
+            segments.push_back(run->Segment.get());
         }
+        segments.push_back(version->Base.get());
+
+        SnapshotWriter writer;
+        CacheSegment<N>::Merge(segments, writer);
+        std::filesystem::path temp = Output;
+        temp += ".tmp";
+        writer.Finish(temp);
+        std::filesystem::rename(temp, Output);
+        return writer.Keys();
+    }
+
+    HotFactorCache&
+    GetHotCache(
+        void
+    ) {
+        return m_Hot;
+    }
+
+    const CacheStats&
+    GetStats(
+        void
+    ) const {
+        return m_Stats;
     }
 
+    // Loads a large, unsorted stream of factorizations as one new run.
+    // Records are bucketed by shard as they arrive. Each time the buckets
+    // reach the memory budget they are sorted in parallel and spilled as
+    // a temporary segment, and Finish merges the spills shard by shard in
+    // parallel into the run, building its fences and filters on the way.
+    // Add may be called from any number of threads. Later additions of a
+    // key replace earlier ones.
+    class BulkWriter {
+    public:
+        BulkWriter(
+            PrimeFactorCache<N>& Cache,
+            const size_t BudgetBytes = kBulkBudget
+        ) : m_Cache(Cache), m_Budget(BudgetBytes), m_Buckets(Cache.GetShards()) {
+            if (!Cache.IsOpen() || Cache.m_Snapshot) {
+                throw std::runtime_error("Bulk loading needs a writable cache directory.");
+            }
+            if (!std::atomic_load(&Cache.m_Version)) {
+                Cache.Reload();
+            }
+        }
+
+        BulkWriter(
+            const BulkWriter&
+        ) = delete;
+
+        BulkWriter&
+        operator=(
+            const BulkWriter&
+        ) = delete;
+
+        // Anything not yet published is discarded
+        ~BulkWriter() {
+            std::error_code error;
+            for (const auto& spill : m_Spills) {
+                std::filesystem::remove_all(spill, error);
+            }
+        }
+
+        void
+        Add(
+            const PrimeFactors& Factors
+        ) {
+            Add(Factors.Product(), Factors);
+        }
+
+        void
+        Add(
+            const mpz_class& Key,
+            const PrimeFactors& Factors
+        ) {
+            thread_local std::vector<uint8_t> payload;
+            payload.clear();
+            AppendFactorPayload(payload, Factors);
+            const size_t bytes = sizeof(Pending) + payload.size() + mpz_size(Key.get_mpz_t()) * sizeof(mp_limb_t);
+            Bucket& bucket = m_Buckets[ShardOfHash(HashKey(Key), m_Buckets.size())];
+            size_t total = 0;
+            {
+                std::lock_guard<std::mutex> lock(bucket.Mutex);
+                bucket.Records.push_back(Pending{Key, bucket.Payloads.size(), static_cast<uint32_t>(payload.size()), m_Sequence++});
+                bucket.Payloads.insert(bucket.Payloads.end(), payload.begin(), payload.end());
+                bucket.Bytes += bytes;
+                // Counted with the bucket so a spill that takes these bytes
+                // never subtracts them before they were added
+                total = m_Bytes.fetch_add(bytes) + bytes;
+            }
+            m_Added++;
+            if (total >= m_Budget) {
+                Spill(false);
+            }
+        }
+
+        // Records added so far, counting repeated keys
+        uint64_t
+        Records(
+            void
+        ) const {
+            return m_Added;
+        }
+
+        // Publish everything added as a run and return the number of
+        // distinct keys written. The writer is empty afterwards.
+        uint64_t
+        Finish(
+            void
+        ) {
+            Spill(true);
+            std::lock_guard<std::mutex> lock(m_SpillMutex);
+            if (m_Spills.empty()) {
+                return 0;
+            }
+            std::filesystem::path output = m_Spills.front();
+            if (m_Spills.size() > 1) {
+                std::vector<std::unique_ptr<CacheSegment<N>>> opened;
+                std::vector<const CacheSegment<N>*> segments;
+                // Newest first, so the last addition of a key wins
+                for (auto spill = m_Spills.rbegin(); spill != m_Spills.rend(); ++spill) {
+                    opened.push_back(std::make_unique<CacheSegment<N>>(*spill));
+                    segments.push_back(opened.back().get());
+                }
+                output = m_Cache.NewTempPath();
+                m_Cache.WriteSegment(output, [&segments](ShardedCacheWriter& Writer) {
+                    CacheSegment<N>::Merge(segments, Writer);
+                });
+                opened.clear();
+                std::error_code error;
+                for (const auto& spill : m_Spills) {
+                    std::filesystem::remove_all(spill, error);
+                }
+            }
+            m_Spills.clear();
+            const uint64_t written = CacheSegment<N>(output).Entries();
+            m_Cache.PublishRun(output);
+            return written;
+        }
+
+    private:
+        struct Pending {
+            mpz_class Key;
+            uint64_t Offset;
+            uint32_t Size;
+            // Orders repeated keys by when they were added
+            uint64_t Sequence;
+        };
+
+        struct Bucket {
+            std::mutex Mutex;
+            std::vector<Pending> Records;
+            std::vector<uint8_t> Payloads;
+            size_t Bytes = 0;
+        };
+
+        // Write the buckets as a sorted temporary segment once they are
+        // over budget, or whenever they hold anything if Force is set.
+        // Other threads keep adding to fresh buckets meanwhile.
+        void
+        Spill(
+            const bool Force
+        ) {
+            std::lock_guard<std::mutex> lock(m_SpillMutex);
+            if (!Force && m_Bytes < m_Budget) {
+                // Another thread spilled first
+                return;
+            }
+            std::vector<Bucket> taken(m_Buckets.size());
+            size_t records = 0;
+            for (size_t shard = 0; shard < m_Buckets.size(); ++shard) {
+                std::lock_guard<std::mutex> bucket(m_Buckets[shard].Mutex);
+                std::swap(taken[shard].Records, m_Buckets[shard].Records);
+                std::swap(taken[shard].Payloads, m_Buckets[shard].Payloads);
+                m_Bytes -= m_Buckets[shard].Bytes;
+                m_Buckets[shard].Bytes = 0;
+                records += taken[shard].Records.size();
+            }
+            if (records == 0) {
+                return;
+            }
+
+            const std::filesystem::path temp = m_Cache.NewTempPath();
+            m_Spills.push_back(temp);
+            std::filesystem::create_directories(temp);
+            ShardedCacheWriter writer(temp, taken.size());
+            ForEachShard(taken.size(), [&](const size_t Shard) {
+                std::vector<Pending>& pending = taken[Shard].Records;
+                std::sort(pending.begin(), pending.end(), [](const Pending& A, const Pending& B) {
+                    const int order = cmp(A.Key, B.Key);
+                    return order < 0 || (order == 0 && A.Sequence < B.Sequence);
+                });
+                const uint8_t* payloads = taken[Shard].Payloads.data();
+                CacheFileWriter& file = writer.Shard(Shard);
+                for (size_t i = 0; i < pending.size(); ++i) {
+                    if (i + 1 < pending.size() && pending[i + 1].Key == pending[i].Key) {
+                        continue;
+                    }
+                    file.Add(pending[i].Key, std::span<const uint8_t>(payloads + pending[i].Offset, pending[i].Size));
+                }
+                // Free the bucket before the next shard is sorted
+                std::vector<Pending>().swap(pending);
+                std::vector<uint8_t>().swap(taken[Shard].Payloads);
+            });
+            writer.Finish();
+        }
+
+        PrimeFactorCache<N>& m_Cache;
+        size_t m_Budget;
+        std::vector<Bucket> m_Buckets;
+        std::atomic<size_t> m_Bytes = 0;
+        std::atomic<uint64_t> m_Added = 0;
+        std::atomic<uint64_t> m_Sequence = 0;
+        // Serializes spills, and guards m_Spills. Oldest first.
+        std::mutex m_SpillMutex;
+        std::vector<std::filesystem::path> m_Spills;
+    };
+
     void PrintStats(
         void
     ) const {
         std::cout << "Prime Factor Cache Stats:" << std::endl;
         std::cout << "Cache Path: " << m_CachePath << std::endl;
-        // Get number of entries in the index file
-        size_t index_size = 0;
-        for (size_t i = 0; i < 256; ++i) {
-            if (std::filesystem::exists(GetIndexPath(i))) {
-                index_size = std::filesystem::file_size(GetIndexPath(i));
-                index_size = index_size / sizeof(IndexEntry<N>);
+        const Shape shape = GetShape();
+        std::cout << "Entries: " << shape.Entries << std::endl;
+        if (m_Snapshot) {
+            std::cout << "Snapshot size: " << shape.Bytes << " bytes" << std::endl;
+        } else if (shape.Legacy) {
+            for (size_t i = 1; i <= kMaxFactorFiles; ++i) {
+                std::error_code error;
+                const size_t factor_size = std::filesystem::file_size(GetFactorPath(i), error);
+                if (!error && factor_size > 0) {
+                    std::cout << "Factors with " << i << " primes: " << factor_size / FactorRecordSize<N>(i) << std::endl;
+                }
+            }
+        } else {
+            std::cout << "Segments: " << shape.Segments << std::endl;
+            std::cout << "Shards per segment: " << GetShards() << std::endl;
+            std::cout << "Segment size: " << shape.Bytes << " bytes" << std::endl;
+        }
+        std::cout << "Hot tier: " << m_Hot.GetBudget() << " byte budget" << std::endl;
+        m_Stats.Print(std::cout, GetShards());
+    }
+
+    // The shape of the cache and its counters as one JSON object
+    void
+    WriteStats(
+        std::ostream& Output
+    ) const {
+        const Shape shape = GetShape();
+        Output << "{\"path\":\"" << m_CachePath.string() << "\",\"entries\":" << shape.Entries <<
+            ",\"segments\":" << shape.Segments << ",\"bytes\":" << shape.Bytes <<
+            ",\"shards\":" << GetShards() << ",\"connected\":" << (m_Client ? "true" : "false") << ",\"stats\":";
+        m_Stats.WriteJson(Output, GetShards());
+        Output << "}";
+    }
+
+private:
+    using Memtable = std::map<mpz_class, PrimeFactors>;
+
+    struct Run {
+        size_t First = 0;
+        size_t Last = 0;
+        std::shared_ptr<CacheSegment<N>> Segment;
+    };
+
+    // One consistent list of segments. Its segments stay mapped until the
+    // last pin is dropped, even after another process removes their files.
+    struct Version {
+        CacheManifest Manifest;
+        std::shared_ptr<CacheSegment<N>> Base;
+        // Oldest first
+        std::vector<Run> Runs;
+    };
+
+    struct Shape {
+        size_t Entries = 0;
+        size_t Segments = 0;
+        size_t Bytes = 0;
+        // Only the unsorted files of a cache written before segments
+        bool Legacy = false;
+    };
+
+    Shape
+    GetShape(
+        void
+    ) const {
+        Shape shape;
+        if (m_Snapshot) {
+            shape.Entries = m_Snapshot->Keys();
+            shape.Segments = 1;
+            shape.Bytes = m_Snapshot->Size();
+            return shape;
+        }
+        const auto version = std::atomic_load(&m_Version);
+        if (version && (!version->Base->IsLegacy() || !version->Runs.empty())) {
+            shape.Entries = version->Base->Entries();
+            shape.Bytes = version->Base->Bytes();
+            for (const Run& run : version->Runs) {
+                shape.Entries += run.Segment->Entries();
+                shape.Bytes += run.Segment->Bytes();
             }
+            shape.Segments = version->Runs.size() + 1;
+            return shape;
         }
-        std::cout << "Entries: " << index_size << std::endl;
-        for (size_t i = 1; i <= 6; ++i) {
-            std::filesystem::path factor_path = GetFactorPath(i);
-            if (std::filesystem::exists(factor_path)) {
-                size_t factor_size = std::filesystem::file_size(factor_path);
-                size_t record_size = sizeof(FactorRecord<N>) + i * sizeof(Factor<N>);
-                size_t num_records = factor_size / record_size;
-                std::cout << "Factors with " << i << " primes: " << num_records << std::endl;
+        // Every index file, one per low byte of the key
+        shape.Legacy = IsOpen();
+        for (size_t i = 0; i < 256 && IsOpen(); ++i) {
+            std::error_code error;
+            const size_t index_size = std::filesystem::file_size(GetIndexPath(static_cast<uint8_t>(i)), error);
+            if (!error) {
+                shape.Entries += index_size / sizeof(IndexEntry<N>);
+                shape.Bytes += index_size;
             }
         }
+        for (size_t i = 1; i <= kMaxFactorFiles && IsOpen(); ++i) {
+            std::error_code error;
+            const size_t factor_size = std::filesystem::file_size(GetFactorPath(i), error);
+            shape.Bytes += error ? 0 : factor_size;
+        }
+        return shape;
     }
-private:
+
+    // Set Tier to where the lookup was answered
+    std::optional<PrimeFactors>
+    Lookup(
+        const mpz_class& Product,
+        CacheTier& Tier
+    ) {
+        auto hot = m_Hot.Get(Product);
+        if (hot.has_value()) {
+            Tier = CacheTier::Hot;
+            return hot;
+        }
+        if (m_Client) {
+            hot = m_Client->Lookup(Product);
+            if (hot.has_value()) {
+                Tier = CacheTier::Daemon;
+                m_Hot.Put(Product, hot.value());
+            }
+            return hot;
+        }
+        if (!IsOpen()) {
+            return hot;
+        }
+        auto factors = FindOnDisk(Product, Tier);
+        // Another process may have written it since
+        if (!factors.has_value() && RefreshDue() && Refresh()) {
+            factors = FindOnDisk(Product, Tier);
+        }
+        if (factors.has_value()) {
+            m_Hot.Put(Product, factors.value());
+        }
+        return factors;
+    }
+
+    std::optional<PrimeFactors>
+    FindOnDisk(
+        const mpz_class& Product,
+        CacheTier& Tier
+    ) {
+        if (m_Snapshot) {
+            auto factors = m_Snapshot->Find(Product);
+            Tier = factors.has_value() ? CacheTier::Segment : CacheTier::Miss;
+            return factors;
+        }
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            auto pending = m_Memtable.find(Product);
+            if (pending != m_Memtable.end()) {
+                Tier = CacheTier::Memtable;
+                return pending->second;
+            }
+            for (auto sealed = m_Sealed.rbegin(); sealed != m_Sealed.rend(); ++sealed) {
+                pending = sealed->find(Product);
+                if (pending != sealed->end()) {
+                    Tier = CacheTier::Memtable;
+                    return pending->second;
+                }
+            }
+        }
+        // The flusher publishes a run before it drops the sealed memtable,
+        // so anything missed above is in this version
+        const Version* version = PinnedVersion();
+        if (version == nullptr) {
+            return std::nullopt;
+        }
+        const uint64_t bytes = ThreadBytesRead();
+        size_t probes = 0;
+        std::optional<PrimeFactors> factors;
+        for (auto run = version->Runs.rbegin(); run != version->Runs.rend() && !factors.has_value(); ++run) {
+            probes++;
+            factors = run->Segment->Find(Product);
+        }
+        if (!factors.has_value()) {
+            probes++;
+            factors = version->Base->Find(Product);
+        }
+        Tier = factors.has_value() ? CacheTier::Segment : CacheTier::Miss;
+        m_Stats.RecordProbes(ShardOfHash(HashKey(Product), GetShards()), probes);
+        m_Stats.RecordBytesRead(ThreadBytesRead() - bytes);
+        return factors;
+    }
+
+    // Merge every run, and Others after the base, into a new base
+    void
+    Rebase(
+        const std::vector<const CacheSegment<N>*>& Others,
+        const SortProgress& Progress
+    ) {
+        if (m_Snapshot || !IsOpen()) {
+            return;
+        }
+        if (!std::atomic_load(&m_Version)) {
+            Reload();
+        }
+        Flush();
+
+        // Waits for a compaction here or in another process to finish
+        FileLock compacting(GetCompactLockPath());
+        Refresh();
+        const auto version = std::atomic_load(&m_Version);
+        std::shared_ptr<CacheSegment<N>> base = version->Base;
+        const bool in_root = base->GetPath() == m_CachePath;
+        if (version->Runs.empty() && Others.empty() && !in_root && base->Shards() == GetShards()) {
+            return;
+        }
+        std::mutex progress_mutex;
+        auto report = [&](const std::string_view Stage, const size_t Done, const size_t Total) {
+            if (Progress) {
+                std::lock_guard<std::mutex> lock(progress_mutex);
+                Progress(Stage, Done, Total);
+            }
+        };
+        if (in_root) {
+            // Caches written before runs existed appended straight to the
+            // root, and the merge needs their files in order. Each thread
+            // gets an even share of the memory budget.
+            std::vector<std::pair<std::filesystem::path, size_t>> files;
+            for (size_t i = 0; i < 256; ++i) {
+                files.emplace_back(GetIndexPath(static_cast<uint8_t>(i)), sizeof(IndexEntry<N>));
+            }
+            for (size_t num_factors = 1; num_factors <= kMaxFactorFiles; ++num_factors) {
+                files.emplace_back(GetFactorPath(num_factors), FactorRecordSize<N>(num_factors));
+            }
+            std::erase_if(files, [](const auto& File) {
+                std::error_code error;
+                return std::filesystem::file_size(File.first, error) == 0 || error;
+            });
+            const size_t threads = std::clamp<size_t>(std::thread::hardware_concurrency(), 1, std::max<size_t>(files.size(), 1));
+            std::atomic<size_t> sorted = 0;
+            // A file left unsorted would be merged out of order and then
+            // deleted with the rest, so any failure stops the sort
+            std::vector<uint8_t> ok(files.size(), 0);
+            ForEachShard(files.size(), [&](const size_t Index) {
+                ok[Index] = SortRecordFile(files[Index].first, files[Index].second, N / 64, kRecordSortBudget / threads);
+                report("Sorting legacy files", ++sorted, files.size());
+            });
+            for (size_t i = 0; i < files.size(); ++i) {
+                if (!ok[i]) {
+                    throw std::runtime_error("Failed to sort legacy cache file: " + files[i].first.string());
+                }
+            }
+            base = std::make_shared<CacheSegment<N>>(m_CachePath, m_Resident);
+        }
+
+        std::vector<const CacheSegment<N>*> segments;
+        for (auto run = version->Runs.rbegin(); run != version->Runs.rend(); ++run) {
+            segments.push_back(run->Segment.get());
+        }
+        segments.push_back(base.get());
+        segments.insert(segments.end(), Others.begin(), Others.end());
+        const std::filesystem::path temp = NewTempPath();
+        WriteSegment(temp, [&](ShardedCacheWriter& Writer) {
+            CacheSegment<N>::Merge(segments, Writer, [&](const size_t Done, const size_t Total) {
+                report("Merging shards", Done, Total);
+            });
+        });
+
+        const CacheManifest& merged = version->Manifest;
+        const bool published = Publish([&](CacheManifest& Manifest) {
+            // Nothing else merges while the compaction lock is held, so
+            // the runs merged are still the oldest ones
+            if (Manifest.Base != merged.Base || !StartsWith(Manifest.Runs, merged.Runs)) {
+                return false;
+            }
+            Manifest.Base = "base-" + std::to_string(Manifest.Generation + 1);
+            Install(temp, m_CachePath / Manifest.Base);
+            Manifest.Runs.erase(Manifest.Runs.begin(), Manifest.Runs.begin() + merged.Runs.size());
+            return true;
+        });
+        if (!published) {
+            std::filesystem::remove_all(temp);
+            throw std::runtime_error("Cache segments changed while sorting: " + m_CachePath.string());
+        }
+        RemoveSegments(version->Runs);
+        if (in_root) {
+            RemoveLegacyFiles();
+        } else {
+            std::error_code error;
+            std::filesystem::remove_all(version->Base->GetPath(), error);
+        }
+    }
+
+    // Each thread's reader for batched lookups, set up on first use
+    static AsyncReader&
+    BatchReader(
+        void
+    ) {
+        static thread_local AsyncReader reader;
+        return reader;
+    }
+
+    // Fill Results for the Products at Indices, memtables first, then the
+    // segments newest first, reading the blocks of each segment together
+    void
+    FindBatchOnDisk(
+        const std::span<const mpz_class> Products,
+        std::vector<size_t> Indices,
+        std::vector<std::optional<PrimeFactors>>& Results,
+        std::array<uint64_t, kCacheTiers>& Tiers
+    ) {
+        uint64_t& segment_hits = Tiers[static_cast<size_t>(CacheTier::Segment)];
+        if (m_Snapshot) {
+            for (const size_t index : Indices) {
+                Results[index] = m_Snapshot->Find(Products[index]);
+                segment_hits += Results[index].has_value();
+            }
+            return;
+        }
+        const size_t queried = Indices.size();
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            std::erase_if(Indices, [&](const size_t Index) {
+                auto pending = m_Memtable.find(Products[Index]);
+                if (pending != m_Memtable.end()) {
+                    Results[Index] = pending->second;
+                    return true;
+                }
+                for (auto sealed = m_Sealed.rbegin(); sealed != m_Sealed.rend(); ++sealed) {
+                    pending = sealed->find(Products[Index]);
+                    if (pending != sealed->end()) {
+                        Results[Index] = pending->second;
+                        return true;
+                    }
+                }
+                return false;
+            });
+        }
+        Tiers[static_cast<size_t>(CacheTier::Memtable)] += queried - Indices.size();
+        const Version* version = PinnedVersion();
+        if (version == nullptr || Indices.empty()) {
+            return;
+        }
+
+        struct Query {
+            size_t Index;
+            uint64_t Hash;
+        };
+        std::vector<Query> queries;
+        for (const size_t index : Indices) {
+            queries.push_back(Query{index, HashKey(Products[index])});
+        }
+        std::sort(queries.begin(), queries.end(), [&Products](const Query& A, const Query& B) {
+            return Products[A.Index] < Products[B.Index];
+        });
+        std::vector<const CacheSegment<N>*> segments;
+        for (auto run = version->Runs.rbegin(); run != version->Runs.rend(); ++run) {
+            segments.push_back(run->Segment.get());
+        }
+        segments.push_back(version->Base.get());
+        std::vector<const mpz_class*> keys;
+        std::vector<uint64_t> hashes;
+        const uint64_t bytes = ThreadBytesRead();
+        const size_t shards = GetShards();
+        size_t probes = 0;
+        for (const CacheSegment<N>* segment : segments) {
+            if (queries.empty()) {
+                break;
+            }
+            probes++;
+            keys.clear();
+            hashes.clear();
+            for (const Query& query : queries) {
+                keys.push_back(&Products[query.Index]);
+                hashes.push_back(query.Hash);
+            }
+            segment->FindBatched(keys, hashes, BatchReader(), [&](const size_t Found, PrimeFactors&& Factors) {
+                Results[queries[Found].Index] = std::move(Factors);
+            });
+            // Older segments only need the keys still missing
+            std::erase_if(queries, [&](const Query& Entry) {
+                if (!Results[Entry.Index].has_value()) {
+                    return false;
+                }
+                segment_hits++;
+                m_Stats.RecordProbes(ShardOfHash(Entry.Hash, shards), probes);
+                return true;
+            });
+        }
+        for (const Query& query : queries) {
+            m_Stats.RecordProbes(ShardOfHash(query.Hash, shards), probes);
+        }
+        m_Stats.RecordBytesRead(ThreadBytesRead() - bytes);
+    }
+
+    // Publish Next to every thread of this handle
+    void
+    StoreVersion(
+        std::shared_ptr<const Version> Next
+    ) {
+        // Serials are unique across handles, so a thread's pin is never
+        // mistaken for the current version of another handle
+        static std::atomic<uint64_t> serial = 0;
+        std::atomic_store(&m_Version, std::move(Next));
+        m_VersionSerial->store(serial.fetch_add(1, std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    // The calling thread's pin of this handle's current version, valid
+    // until the thread's next call on this handle. Each thread keeps a pin
+    // per handle, only replaced when a new version is stored, so lookups
+    // skip the lock std::atomic_load takes. Whenever a thread replaces a
+    // pin it also drops its pins of versions that are no longer current,
+    // such as those of closed handles, so their segments get unmapped.
+    const Version*
+    PinnedVersion(
+        void
+    ) const {
+        struct Pin {
+            const std::atomic<uint64_t>* Handle = nullptr;
+            // Expires with the handle
+            std::weak_ptr<const std::atomic<uint64_t>> Owner;
+            uint64_t Serial = 0;
+            std::shared_ptr<const Version> Pinned;
+        };
+        thread_local std::vector<Pin> pins;
+        const uint64_t serial = m_VersionSerial->load(std::memory_order_acquire);
+        for (const Pin& pin : pins) {
+            if (pin.Handle == m_VersionSerial.get() && pin.Serial == serial) {
+                return pin.Pinned.get();
+            }
+        }
+        std::erase_if(pins, [this](const Pin& Stale) {
+            if (Stale.Handle == m_VersionSerial.get()) {
+                return true;
+            }
+            const auto owner = Stale.Owner.lock();
+            return !owner || owner->load(std::memory_order_acquire) != Stale.Serial;
+        });
+        pins.push_back({m_VersionSerial.get(), m_VersionSerial, serial, std::atomic_load(&m_Version)});
+        return pins.back().Pinned.get();
+    }
+
+    size_t
+    RunCount(
+        void
+    ) const {
+        const auto version = std::atomic_load(&m_Version);
+        return version ? version->Runs.size() : 0;
+    }
+
+    // True for one caller each kRefreshInterval. Each thread only reads
+    // the clock every kRefreshMisses calls, it can be a system call.
+    bool
+    RefreshDue(
+        void
+    ) {
+        thread_local uint64_t misses = 0;
+        if (misses++ % kRefreshMisses != 0) {
+            return false;
+        }
+        const int64_t now = std::chrono::steady_clock::now().time_since_epoch().count();
+        const int64_t interval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(kRefreshInterval).count();
+        int64_t last = m_LastRefresh.load(std::memory_order_relaxed);
+        return now - last >= interval && m_LastRefresh.compare_exchange_strong(last, now, std::memory_order_relaxed);
+    }
+
+    std::filesystem::path
+    GetLockPath(
+        void
+    ) const {
+        return m_CachePath / "LOCK";
+    }
+
+    std::filesystem::path
+    GetCompactLockPath(
+        void
+    ) const {
+        return m_CachePath / "COMPACT.LOCK";
+    }
+
+    static std::string
+    RunName(
+        const size_t First,
+        const size_t Last
+    ) {
+        return std::to_string(First) + "-" + std::to_string(Last);
+    }
+
+    std::filesystem::path
+    GetRunPath(
+        const size_t First,
+        const size_t Last
+    ) const {
+        return GetRunsPath() / RunName(First, Last);
+    }
+
+    // A directory no other writer, in this process or another, will use
+    std::filesystem::path
+    NewTempPath(
+        void
+    ) const {
+        static std::atomic<uint64_t> counter = 0;
+        return GetRunsPath() / ("tmp-" + std::to_string(getpid()) + "-" + std::to_string(counter.fetch_add(1)));
+    }
+
+    // Fill a segment in a temporary directory, it is renamed into place
+    // when published so a segment is either complete or absent
+    template <typename Fill>
+    void
+    WriteSegment(
+        const std::filesystem::path& Path,
+        Fill&& Records
+    ) const {
+        try {
+            std::filesystem::create_directories(Path);
+            ShardedCacheWriter writer(Path, GetShards());
+            Records(writer);
+            writer.Finish();
+        } catch (...) {
+            std::error_code error;
+            std::filesystem::remove_all(Path, error);
+            throw;
+        }
+    }
+
+    // Move a written segment to its published name. Nothing lists that
+    // name yet, so anything there is left over from a crash.
+    static void
+    Install(
+        const std::filesystem::path& Temp,
+        const std::filesystem::path& Path
+    ) {
+        std::filesystem::remove_all(Path);
+        std::filesystem::rename(Temp, Path);
+        SyncDirectory(Path.parent_path());
+    }
+
+    static bool
+    StartsWith(
+        const std::vector<CacheManifest::Run>& Runs,
+        const std::vector<CacheManifest::Run>& Prefix
+    ) {
+        return Runs.size() >= Prefix.size() &&
+            std::equal(Prefix.begin(), Prefix.end(), Runs.begin(), [](const auto& a, const auto& b) {
+                return a.First == b.First && a.Last == b.Last;
+            });
+    }
+
+    // Apply Change to the newest manifest and publish the result under the
+    // writer lock, then pin it. Change returns false to publish nothing.
+    template <typename Change>
+    bool
+    Publish(
+        Change&& Apply
+    ) {
+        FileLock lock(GetLockPath());
+        CacheManifest manifest = CacheManifest::Read(m_CachePath).value_or(CacheManifest());
+        if (!Apply(manifest)) {
+            return false;
+        }
+        manifest.Generation++;
+        manifest.Write(m_CachePath);
+        std::lock_guard<std::mutex> refresh(m_RefreshMutex);
+        StoreVersion(OpenVersion(manifest));
+        return true;
+    }
+
+    // Open the segments Manifest lists, sharing any that are already
+    // open. Throws if one has been removed.
+    std::shared_ptr<const Version>
+    OpenVersion(
+        const CacheManifest& Manifest
+    ) const {
+        const auto current = std::atomic_load(&m_Version);
+        auto version = std::make_shared<Version>();
+        version->Manifest = Manifest;
+        version->Base = OpenSegment(Manifest.Base == "." ? m_CachePath : m_CachePath / Manifest.Base, current);
+        for (const CacheManifest::Run& run : Manifest.Runs) {
+            version->Runs.push_back(Run{run.First, run.Last, OpenSegment(GetRunPath(run.First, run.Last), current)});
+        }
+        return version;
+    }
+
+    std::shared_ptr<CacheSegment<N>>
+    OpenSegment(
+        const std::filesystem::path& Path,
+        const std::shared_ptr<const Version>& Current
+    ) const {
+        if (Current) {
+            if (Current->Base->GetPath() == Path) {
+                return Current->Base;
+            }
+            for (const Run& run : Current->Runs) {
+                if (run.Segment->GetPath() == Path) {
+                    return run.Segment;
+                }
+            }
+        }
+        auto segment = std::make_shared<CacheSegment<N>>(Path, m_Resident);
+        // Only the root holds legacy files, anywhere else the directory
+        // has gone
+        if (segment->IsLegacy() && Path != m_CachePath) {
+            throw std::runtime_error("Cache segment is missing: " + Path.string());
+        }
+        return segment;
+    }
+
+    // Build the first manifest of a cache written before manifests.
+    // Unfinished runs, and runs a finished compaction covers, are removed.
+    CacheManifest
+    ScanSegments(
+        void
+    ) const {
+        std::vector<CacheManifest::Run> runs;
+        std::error_code error;
+        for (const auto& dir : std::filesystem::directory_iterator(GetRunsPath(), error)) {
+            const std::string name = dir.path().filename().string();
+            CacheManifest::Run run;
+            int consumed = 0;
+            if (sscanf(name.c_str(), "%zu-%zu%n", &run.First, &run.Last, &consumed) != 2 ||
+                static_cast<size_t>(consumed) != name.size()) {
+                std::filesystem::remove_all(dir.path(), error);
+                continue;
+            }
+            runs.push_back(run);
+        }
+        // A merged run sorts after the inputs it covers
+        std::sort(runs.begin(), runs.end(), [](const auto& a, const auto& b) {
+            return a.Last < b.Last || (a.Last == b.Last && a.First > b.First);
+        });
+
+        CacheManifest manifest;
+        for (const CacheManifest::Run& run : runs) {
+            while (!manifest.Runs.empty() && run.First <= manifest.Runs.back().First) {
+                std::filesystem::remove_all(GetRunPath(manifest.Runs.back().First, manifest.Runs.back().Last), error);
+                manifest.Runs.pop_back();
+            }
+            manifest.Runs.push_back(run);
+            manifest.NextRun = run.Last + 1;
+        }
+        if (std::filesystem::is_directory(m_CachePath / "base")) {
+            manifest.Base = "base";
+        }
+        return manifest;
+    }
+
+    // Remove segments no manifest lists any more, which a crash between
+    // publishing and removing leaves behind, and the temporary segments of
+    // processes that have exited. Called with the writer lock held.
+    void
+    RemoveUnlisted(
+        const CacheManifest& Manifest
+    ) const {
+        std::error_code error;
+        for (const auto& dir : std::filesystem::directory_iterator(GetRunsPath(), error)) {
+            const std::string name = dir.path().filename().string();
+            int pid = 0;
+            if (sscanf(name.c_str(), "tmp-%d-", &pid) == 1) {
+                if (pid > 0 && (kill(pid, 0) == 0 || errno == EPERM)) {
+                    continue;
+                }
+            } else if (std::any_of(Manifest.Runs.begin(), Manifest.Runs.end(), [&name](const auto& run) {
+                           return RunName(run.First, run.Last) == name;
+                       })) {
+                continue;
+            }
+            std::filesystem::remove_all(dir.path(), error);
+        }
+        for (const auto& dir : std::filesystem::directory_iterator(m_CachePath, error)) {
+            const std::string name = dir.path().filename().string();
+            if (name.starts_with("base") && name != Manifest.Base && dir.is_directory(error)) {
+                std::filesystem::remove_all(dir.path(), error);
+            }
+        }
+    }
+
+    // Queue the memtable for the flusher, first waiting for room if
+    // kFlushQueue memtables are already queued
+    void
+    SealLocked(
+        std::unique_lock<std::mutex>& Lock
+    ) {
+        if (m_Memtable.empty()) {
+            return;
+        }
+        if (m_Flusher.joinable()) {
+            m_FlushDone.wait(Lock, [this]() {
+                return m_Sealed.size() < kFlushQueue;
+            });
+        }
+        m_Sealed.push_back(std::move(m_Memtable));
+        m_Memtable.clear();
+        m_FlushWake.notify_one();
+    }
+
+    void
+    WriteRun(
+        const Memtable& Entries
+    ) {
+        // The memtable is already in key order
+        const std::filesystem::path temp = NewTempPath();
+        WriteSegment(temp, [&Entries](ShardedCacheWriter& Writer) {
+            for (const auto& [product, factors] : Entries) {
+                Writer.Add(product, factors);
+            }
+        });
+        PublishRun(temp);
+    }
+
+    // Publish a written temporary segment as the newest run
+    void
+    PublishRun(
+        const std::filesystem::path& Temp
+    ) {
+        Publish([&](CacheManifest& Manifest) {
+            const size_t run = Manifest.NextRun++;
+            Install(Temp, GetRunPath(run, run));
+            Manifest.Runs.push_back(CacheManifest::Run{run, run});
+            return true;
+        });
+        if (RunCount() >= kRunFanout) {
+            m_CompactWake.notify_one();
+        }
+    }
+
+    // Write sealed memtables oldest first. Lookups keep finding one in
+    // m_Sealed until its run is published. On stop the queue is drained
+    // before the thread exits.
+    void
+    FlusherLoop(
+        void
+    ) {
+        std::unique_lock<std::mutex> lock(m_Mutex);
+        while (true) {
+            m_FlushWake.wait(lock, [this]() {
+                return m_StopFlusher || !m_Sealed.empty();
+            });
+            if (m_Sealed.empty()) {
+                return;
+            }
+            // Only this thread removes from the queue, and the deque keeps
+            // the front in place while writers append
+            const Memtable& entries = m_Sealed.front();
+            lock.unlock();
+            try {
+                WriteRun(entries);
+            } catch (const std::exception& e) {
+                // The entries can be computed again, so losing them beats
+                // stalling every writer behind a full queue
+                std::cerr << "Cache flush failed, dropping " << entries.size() << " entries: " << e.what() << std::endl;
+            }
+            lock.lock();
+            m_Sealed.pop_front();
+            m_FlushDone.notify_all();
+        }
+    }
+
+    // Caches written before base directories kept these in the root
+    void
+    RemoveLegacyFiles(
+        void
+    ) {
+        std::error_code error;
+        std::filesystem::remove_all(GetIndexPath(), error);
+        std::filesystem::remove(m_CachePath / kCacheFileName, error);
+        for (const auto& file : std::filesystem::directory_iterator(m_CachePath, error)) {
+            const std::string name = file.path().filename().string();
+            if (name.starts_with("factors_") && name.ends_with(".dat")) {
+                std::filesystem::remove(file.path(), error);
+            }
+        }
+    }
+
+    // Once merged runs are out of the manifest their files can go, pinned
+    // versions keep them mapped
+    void
+    RemoveSegments(
+        const std::vector<Run>& Merged
+    ) {
+        std::error_code error;
+        for (const Run& run : Merged) {
+            std::filesystem::remove_all(run.Segment->GetPath(), error);
+        }
+    }
+
+    // Merge the newest kRunFanout runs, plus any older run no bigger than
+    // everything being merged, so run sizes grow geometrically and each
+    // entry is rewritten O(log n) times. Returns false if there was
+    // nothing to do or another process is compacting.
+    bool
+    CompactRuns(
+        void
+    ) {
+        FileLock compacting(GetCompactLockPath(), false);
+        if (!compacting.Held()) {
+            return false;
+        }
+        Refresh();
+        const auto version = std::atomic_load(&m_Version);
+        if (!version || version->Runs.size() < kRunFanout) {
+            return false;
+        }
+        const std::vector<Run>& runs = version->Runs;
+        size_t start = runs.size() - kRunFanout;
+        size_t merged = 0;
+        for (size_t i = start; i < runs.size(); ++i) {
+            merged += runs[i].Segment->Entries();
+        }
+        while (start > 0 && runs[start - 1].Segment->Entries() <= merged) {
+            start--;
+            merged += runs[start].Segment->Entries();
+        }
+        const std::vector<Run> inputs(runs.begin() + start, runs.end());
+        const std::vector<CacheManifest::Run> listed(version->Manifest.Runs.begin() + start, version->Manifest.Runs.end());
+
+        std::vector<const CacheSegment<N>*> segments;
+        for (auto run = inputs.rbegin(); run != inputs.rend(); ++run) {
+            segments.push_back(run->Segment.get());
+        }
+        const std::filesystem::path temp = NewTempPath();
+        WriteSegment(temp, [&segments](ShardedCacheWriter& Writer) {
+            CacheSegment<N>::Merge(segments, Writer);
+        });
+
+        const CacheManifest::Run output{inputs.front().First, inputs.back().Last};
+        const bool published = Publish([&](CacheManifest& Manifest) {
+            // Flushes since only append, so the inputs are still together
+            auto position = std::find_if(Manifest.Runs.begin(), Manifest.Runs.end(), [&output](const auto& run) {
+                return run.First == output.First;
+            });
+            if (position == Manifest.Runs.end() || !StartsWith(std::vector<CacheManifest::Run>(position, Manifest.Runs.end()), listed)) {
+                return false;
+            }
+            Install(temp, GetRunPath(output.First, output.Last));
+            position = Manifest.Runs.erase(position, position + listed.size());
+            Manifest.Runs.insert(position, output);
+            return true;
+        });
+        if (!published) {
+            std::filesystem::remove_all(temp);
+            return false;
+        }
+        RemoveSegments(inputs);
+        return true;
+    }
+
+    void
+    CompactorLoop(
+        void
+    ) {
+        std::unique_lock<std::mutex> lock(m_Mutex);
+        while (!m_StopCompactor) {
+            if (RunCount() >= kRunFanout) {
+                lock.unlock();
+                bool compacted = false;
+                try {
+                    compacted = CompactRuns();
+                } catch (const std::exception& e) {
+                    // Lookups still work across the uncompacted runs
+                    std::cerr << "Cache compaction failed: " << e.what() << std::endl;
+                    return;
+                }
+                lock.lock();
+                if (compacted) {
+                    continue;
+                }
+            }
+            // Woken by a flush, or retry later in case another process
+            // held the compaction lock
+            m_CompactWake.wait_for(lock, kCompactRetry);
+        }
+    }
+
+    // Entries held in memory before they are flushed as a run
+    static constexpr size_t kMemtableEntries = 1 << 17;
+    // Sealed memtables waiting for the flusher before writers block
+    static constexpr size_t kFlushQueue = 2;
+    // Memory a BulkWriter buffers before it spills a sorted segment
+    static constexpr size_t kBulkBudget = size_t(1) << 30;
+    // Number of similarly sized runs merged by each compaction
+    static constexpr size_t kRunFanout = 8;
+    // Records can have at most this many distinct primes
+    static constexpr size_t kMaxFactorFiles = 64;
+    // How often a miss checks for versions published by other processes
+    static constexpr std::chrono::milliseconds kRefreshInterval{100};
+    static constexpr uint64_t kRefreshMisses = 64;
+    static constexpr size_t kRefreshAttempts = 8;
+    static constexpr std::chrono::seconds kCompactRetry{1};
+    // Bits, as words, remembering which keys Admit held in memory only
+    static constexpr size_t kOfferedWords = size_t(1) << 16;
+
     std::filesystem::path m_CachePath;
-};
\ No newline at end of file
+    bool m_Resident = false;
+    std::unique_ptr<CacheSnapshot> m_Snapshot;
+    HotFactorCache m_Hot;
+    CacheStats m_Stats;
+    std::chrono::nanoseconds m_AdmitThreshold = kDefaultAdmitThreshold;
+    std::unique_ptr<std::atomic<uint64_t>[]> m_Offered = std::make_unique<std::atomic<uint64_t>[]>(kOfferedWords);
+    std::unique_ptr<CacheClient> m_Client;
+    std::atomic<size_t> m_Shards = kDefaultCacheShards;
+    // Guards the memtables
+    std::mutex m_Mutex;
+    // Held while a new version is opened and pinned
+    std::mutex m_RefreshMutex;
+    Memtable m_Memtable;
+    // Oldest first
+    std::deque<Memtable> m_Sealed;
+    std::condition_variable m_FlushWake;
+    std::condition_variable m_FlushDone;
+    bool m_StopFlusher = false;
+    std::thread m_Flusher;
+    // Only replaced through StoreVersion
+    std::shared_ptr<const Version> m_Version;
+    // Shared so that threads' pins can tell when the handle is gone
+    std::shared_ptr<std::atomic<uint64_t>> m_VersionSerial = std::make_shared<std::atomic<uint64_t>>(0);
+    std::atomic<int64_t> m_LastRefresh = 0;
+    std::condition_variable m_CompactWake;
+    bool m_StopCompactor = false;
+    std::thread m_Compactor;
+};
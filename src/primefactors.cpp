@@ -26,12 +26,16 @@ PrimeFactorsLinear(
 
     PrimeFactors prime_factors;
 
-    std::vector<mpz_class> factors;
     uint64_t prime = 2;
-    size_t gap_index = 1;
     mpz_class remainder = N;
 
-    while (remainder > 1 && gap_index < gaps.size()) {
+    // Trial divide by the stored primes. Half-gap stores decode each block
+    // with a branch free loop inside ForEachPrime.
+    ForEachPrime(gaps, [&](const uint64_t Prime) {
+        prime = Prime;
+        if (remainder <= 1) {
+            return false;
+        }
         // Check if we have the factor in cache
         // auto cached_factors = Cache.ProductExists(remainder);
         // if (cached_factors.has_value()) {
@@ -43,27 +47,17 @@ PrimeFactorsLinear(
         // Check if the remainder is prime
         if (prime_checker.CheckSmall(remainder)) {
             prime_factors.AddFactor(remainder);
-            return prime_factors;;
+            remainder = 1;
+            return false;
         }
 
         // Check if prime divides remainder
-        while (mpz_divisible_ui_p(remainder.get_mpz_t(), prime)) {
-            prime_factors.AddFactor(prime);
-            remainder /= prime;
+        while (mpz_divisible_ui_p(remainder.get_mpz_t(), Prime)) {
+            prime_factors.AddFactor(Prime);
+            remainder /= Prime;
         }
-
-        // Get the next VLE-encoded gap
-        uint64_t gap = 0;
-        uint8_t shift = 0;
-        uint8_t byte;
-        do {
-            byte = gaps[gap_index];
-            gap |= static_cast<uint64_t>(byte & 0x7F) << shift;
-            shift += 7;
-            gap_index++;
-        } while ((byte & 0x80) != 0);
-        prime += gap;
-    }
+        return true;
+    });
 
     // If remainder is not 1, then we need to continue factoring
     // We use the 30-wheel to avoid using nextprime
@@ -91,6 +85,9 @@ PrimeFactorsLinear(
     return prime_factors;
 }
 
+// Wheel is either a compile time std::array, so each modulus gets its own
+// fixed trip count inner loop, or a span over a runtime built wheel
+template <typename Wheel>
 bool
 PrimeFactorsInRange(
     const mpz_class& N,
@@ -99,7 +96,7 @@ PrimeFactorsInRange(
     const mpz_class& MaxFactor,
     const IsPrime& PrimeChecker,
     const size_t Modulus,
-    std::span<const uint64_t> WheelGaps,
+    const Wheel& Increments,
     PrimeFactors& FoundFactors,
     std::mutex& Mutex,
     std::atomic<bool>& Found
@@ -115,37 +112,36 @@ PrimeFactorsInRange(
     candidate += 1;
 
     while (candidate < MaxFactor && !Found.load()) {
-        for (auto gapword : WheelGaps) {
-            for (size_t i = 0; i < kGapsPerWord && !Found.load(); ++i) {
-                // Check if candidate divides n and it is prime (the wheel doesn't guarantee primality)
-                if (candidate != 1 &&
-                    mpz_divisible_p(N.get_mpz_t(), candidate.get_mpz_t())
-                    && PrimeChecker.Check(candidate)) {
-                    // Lock and add factor
-                    std::lock_guard<std::mutex> lock(Mutex);
-                    // Add all powers of this factor that divide the quotient
-                    while (mpz_divisible_p(Remainder.get_mpz_t(), candidate.get_mpz_t())) {
-                        FoundFactors.AddFactor(candidate);
-                        Remainder /= candidate;
-                        // std::cout << "Found factor: " << candidate << " Remainder: " << Remainder << std::endl;
-                    }
+        for (const uint8_t increment : Increments) {
+            if (Found.load(std::memory_order_relaxed)) {
+                break;
+            }
+            // Check if candidate divides n and it is prime (the wheel doesn't guarantee primality)
+            if (candidate != 1 &&
+                mpz_divisible_p(N.get_mpz_t(), candidate.get_mpz_t())
+                && PrimeChecker.Check(candidate)) {
+                // Lock and add factor
+                std::lock_guard<std::mutex> lock(Mutex);
+                // Add all powers of this factor that divide the quotient
+                while (mpz_divisible_p(Remainder.get_mpz_t(), candidate.get_mpz_t())) {
+                    FoundFactors.AddFactor(candidate);
+                    Remainder /= candidate;
+                    // std::cout << "Found factor: " << candidate << " Remainder: " << Remainder << std::endl;
+                }
 
-                    // Check if we've completely factored N
-                    if (Remainder == 1) {
-                        Found.store(true);
-                        return true;
-                    } else if (PrimeChecker.Check(Remainder)) {
-                        // See if we can return early if the remaining quotient is prime
-                        FoundFactors.AddFactor(Remainder);
-                        Found.store(true);
-                        return true;
-                    }
+                // Check if we've completely factored N
+                if (Remainder == 1) {
+                    Found.store(true);
+                    return true;
+                } else if (PrimeChecker.Check(Remainder)) {
+                    // See if we can return early if the remaining quotient is prime
+                    FoundFactors.AddFactor(Remainder);
+                    Found.store(true);
+                    return true;
                 }
-                // Get next candidate
-                const uint64_t increment = gapword & kGapMask;
-                gapword >>= kBitsPerWheelGap;
-                candidate += increment;
             }
+            // Get next candidate
+            candidate += increment;
         }
     }
     return false;
@@ -188,9 +184,7 @@ PrimeFactorsMT(
         throw std::runtime_error("Number too small for multi-threaded factorization.");
     }
 
-    // Get the wheel gaps
     const size_t modulus_ui = modulus.get_ui();
-    std::span<const uint64_t> wheel_gaps = GetWheel(modulus_ui);
     
     // Round up sqrt_n to nearest multiple of modulus
     mpz_class max_factor = (sqrt_n + modulus - 1) / modulus * modulus;
@@ -220,22 +214,43 @@ PrimeFactorsMT(
     }
     
     // Launch threads with interleaved block distribution
-    for (size_t i = 0; i < NumThreads; ++i) {
-        futures.push_back(std::async(std::launch::async, [thread_id = i, NumThreads, modulus, &max_factor, &N, modulus_ui, wheel_gaps, &local_factors, &factor_mutex, &found, &prime_checker, &remainder]() {
-            // This thread processes blocks: thread_id, thread_id + num_threads, thread_id + 2*num_threads, ...
-            mpz_class block_start = thread_id * modulus;
-            while (block_start < max_factor && !found) {
-                mpz_class block_end = block_start + modulus;
-                if (block_end > max_factor) {
-                    block_end = max_factor;
-                }
-                if (PrimeFactorsInRange(N, remainder, block_start, block_end, prime_checker, modulus_ui, wheel_gaps, local_factors, factor_mutex, found)) {
-                    return true;
+    auto launch = [&](const auto& Wheel) {
+        for (size_t i = 0; i < NumThreads; ++i) {
+            futures.push_back(std::async(std::launch::async, [thread_id = i, NumThreads, modulus, &max_factor, &N, modulus_ui, Wheel, &local_factors, &factor_mutex, &found, &prime_checker, &remainder]() {
+                // This thread processes blocks: thread_id, thread_id + num_threads, thread_id + 2*num_threads, ...
+                mpz_class block_start = thread_id * modulus;
+                while (block_start < max_factor && !found) {
+                    mpz_class block_end = block_start + modulus;
+                    if (block_end > max_factor) {
+                        block_end = max_factor;
+                    }
+                    if (PrimeFactorsInRange(N, remainder, block_start, block_end, prime_checker, modulus_ui, Wheel, local_factors, factor_mutex, found)) {
+                        return true;
+                    }
+                    block_start += NumThreads * modulus;
                 }
-                block_start += NumThreads * modulus;
-            }
-            return false;
-        }));
+                return false;
+            }));
+        }
+    };
+
+    // The compile time wheels get their own unrolled inner loop
+    switch (modulus_ui) {
+        case 30:
+            launch(kWheel<30>);
+            break;
+        case 210:
+            launch(kWheel<210>);
+            break;
+        case 2310:
+            launch(kWheel<2310>);
+            break;
+        case 30030:
+            launch(kWheel<30030>);
+            break;
+        default:
+            launch(GetWheel(modulus_ui));
+            break;
     }
 
     // PrimeFactors total_factors;
@@ -265,19 +280,25 @@ PrimeFactors
 GetPrimeFactors(
     const mpz_class& N,
     PrimeFactorCache<>& Cache,
-    const size_t NumThreads
+    const size_t NumThreads,
+    FactorMethod* Method
 )
 {
-    auto cached = Cache.ProductExists(N.get_ui());
+    FactorMethod unused;
+    FactorMethod& method = Method != nullptr ? *Method : unused;
+    auto cached = Cache.ProductExists(N);
     if (cached.has_value()) {
+        method = FactorMethod::Cache;
         return cached.value();
     }
      // If the number is small, use the linear method
     if (N < 3'000'000) {
+        method = FactorMethod::Linear;
         return PrimeFactorsLinear(N, Cache);
     }
 
     // For larger numbers, use multi-threaded factorization
+    method = FactorMethod::Wheel;
     return PrimeFactorsMT(N, Cache, NumThreads);
 }
 
@@ -29,11 +29,13 @@ PrimeFactorsMT(
     const size_t NumThreads = std::thread::hardware_concurrency()
 );
 
+// Method, if given, is set to how the factors were found
 PrimeFactors
 GetPrimeFactors(
     const mpz_class& N,
     PrimeFactorCache<>& Cache,
-    const size_t NumThreads = std::thread::hardware_concurrency()
+    const size_t NumThreads = std::thread::hardware_concurrency(),
+    FactorMethod* Method = nullptr
 );
 
 PrimeFactors
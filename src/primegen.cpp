@@ -1,15 +1,26 @@
 // primegen
 // Precomputes the gaps between primes and outputs them to a file.
 // The gaps are encoded as VLE-encoded bytes.
+// Primes are found with a segmented sieve of Eratosthenes, threads sieve
+// disjoint segments which are then written out in order.
+// Output can be limited to a window [a, b) whose first gap is relative to
+// the last prime below a, so windows concatenate into one valid file.
+#include <array>
 #include <iomanip>
 #include <iostream>
+#include <filesystem>
 #include <fstream>
+#include <optional>
 #include <string_view>
 #include <cstdint>
+#include <span>
+#include <thread>
 
 #include <gmpxx.h>
+#include <sys/mman.h>
 
 #include "primes.hpp"
+#include "sieve.hpp"
 
 std::string
 HumanReadableSize(
@@ -27,6 +38,172 @@ HumanReadableSize(
     return std::string(buffer);
 }
 
+// Bytes written between checkpoints
+constexpr size_t kCheckpointInterval = 64 * 1024 * 1024;
+
+// pi(2^64), the most primes -c can generate
+constexpr uint64_t kMaxPrimeCount = 425656284035217743;
+
+// Progress marker stored next to the output file. On resume only the bytes
+// written after the checkpoint need to be scanned to recover the last prime.
+struct Checkpoint {
+    uint64_t Start = 0;
+    size_t Offset = 0;
+    uint64_t Last = 0;
+    size_t Count = 0;
+};
+
+std::filesystem::path
+GetCheckpointPath(
+    const std::string_view Output
+) {
+    return std::filesystem::path(std::string(Output) + ".ckpt");
+}
+
+std::optional<Checkpoint>
+ReadCheckpoint(
+    const std::string_view Output
+) {
+    std::ifstream ifs(GetCheckpointPath(Output));
+    Checkpoint checkpoint;
+    if (!(ifs >> checkpoint.Start >> checkpoint.Offset >> checkpoint.Last >> checkpoint.Count)) {
+        return std::nullopt;
+    }
+    return checkpoint;
+}
+
+bool
+WriteCheckpoint(
+    const std::string_view Output,
+    const Checkpoint& State
+) {
+    // Write then rename so a crash never leaves a torn checkpoint
+    const std::filesystem::path path = GetCheckpointPath(Output);
+    std::filesystem::path temp = path;
+    temp += ".tmp";
+    {
+        std::ofstream ofs(temp, std::ios::trunc);
+        ofs << State.Start << " " << State.Offset << " " << State.Last << " " << State.Count << std::endl;
+        if (!ofs) {
+            return false;
+        }
+    }
+    std::error_code error;
+    std::filesystem::rename(temp, path, error);
+    return !error;
+}
+
+// Recover the end of an existing output file. Starts from the checkpoint
+// when it matches the file, otherwise scans the whole file. Any partially
+// written gap at the end is truncated away.
+std::optional<Checkpoint>
+RecoverOutput(
+    const std::string_view Output,
+    const uint64_t Start
+) {
+    Checkpoint state;
+    state.Start = Start;
+    if (!std::filesystem::exists(Output)) {
+        state.Last = PreviousPrime(Start);
+        return state;
+    }
+
+    const size_t size = std::filesystem::file_size(Output);
+    auto checkpoint = ReadCheckpoint(Output);
+    if (checkpoint.has_value() && checkpoint->Start == Start && checkpoint->Offset <= size) {
+        state = checkpoint.value();
+    } else {
+        state.Last = PreviousPrime(Start);
+    }
+
+    if (state.Offset < size) {
+        FILE* file = std::fopen(std::string(Output).c_str(), "rb");
+        if (file == nullptr) {
+            return std::nullopt;
+        }
+        void* map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+        std::fclose(file);
+        if (map == MAP_FAILED) {
+            return std::nullopt;
+        }
+        std::span<const uint8_t> tail(static_cast<const uint8_t*>(map) + state.Offset, size - state.Offset);
+        const PrimeGapTail scanned = ScanPrimeGaps(tail, state.Last);
+        munmap(map, size);
+        state.Offset += scanned.Valid;
+        state.Last = scanned.Last;
+        state.Count += scanned.Count;
+    }
+
+    if (state.Offset != size) {
+        std::cerr << "Truncating partial gap at end of output file." << std::endl;
+        std::filesystem::resize_file(Output, state.Offset);
+    }
+    return state;
+}
+
+// Recover the end of an existing half-gap output. Blocks carry their own
+// base prime so only the block headers and the final block are read.
+std::optional<Checkpoint>
+RecoverHalfGapOutput(
+    const std::string_view Output,
+    const uint64_t Start
+) {
+    Checkpoint state;
+    state.Start = Start;
+    state.Last = PreviousPrime(Start);
+    if (!std::filesystem::exists(Output) || std::filesystem::file_size(Output) == 0) {
+        return state;
+    }
+
+    const size_t size = std::filesystem::file_size(Output);
+    FILE* file = std::fopen(std::string(Output).c_str(), "rb");
+    if (file == nullptr) {
+        return std::nullopt;
+    }
+    void* map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+    std::fclose(file);
+    if (map == MAP_FAILED) {
+        return std::nullopt;
+    }
+    std::span<const uint8_t> data(static_cast<const uint8_t*>(map), size);
+    size_t offset = 0;
+    if (GetPrimeGapEncoding(data) == PrimeGapEncoding::HalfGap) {
+        // Prime 2 is implied by the header
+        offset = kHalfGapHeaderSize;
+        state.Last = 2;
+        state.Count = 1;
+    }
+    const PrimeGapTail scanned = ScanHalfGapBlocks(data.subspan(offset));
+    munmap(map, size);
+    if (scanned.Valid > 0) {
+        state.Last = scanned.Last;
+    }
+    state.Count += scanned.Count;
+    state.Offset = offset + scanned.Valid;
+
+    if (size - state.Offset >= kHalfGapBlockSize) {
+        std::cerr << "Output file has a corrupt block at offset " << state.Offset << "." << std::endl;
+        return std::nullopt;
+    }
+    if (state.Offset != size) {
+        std::cerr << "Truncating partial block at end of output file." << std::endl;
+        std::filesystem::resize_file(Output, state.Offset);
+    }
+    return state;
+}
+
+// The encoding of an existing output, read from its first bytes
+std::optional<PrimeGapEncoding>
+ReadOutputEncoding(
+    const std::string_view Output,
+    const uint64_t Start
+) {
+    std::ifstream file{std::string(Output), std::ios::binary};
+    std::array<uint8_t, kHalfGapHeaderSize> head{};
+    file.read(reinterpret_cast<char*>(head.data()), head.size());
+    return DetectOutputEncoding(std::span(head).first(file.gcount()), Start);
+}
+
 int main(
     int argc,
     char* argv[]
@@ -38,12 +215,22 @@ int main(
         std::cerr << "  -2 <N>    Generate primes up to 2^N" << std::endl;
         std::cerr << "  -n <N>    Generate primes up to N" << std::endl;
         std::cerr << "  -c <N>    Generate first N primes" << std::endl;
+        std::cerr << "  -a <N>    Start the window at N (first gap is from the prime below N)" << std::endl;
+        std::cerr << "  -b <N>    End the window before N" << std::endl;
+        std::cerr << "  -r        Resume or extend an existing output file" << std::endl;
+        std::cerr << "  -f <F>    Output format, vle (default) or half" << std::endl;
+        std::cerr << "  -t <N>    Number of sieve threads" << std::endl;
         return 1;
     }
 
     std::string_view output_file;
     mpz_class max_prime = 0;
     bool use_count = false;
+    bool resume = false;
+    bool half_gaps = false;
+    uint64_t window_start = 0;
+    uint64_t window_end = 0;
+    size_t num_threads = std::thread::hardware_concurrency();
 
     for (int i = 1; i < argc; ++i) {
         if (std::string_view(argv[i]) == "-2" && i + 1 < argc) {
@@ -55,75 +242,195 @@ int main(
         } else if (std::string_view(argv[i]) == "-c" && i + 1 < argc) {
             max_prime = mpz_class(argv[++i]);
             use_count = true;
+        } else if (std::string_view(argv[i]) == "-a" && i + 1 < argc) {
+            window_start = static_cast<uint64_t>(std::stoull(argv[++i]));
+        } else if (std::string_view(argv[i]) == "-b" && i + 1 < argc) {
+            window_end = static_cast<uint64_t>(std::stoull(argv[++i]));
+        } else if (std::string_view(argv[i]) == "-r") {
+            resume = true;
+        } else if (std::string_view(argv[i]) == "-f" && i + 1 < argc) {
+            const std::string_view format = argv[++i];
+            if (format == "half") {
+                half_gaps = true;
+            } else if (format != "vle") {
+                std::cerr << "Error: Unknown output format " << format << std::endl;
+                return 1;
+            }
+        } else if (std::string_view(argv[i]) == "-t" && i + 1 < argc) {
+            num_threads = static_cast<size_t>(std::stoul(argv[++i]));
         } else {
             output_file = argv[i];
             break;
         }
     }
 
-    mpz_class value = 1;
-    mpz_class last = 5;
-    size_t count = 0;
-    size_t filesize = 0;
-
-    std::ofstream ofs(output_file.data(), std::ios::binary);
-    if (!ofs) {
-        std::cerr << "Error: Could not open output file." << std::endl;
+    if (output_file.empty()) {
+        std::cerr << "Error: Output file not specified." << std::endl;
         return 1;
     }
-    // Write the gaps for 2, 3, 5
-    ofs.put(static_cast<char>(2)); // Gap from 0 to 2
-    ofs.put(static_cast<char>(1)); // Gap from 2 to 3
-    ofs.put(static_cast<char>(2)); // Gap from 3 to 5
-    filesize += 3;
 
-    // Use the wheel30 gaps
-    uint32_t wheel = kWheel30;
+    if (use_count && (window_start != 0 || window_end != 0)) {
+        std::cerr << "Error: -c counts from 2 and cannot be used with a window." << std::endl;
+        return 1;
+    }
 
-    while (
-        (use_count && count < max_prime) ||
-        (!use_count && value <= max_prime)) {
+    // The sieve works in 64 bits and ends one past the limit
+    if (max_prime < 0 || !mpz_fits_ulong_p(max_prime.get_mpz_t()) || max_prime.get_ui() == UINT64_MAX) {
+        std::cerr << "Error: Limit must be below 2^64 - 1." << std::endl;
+        return 1;
+    }
+    if (use_count && max_prime > kMaxPrimeCount) {
+        std::cerr << "Error: There are only " << kMaxPrimeCount << " primes below 2^64." << std::endl;
+        return 1;
+    }
+    const uint64_t limit = max_prime.get_ui();
+    uint64_t end = limit + 1;
+    if (use_count) {
+        end = PrimeUpperBound(limit) + 1;
+    } else if (window_end != 0) {
+        end = window_end;
+        max_prime = window_end;
+    }
 
-        // Increment the value using the wheel
-        const uint32_t increment = wheel & kWheel30Mask;
-        wheel = std::rotr(wheel, kWheel30BitsPerGap);
-        value += increment;
+    // Work out where we are starting from
+    Checkpoint state;
+    state.Start = window_start;
+    if (resume) {
+        const auto requested = half_gaps ? PrimeGapEncoding::HalfGap : PrimeGapEncoding::Vle;
+        if (std::filesystem::exists(output_file) && std::filesystem::file_size(output_file) > 0) {
+            const auto existing = ReadOutputEncoding(output_file, window_start);
+            if (!existing.has_value()) {
+                std::cerr << "Error: Existing output file is not a prime gap file for this window." << std::endl;
+                return 1;
+            }
+            if (existing.value() != requested) {
+                std::cerr << "Error: Existing output file is in the "
+                    << (existing.value() == PrimeGapEncoding::HalfGap ? "half" : "vle")
+                    << " format, pass the matching -f to resume it." << std::endl;
+                return 1;
+            }
+        }
+        auto recovered = half_gaps ?
+            RecoverHalfGapOutput(output_file, window_start) :
+            RecoverOutput(output_file, window_start);
+        if (!recovered.has_value()) {
+            std::cerr << "Error: Could not read existing output file." << std::endl;
+            return 1;
+        }
+        state = recovered.value();
+        if (state.Count > 0) {
+            std::cerr << "Resuming after prime " << state.Last
+                << " (" << state.Count << " primes, " << HumanReadableSize(state.Offset) << ")" << std::endl;
+        }
+    } else {
+        // A stale checkpoint would describe a different file
+        std::error_code error;
+        std::filesystem::remove(GetCheckpointPath(output_file), error);
+        state.Last = PreviousPrime(window_start);
+    }
 
-        // Ensure the value is prime as this is not guaranteed by the wheel
-        if (!mpz_probab_prime_p(value.get_mpz_t(), 25)) {
-            continue;
+    size_t max_count = 0;
+    if (use_count) {
+        if (state.Count >= limit) {
+            std::cerr << "Output already contains " << state.Count << " primes." << std::endl;
+            return 0;
         }
+        max_count = limit - state.Count;
+    }
+    const uint64_t start = state.Count > 0 ? state.Last + 1 : window_start;
+    const size_t base_count = state.Count;
+    size_t filesize = state.Offset;
+    size_t reported = state.Count;
+    size_t checkpointed = state.Offset;
+
+    std::ofstream ofs(output_file.data(), std::ios::binary | (resume ? std::ios::app : std::ios::trunc));
+    if (!ofs) {
+        std::cerr << "Error: Could not open output file." << std::endl;
+        return 1;
+    }
 
-        // Calculate the gap from the last prime
-        mpz_class primegap = value - last;
-        last = value;
+    // Half-gap output is re-encoded from the sieved stream
+    HalfGapEncoder encoder;
+    std::vector<uint8_t> blocks;
+    uint64_t encoded = state.Last;
+    if (half_gaps && filesize == 0 && window_start == 0) {
+        AppendHalfGapHeader(blocks);
+        ofs.write(reinterpret_cast<const char*>(blocks.data()), blocks.size());
+        filesize += blocks.size();
+        blocks.clear();
+    }
 
-        // VLE encode the primegap
-        while (primegap > 0) {
-            uint8_t byte = primegap.get_ui() & 0x7F;
-            primegap >>= 7;
-            if (primegap > 0) {
-                byte |= 0x80; // More bytes to come
+    // Sieve in parallel, the chunks arrive already stitched and in order
+    SievePrimeGaps(
+        start,
+        end,
+        state.Last,
+        max_count,
+        [&](std::span<const uint8_t> Gaps, const uint64_t LastPrime, const size_t Count) {
+            std::span<const uint8_t> output = Gaps;
+            if (half_gaps) {
+                // Chunks always end on a complete gap
+                uint64_t gap = 0;
+                uint8_t shift = 0;
+                for (const uint8_t byte : Gaps) {
+                    gap |= static_cast<uint64_t>(byte & 0x7F) << shift;
+                    shift += 7;
+                    if ((byte & 0x80) == 0) {
+                        encoded += gap;
+                        encoder.Add(encoded, blocks);
+                        gap = 0;
+                        shift = 0;
+                    }
+                }
+                output = blocks;
             }
-            ofs.put(static_cast<char>(byte));
-            filesize++;
-        }
-        count++;
-        
-        if (count % 100000 == 0) {
-            // Calculate percentage
-            double percent = 0.0;
-            if (!use_count) {
-                percent = (value.get_d() / max_prime.get_d()) * 100.0;
-            } else {
-                percent = (static_cast<double>(count) / max_prime.get_d()) * 100.0;
+            ofs.write(reinterpret_cast<const char*>(output.data()), output.size());
+            if (!ofs) {
+                std::cerr << std::endl << "Error: Failed writing output file." << std::endl;
+                return false;
             }
-            std::cerr << "\r#: " << count
-                    << " (" << HumanReadableSize(filesize) << "), "
-                    << "latest prime: " << value
-                    << std::fixed << std::setprecision(2)
-                    << " (" << percent << "%)" << std::flush;
-        }
+            filesize += output.size();
+            blocks.clear();
+            state.Offset = filesize;
+            state.Last = LastPrime;
+            state.Count = base_count + Count;
+
+            if (!half_gaps && filesize - checkpointed >= kCheckpointInterval) {
+                ofs.flush();
+                checkpointed = filesize;
+                WriteCheckpoint(output_file, state);
+            }
+
+            if (state.Count - reported >= 1000000) {
+                reported = state.Count;
+                // Calculate percentage
+                double percent = 0.0;
+                if (!use_count) {
+                    percent = (static_cast<double>(LastPrime) / max_prime.get_d()) * 100.0;
+                } else {
+                    percent = (static_cast<double>(state.Count) / max_prime.get_d()) * 100.0;
+                }
+                std::cerr << "\r#: " << state.Count
+                        << " (" << HumanReadableSize(filesize) << "), "
+                        << "latest prime: " << LastPrime
+                        << std::fixed << std::setprecision(2)
+                        << " (" << percent << "%)" << std::flush;
+            }
+            return true;
+        },
+        num_threads
+    );
+
+    if (half_gaps) {
+        encoder.Finish(blocks);
+        ofs.write(reinterpret_cast<const char*>(blocks.data()), blocks.size());
+        filesize += blocks.size();
+    }
+
+    ofs.close();
+    if (!ofs || (!half_gaps && !WriteCheckpoint(output_file, state))) {
+        std::cerr << std::endl << "Error: Failed to finalise output file." << std::endl;
+        return 1;
     }
 
     std::cerr << std::endl << "Finished generating primes." << std::endl;
@@ -1,9 +1,10 @@
+#include <algorithm>
 #include <array>
 #include <cinttypes>
+#include <cstring>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
-#include <map>
 #include <numeric>
 #include <optional>
 #include <span>
@@ -13,7 +14,9 @@
 #include <gmpxx.h>
 #include <sys/mman.h>
 
+#include "primecount.hpp"
 #include "primes.hpp"
+#include "sieve.hpp"
 
 static std::vector<uint8_t> gGeneratedPrimeGaps;
 static std::span<const uint8_t> gMappedPrimes;
@@ -23,8 +26,6 @@ static FILE* gPrimesFile = nullptr;
 static const std::array<uint64_t, 12> gFirstPrimes = {
     2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37};
 
-static std::map<size_t, std::vector<uint64_t>> gWheelCache;
-
 const bool
 LoadPrimeGaps(
     std::string_view Filename
@@ -64,6 +65,20 @@ LoadPrimeGaps(
         return false;
     }
     gMappedPrimes = std::span<const uint8_t>(base, size);
+
+    // Half-gap stores are recognised by their header, anything else is VLE
+    if (GetPrimeGapEncoding(gMappedPrimes) == PrimeGapEncoding::HalfGap) {
+        HalfGapFileHeader header;
+        std::memcpy(&header, base, sizeof(header));
+        if (header.Version != 1 || header.BlockSize != kHalfGapBlockSize) {
+            std::cerr << "Unsupported half-gap prime store in " << Filename << std::endl;
+            munmap(const_cast<uint8_t*>(base), size);
+            gMappedPrimes = std::span<const uint8_t>();
+            fclose(file);
+            return false;
+        }
+    }
+
     gPrimesFilename = Filename;
     gPrimesFile = file;
     return true;
@@ -80,27 +95,22 @@ GeneratePrimeGaps(
         return gaps;
     }
 
-    gaps.reserve(10 * 1024 * 1024); // Reserve 100MB initially
+    // Limit is either the largest value to include or the number of primes
+    const uint64_t limit = Limit.get_ui();
+    const uint64_t end = IsCount ? PrimeUpperBound(limit) + 1 : limit + 1;
+    const size_t max_count = IsCount ? limit : 0;
+    gaps.reserve(IsCount ? limit : limit / 8);
 
-    mpz_class next = 2;
-    mpz_class previous = 0;
-    size_t count = 0;
-    while ((count && count < Limit) ||
-        (!count && next <= Limit)) {
-        mpz_class gap = next - previous;
-        previous = next;
-        // VLE encode the gap
-        while (gap > 0) {
-            uint8_t byte = gap.get_ui() & 0x7F;
-            gap >>= 7;
-            if (gap > 0) {
-                byte |= 0x80; // More bytes to come
-            }
-            gaps.push_back(byte);
+    SievePrimeGaps(
+        0,
+        end,
+        0,
+        max_count,
+        [&gaps](std::span<const uint8_t> Gaps, const uint64_t, const size_t) {
+            gaps.insert(gaps.end(), Gaps.begin(), Gaps.end());
+            return true;
         }
-        count++;
-        mpz_nextprime(next.get_mpz_t(), next.get_mpz_t());
-    }
+    );
     return gaps;
 }
 
@@ -130,35 +140,22 @@ GetNthPrime(
     
     const auto& gaps = GetPrimeGaps();
 
-    mpz_class prime = 2;
-    size_t gap_index = 1; // Start after the first gap which is for prime 2
-    size_t count = 0;
-
-    while (count < N && gap_index < gaps.size()) {
-        // Get the next VLE-encoded gap
-        uint64_t gap = 0;
-        uint8_t shift = 0;
-        uint8_t byte;
-        do {
-            byte = gaps[gap_index];
-            gap |= static_cast<uint64_t>(byte & 0x7F) << shift;
-            shift += 7;
-            gap_index++;
-        } while ((byte & 0x80) != 0);
-        prime += gap;
-        count++;
+    // Walk the store until we reach index N or run out of primes
+    size_t visited = 0;
+    const uint64_t last = ForEachPrime(gaps, [&visited, N](const uint64_t) {
+        return visited++ < N;
+    });
+    if (visited == 0) {
+        visited = 1;
     }
+    const size_t count = visited - 1;
 
-    // Continue with fallback to mpz_nextprime if needed
-    // if (count < N) {
-    //     std::cout << "Continuing to find prime " << N << " using mpz_nextprime. Currently at " << prime << std::endl;
-    // }
-    while (count < N) {
-        mpz_nextprime(prime.get_mpz_t(), prime.get_mpz_t());
-        count++;
+    // Past the end of the store, count primes rather than stepping to them
+    if (count < N) {
+        return mpz_class(NthPrime(N + 1));
     }
 
-    return prime;
+    return mpz_class(std::max<uint64_t>(last, 2));
 }
 
 size_t
@@ -168,26 +165,31 @@ GetPrimeIndex(
 {
     const auto gaps = GetPrimeGaps();
 
-    mpz_class current_prime = 2;
-    size_t gap_index = 1; // Start after the first gap which is for prime 2
+    // Count the primes in the store below Prime
+    const bool fits = Prime.fits_ulong_p();
+    const uint64_t target = fits ? Prime.get_ui() : 0;
     size_t index = 0;
-
-    while (current_prime < Prime && gap_index < gaps.size()) {
-        // Get the next VLE-encoded gap
-        uint64_t gap = 0;
-        uint8_t shift = 0;
-        uint8_t byte;
-        do {
-            byte = gaps[gap_index];
-            gap |= static_cast<uint64_t>(byte & 0x7F) << shift;
-            shift += 7;
-            gap_index++;
-        } while ((byte & 0x80) != 0);
-        current_prime += gap;
+    bool reached = false;
+    const uint64_t last = ForEachPrime(gaps, [&](const uint64_t Current) {
+        if (fits && Current >= target) {
+            reached = true;
+            return false;
+        }
         index++;
+        return true;
+    });
+    if (reached || Prime <= 2) {
+        return index;
+    }
+
+    // Past the end of the store, count the primes below Prime directly
+    if (fits) {
+        return PrimePi(target - 1);
     }
 
     // Fallback using mpz_nextprime
+    mpz_class current_prime = std::max<uint64_t>(last, 2);
+    index = index > 0 ? index - 1 : 0;
     while (current_prime < Prime) {
         mpz_nextprime(current_prime.get_mpz_t(), current_prime.get_mpz_t());
         index++;
@@ -225,50 +227,55 @@ GetPrimesForWheelModulus(
     }
 }
 
-std::span<const uint64_t>
-GetWheel(
+static std::vector<uint8_t>
+BuildWheel(
     const size_t Modulus
 )
 {
-    // Check cache first
-    if (gWheelCache.find(Modulus) != gWheelCache.end()) {
-        return gWheelCache[Modulus];
+    // Same layout as MakeWheel, for moduli too large to build at compile time
+    std::vector<uint8_t> increments;
+    increments.reserve(WheelTotient(Modulus));
+    uint64_t last = 1;
+    for (uint64_t residue = 3; residue <= Modulus + 1; residue += 2) {
+        if (IsWheelCoprime(Modulus, residue)) {
+            increments.push_back(static_cast<uint8_t>(residue - last));
+            last = residue;
+        }
     }
+    return increments;
+}
 
-    // Generate the gaps for the wheel
-    std::vector<uint64_t> gaps;
-    uint64_t next = 0;
-    size_t count = 0;
-    uint64_t last_residue = 1;
-    for (size_t residue = 3; residue < Modulus; residue+=2) {
-        if (std::gcd(residue, Modulus) != 1) {
-            continue;
+std::span<const uint8_t>
+GetWheel(
+    const size_t Modulus
+)
+{
+    // Small wheels are compile time tables. Larger ones are built on first
+    // use, function local statics make that thread safe and every later
+    // lookup is lock free.
+    switch (Modulus)
+    {
+        case 30:
+            return kWheel<30>;
+        case 210:
+            return kWheel<210>;
+        case 2310:
+            return kWheel<2310>;
+        case 30030:
+            return kWheel<30030>;
+        case 510510: {
+            static const std::vector<uint8_t> wheel = BuildWheel(510510);
+            return wheel;
         }
-        uint64_t gap = residue - last_residue;
-        if (gap > kMaxWheelGap) {
-            throw std::runtime_error("Wheel gap exceeds maximum representable size.");
+        case 9699690: {
+            static const std::vector<uint8_t> wheel = BuildWheel(9699690);
+            return wheel;
         }
-        const size_t shift = count++ * kBitsPerWheelGap;
-        next |= (gap << shift);
-        if (count == kGapsPerWord) {
-            gaps.push_back(next);
-            next = 0;
-            count = 0;
+        case 223092870: {
+            static const std::vector<uint8_t> wheel = BuildWheel(223092870);
+            return wheel;
         }
-        last_residue = residue;
-    }
-
-    // Add final gap to complete the cycle
-    const uint64_t gap = Modulus - last_residue + 1;
-    if (count > 0) {
-        const size_t shift = count++ * kBitsPerWheelGap;
-        next |= (gap << shift);
-    } else {
-        next = gap;
+        default:
+            throw std::invalid_argument("Unsupported wheel Modulus");
     }
-
-    gaps.push_back(next);
-    // Cache the result and return
-    gWheelCache[Modulus] = gaps;
-    return gWheelCache[Modulus];
-}
\ No newline at end of file
+}
@@ -1,6 +1,8 @@
 #pragma once
 
+#include <array>
 #include <cstdint>
+#include <cstring>
 #include <optional>
 #include <span>
 #include <string_view>
@@ -8,15 +10,171 @@
 
 #include <gmpxx.h>
 
-constexpr size_t kBitsPerWheelGap = 6;
-constexpr uint64_t kGapMask = (1 << kBitsPerWheelGap) - 1;
-constexpr size_t kMaxWheelGap = (1 << kBitsPerWheelGap) - 1;
-constexpr size_t kGapsPerWord = (sizeof(uint64_t) * 8) / kBitsPerWheelGap;
+// The primes that make up the supported wheel moduli
+constexpr std::array<uint64_t, 9> kWheelPrimes = {2, 3, 5, 7, 11, 13, 17, 19, 23};
+
+// Largest wheel that is generated at compile time. Bigger wheels are built
+// once on first use.
+constexpr size_t kMaxConstexprWheel = 30030;
 
 constexpr uint32_t kWheel30 = 0x26424246;
 constexpr uint32_t kWheel30BitsPerGap = 4;
 constexpr uint32_t kWheel30Mask = (1 << kWheel30BitsPerGap) - 1;
 
+constexpr bool
+IsWheelCoprime(
+    const uint64_t Modulus,
+    const uint64_t Value
+)
+{
+    for (const uint64_t prime : kWheelPrimes) {
+        if (Modulus % prime == 0 && Value % prime == 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+constexpr size_t
+WheelTotient(
+    const uint64_t Modulus
+)
+{
+    size_t totient = 1;
+    for (const uint64_t prime : kWheelPrimes) {
+        if (Modulus % prime == 0) {
+            totient *= prime - 1;
+        }
+    }
+    return totient;
+}
+
+// Byte-wide wheel increments. Starting from 1, adding each increment in
+// turn visits every residue coprime to Modulus, ending on Modulus + 1.
+template <size_t Modulus>
+constexpr std::array<uint8_t, WheelTotient(Modulus)>
+MakeWheel(
+    void
+)
+{
+    std::array<uint8_t, WheelTotient(Modulus)> increments{};
+    size_t count = 0;
+    uint64_t last = 1;
+    for (uint64_t residue = 3; residue <= Modulus + 1; residue += 2) {
+        if (IsWheelCoprime(Modulus, residue)) {
+            increments[count++] = static_cast<uint8_t>(residue - last);
+            last = residue;
+        }
+    }
+    return increments;
+}
+
+template <size_t Modulus>
+inline constexpr auto kWheel = MakeWheel<Modulus>();
+
+// Half-gap prime store. Every odd prime gap is even, so gap/2 is stored in a
+// single byte. The file starts with a 64 byte header followed by fixed size
+// blocks. Each block begins with the prime it is based on and the number of
+// half gaps that follow, so decoding a block is a plain loop of adds. A gap
+// too large for one byte ends the block early, the rest of it is filled with
+// the escape byte and the next prime becomes the base of a new block.
+// Prime 2 is implied by the file header. Only a store starting at 0 carries
+// the header, so windows of blocks can be concatenated onto it.
+constexpr char kHalfGapMagic[8] = {'A', 'L', 'Q', 'H', 'G', 'A', 'P', '1'};
+constexpr size_t kHalfGapHeaderSize = 64;
+constexpr size_t kHalfGapBlockSize = 4096;
+constexpr uint8_t kHalfGapEscape = 0;
+constexpr uint64_t kMaxHalfGap = 255;
+
+struct HalfGapFileHeader {
+    char Magic[8];
+    uint32_t Version;
+    uint32_t BlockSize;
+    uint8_t Reserved[kHalfGapHeaderSize - 16];
+};
+
+struct HalfGapBlockHeader {
+    uint64_t Base;
+    uint32_t Count;
+    uint32_t Reserved;
+};
+
+constexpr size_t kHalfGapsPerBlock = kHalfGapBlockSize - sizeof(HalfGapBlockHeader);
+
+static_assert(sizeof(HalfGapFileHeader) == kHalfGapHeaderSize);
+
+enum class PrimeGapEncoding {
+    Vle,
+    HalfGap
+};
+
+inline PrimeGapEncoding
+GetPrimeGapEncoding(
+    std::span<const uint8_t> Gaps
+)
+{
+    if (Gaps.size() >= kHalfGapHeaderSize &&
+        std::memcmp(Gaps.data(), kHalfGapMagic, sizeof(kHalfGapMagic)) == 0) {
+        return PrimeGapEncoding::HalfGap;
+    }
+    return PrimeGapEncoding::Vle;
+}
+
+// Calls Visit(prime) for each prime in the store, in either encoding, until
+// it returns false. Returns the last prime visited.
+template <typename Visitor>
+inline uint64_t
+ForEachPrime(
+    std::span<const uint8_t> Gaps,
+    Visitor&& Visit
+)
+{
+    uint64_t prime = 0;
+    if (GetPrimeGapEncoding(Gaps) == PrimeGapEncoding::Vle) {
+        size_t gap_index = 0;
+        while (gap_index < Gaps.size()) {
+            // Get the next VLE-encoded gap
+            uint64_t gap = 0;
+            uint8_t shift = 0;
+            uint8_t byte;
+            do {
+                byte = Gaps[gap_index];
+                gap |= static_cast<uint64_t>(byte & 0x7F) << shift;
+                shift += 7;
+                gap_index++;
+            } while ((byte & 0x80) != 0 && gap_index < Gaps.size());
+            prime += gap;
+            if (!Visit(prime)) {
+                return prime;
+            }
+        }
+        return prime;
+    }
+
+    prime = 2;
+    if (!Visit(prime)) {
+        return prime;
+    }
+    for (size_t offset = kHalfGapHeaderSize;
+        offset + kHalfGapBlockSize <= Gaps.size();
+        offset += kHalfGapBlockSize) {
+        HalfGapBlockHeader header;
+        std::memcpy(&header, Gaps.data() + offset, sizeof(header));
+        const uint8_t* half_gaps = Gaps.data() + offset + sizeof(header);
+        prime = header.Base;
+        if (!Visit(prime)) {
+            return prime;
+        }
+        for (uint32_t i = 0; i < header.Count; ++i) {
+            prime += 2 * static_cast<uint64_t>(half_gaps[i]);
+            if (!Visit(prime)) {
+                return prime;
+            }
+        }
+    }
+    return prime;
+}
+
 const bool
 LoadPrimeGaps(
     std::string_view Filename
@@ -48,7 +206,7 @@ GetPrimesForWheelModulus(
     const size_t Modulus
 );
 
-std::span<const uint64_t>
+std::span<const uint8_t>
 GetWheel(
     const size_t Modulus
 );
\ No newline at end of file
@@ -0,0 +1,244 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <queue>
+#include <span>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "mappedfile.hpp"
+
+// Sorting for files of fixed width records that start with their key, an
+// unsigned integer of KeyWords 64-bit words, least significant first, as
+// version 1 cache files store them.
+
+// Memory a sort may use before it spills sorted chunks and merges them
+constexpr size_t kRecordSortBudget = size_t(1) << 30;
+
+inline int
+CompareRecordKeys(
+    const uint8_t* A,
+    const uint8_t* B,
+    const size_t KeyWords
+)
+{
+    for (size_t i = KeyWords; i-- > 0;) {
+        uint64_t a = 0;
+        uint64_t b = 0;
+        std::memcpy(&a, A + i * sizeof(uint64_t), sizeof(a));
+        std::memcpy(&b, B + i * sizeof(uint64_t), sizeof(b));
+        if (a != b) {
+            return a < b ? -1 : 1;
+        }
+    }
+    return 0;
+}
+
+// Sort Records by key with an LSD radix sort, one byte per pass. Only the
+// words some key uses are sorted on, and passes over a byte that every
+// key shares are skipped, so 64-bit keys take at most 8 passes. The keys
+// and record numbers are sorted rather than the records, which are then
+// moved once. Equal keys keep their order.
+inline std::vector<uint8_t>
+RadixSortRecords(
+    const std::span<const uint8_t> Records,
+    const size_t RecordSize,
+    const size_t KeyWords
+)
+{
+    const size_t count = Records.size() / RecordSize;
+    size_t used = 1;
+    for (size_t i = 0; i < count; ++i) {
+        for (size_t word = KeyWords; word > used; --word) {
+            uint64_t value = 0;
+            std::memcpy(&value, Records.data() + i * RecordSize + (word - 1) * sizeof(uint64_t), sizeof(value));
+            if (value != 0) {
+                used = word;
+                break;
+            }
+        }
+    }
+
+    // Each item is the used key words followed by the record number
+    const size_t stride = used + 1;
+    std::vector<uint64_t> items(count * stride);
+    std::vector<std::array<size_t, 256>> histograms(used * sizeof(uint64_t));
+    for (auto& histogram : histograms) {
+        histogram.fill(0);
+    }
+    for (size_t i = 0; i < count; ++i) {
+        uint64_t* item = items.data() + i * stride;
+        std::memcpy(item, Records.data() + i * RecordSize, used * sizeof(uint64_t));
+        item[used] = i;
+        for (size_t digit = 0; digit < histograms.size(); ++digit) {
+            histograms[digit][(item[digit / 8] >> (8 * (digit % 8))) & 0xFF]++;
+        }
+    }
+
+    std::vector<uint64_t> scratch(items.size());
+    for (size_t digit = 0; digit < histograms.size(); ++digit) {
+        auto& histogram = histograms[digit];
+        if (std::find(histogram.begin(), histogram.end(), count) != histogram.end()) {
+            continue;
+        }
+        size_t offset = 0;
+        for (size_t& bucket : histogram) {
+            offset += std::exchange(bucket, offset);
+        }
+        const size_t word = digit / 8;
+        const size_t shift = 8 * (digit % 8);
+        for (size_t i = 0; i < count; ++i) {
+            const uint64_t* item = items.data() + i * stride;
+            const size_t position = histogram[(item[word] >> shift) & 0xFF]++;
+            std::memcpy(scratch.data() + position * stride, item, stride * sizeof(uint64_t));
+        }
+        items.swap(scratch);
+    }
+
+    std::vector<uint8_t> sorted(count * RecordSize);
+    for (size_t i = 0; i < count; ++i) {
+        const size_t record = items[i * stride + used];
+        std::memcpy(sorted.data() + i * RecordSize, Records.data() + record * RecordSize, RecordSize);
+    }
+    return sorted;
+}
+
+// Write Data to a temporary file and rename it over Path, so readers see
+// either the old file or the new one
+inline bool
+ReplaceFile(
+    const std::filesystem::path& Path,
+    const void* Data,
+    const size_t Size
+)
+{
+    std::filesystem::path temp = Path;
+    temp += ".tmp";
+    FILE* file = fopen(temp.c_str(), "wb");
+    if (file == nullptr) {
+        std::cerr << "Failed to write sorted file: " << temp << std::endl;
+        return false;
+    }
+    const bool written = Size == 0 || fwrite(Data, Size, 1, file) == 1;
+    if (fclose(file) != 0 || !written) {
+        std::cerr << "Failed to write sorted file: " << temp << std::endl;
+        std::filesystem::remove(temp);
+        return false;
+    }
+    std::filesystem::rename(temp, Path);
+    return true;
+}
+
+// Sort the records of the file at Path in place, replacing it by rename.
+// A file larger than Budget is sorted in chunks that fit, which are
+// spilled next to it and merged. A partial record at the end is dropped.
+inline bool
+SortRecordFile(
+    const std::filesystem::path& Path,
+    const size_t RecordSize,
+    const size_t KeyWords,
+    const size_t Budget = kRecordSortBudget
+)
+{
+    MappedFile map;
+    if (!map.Open(Path)) {
+        std::cerr << "Failed to open file for sorting: " << Path << std::endl;
+        return false;
+    }
+    const size_t count = map.Size() / RecordSize;
+    const std::span<const uint8_t> records = map.Data().first(count * RecordSize);
+    // The copy of the records, and the keys twice over
+    const size_t per_record = RecordSize + 2 * (KeyWords + 1) * sizeof(uint64_t);
+    const size_t chunk_records = std::max<size_t>(1, Budget / per_record);
+    if (count <= chunk_records) {
+        const std::vector<uint8_t> sorted = RadixSortRecords(records, RecordSize, KeyWords);
+        return ReplaceFile(Path, sorted.data(), sorted.size());
+    }
+
+    std::vector<std::filesystem::path> chunk_paths;
+    auto remove_chunks = [&chunk_paths]() {
+        std::error_code error;
+        for (const auto& chunk : chunk_paths) {
+            std::filesystem::remove(chunk, error);
+        }
+    };
+    for (size_t first = 0; first < count; first += chunk_records) {
+        const size_t chunk = std::min(chunk_records, count - first);
+        const std::vector<uint8_t> sorted = RadixSortRecords(
+            records.subspan(first * RecordSize, chunk * RecordSize),
+            RecordSize,
+            KeyWords
+        );
+        std::filesystem::path chunk_path = Path;
+        chunk_path += ".sort" + std::to_string(chunk_paths.size());
+        chunk_paths.push_back(chunk_path);
+        if (!ReplaceFile(chunk_path, sorted.data(), sorted.size())) {
+            remove_chunks();
+            return false;
+        }
+    }
+    map.Close();
+
+    std::vector<MappedFile> chunks(chunk_paths.size());
+    std::vector<size_t> offsets(chunk_paths.size(), 0);
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        if (!chunks[i].Open(chunk_paths[i])) {
+            std::cerr << "Failed to open sorted chunk: " << chunk_paths[i] << std::endl;
+            remove_chunks();
+            return false;
+        }
+    }
+    // Smallest key on top, the earlier chunk among equal keys
+    auto later = [&](const size_t A, const size_t B) {
+        const int order = CompareRecordKeys(
+            chunks[A].Data().data() + offsets[A],
+            chunks[B].Data().data() + offsets[B],
+            KeyWords
+        );
+        return order > 0 || (order == 0 && A > B);
+    };
+    std::priority_queue<size_t, std::vector<size_t>, decltype(later)> heap(later);
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        if (chunks[i].Size() > 0) {
+            heap.push(i);
+        }
+    }
+
+    std::filesystem::path temp = Path;
+    temp += ".tmp";
+    FILE* file = fopen(temp.c_str(), "wb");
+    if (file == nullptr) {
+        std::cerr << "Failed to write sorted file: " << temp << std::endl;
+        remove_chunks();
+        return false;
+    }
+    std::vector<char> buffer(size_t(1) << 20);
+    setvbuf(file, buffer.data(), _IOFBF, buffer.size());
+    bool written = true;
+    while (!heap.empty() && written) {
+        const size_t chunk = heap.top();
+        heap.pop();
+        written = fwrite(chunks[chunk].Data().data() + offsets[chunk], RecordSize, 1, file) == 1;
+        offsets[chunk] += RecordSize;
+        if (offsets[chunk] < chunks[chunk].Size()) {
+            heap.push(chunk);
+        }
+    }
+    if (fclose(file) != 0 || !written) {
+        std::cerr << "Failed to write sorted file: " << temp << std::endl;
+        std::filesystem::remove(temp);
+        remove_chunks();
+        return false;
+    }
+    chunks.clear();
+    remove_chunks();
+    std::filesystem::rename(temp, Path);
+    return true;
+}
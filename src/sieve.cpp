@@ -0,0 +1,417 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <cstdint>
+#include <deque>
+#include <future>
+#include <optional>
+#include <span>
+#include <vector>
+
+#include "sieve.hpp"
+
+// How far past a window's start its first prime may be, far above any
+// prime gap below 2^64
+constexpr uint64_t kMaxWindowLead = 1 << 16;
+
+void
+HalfGapEncoder::Add(
+    const uint64_t Prime,
+    std::vector<uint8_t>& Output
+)
+{
+    // 2 is implied by the file header
+    if (Prime == 2) {
+        return;
+    }
+    const uint64_t half_gap = (Prime - m_Last) / 2;
+    if (m_Open && half_gap <= kMaxHalfGap && m_Header.Count < kHalfGapsPerBlock) {
+        m_HalfGaps[m_Header.Count++] = static_cast<uint8_t>(half_gap);
+    } else {
+        // Block is full or the gap needs escaping, start a new block at this prime
+        if (m_Open) {
+            Flush(Output);
+        }
+        m_Header.Base = Prime;
+        m_Header.Count = 0;
+        m_Open = true;
+    }
+    m_Last = Prime;
+}
+
+void
+HalfGapEncoder::Finish(
+    std::vector<uint8_t>& Output
+)
+{
+    if (m_Open) {
+        Flush(Output);
+    }
+}
+
+void
+HalfGapEncoder::Flush(
+    std::vector<uint8_t>& Output
+)
+{
+    // Unused bytes are escapes so the block is always full size
+    std::fill(m_HalfGaps.begin() + m_Header.Count, m_HalfGaps.end(), kHalfGapEscape);
+    const uint8_t* header = reinterpret_cast<const uint8_t*>(&m_Header);
+    Output.insert(Output.end(), header, header + sizeof(m_Header));
+    Output.insert(Output.end(), m_HalfGaps.begin(), m_HalfGaps.end());
+    m_Open = false;
+}
+
+void
+AppendHalfGapHeader(
+    std::vector<uint8_t>& Output
+)
+{
+    HalfGapFileHeader header{};
+    std::memcpy(header.Magic, kHalfGapMagic, sizeof(kHalfGapMagic));
+    header.Version = 1;
+    header.BlockSize = kHalfGapBlockSize;
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&header);
+    Output.insert(Output.end(), bytes, bytes + sizeof(header));
+}
+
+PrimeGapTail
+ScanHalfGapBlocks(
+    std::span<const uint8_t> Blocks
+)
+{
+    // Blocks are self describing, so only their headers need reading.
+    // The last prime comes from decoding the final block. Scanning stops
+    // at a block that cannot be one, with more gaps than fit or a base
+    // not above the block before, so Valid ends before it.
+    PrimeGapTail tail;
+    const size_t num_blocks = Blocks.size() / kHalfGapBlockSize;
+    HalfGapBlockHeader header{};
+    HalfGapBlockHeader last{};
+    for (size_t i = 0; i < num_blocks; ++i) {
+        std::memcpy(&header, Blocks.data() + i * kHalfGapBlockSize, sizeof(header));
+        if (header.Count > kHalfGapsPerBlock || (i > 0 && header.Base <= last.Base)) {
+            break;
+        }
+        tail.Count += header.Count + 1;
+        tail.Valid += kHalfGapBlockSize;
+        last = header;
+    }
+    if (tail.Valid > 0) {
+        const uint8_t* half_gaps = Blocks.data() + tail.Valid - kHalfGapsPerBlock;
+        tail.Last = last.Base;
+        for (uint32_t i = 0; i < last.Count; ++i) {
+            tail.Last += 2 * static_cast<uint64_t>(half_gaps[i]);
+        }
+    }
+    return tail;
+}
+
+void
+EncodeGap(
+    std::vector<uint8_t>& Output,
+    uint64_t Gap
+)
+{
+    // VLE encode the gap, least significant 7 bits first
+    while (Gap > 0) {
+        uint8_t byte = Gap & 0x7F;
+        Gap >>= 7;
+        if (Gap > 0) {
+            byte |= 0x80; // More bytes to come
+        }
+        Output.push_back(byte);
+    }
+}
+
+std::vector<uint32_t>
+SieveBasePrimes(
+    const uint64_t Limit
+)
+{
+    std::vector<uint32_t> primes;
+    if (Limit < 2) {
+        return primes;
+    }
+    primes.push_back(2);
+
+    // Odd-only sieve, index i represents 2i + 1
+    std::vector<uint8_t> composite(Limit / 2 + 1, 0);
+    for (uint64_t i = 1; i < composite.size(); ++i) {
+        if (composite[i]) {
+            continue;
+        }
+        const uint64_t p = 2 * i + 1;
+        if (p > Limit) {
+            break;
+        }
+        primes.push_back(static_cast<uint32_t>(p));
+        for (uint64_t j = p * p / 2; j < composite.size(); j += p) {
+            composite[j] = 1;
+        }
+    }
+    return primes;
+}
+
+PrimeGapChunk
+SieveSegment(
+    const uint64_t Low,
+    const uint64_t High,
+    std::span<const uint32_t> BasePrimes
+)
+{
+    PrimeGapChunk chunk;
+    if (High <= Low) {
+        return chunk;
+    }
+
+    uint64_t previous = 0;
+    auto add_prime = [&chunk, &previous](const uint64_t Prime) {
+        if (chunk.Count == 0) {
+            chunk.First = Prime;
+        } else {
+            EncodeGap(chunk.Gaps, Prime - previous);
+        }
+        previous = Prime;
+        chunk.Count++;
+    };
+
+    // 2 is the only even prime, everything else goes through the odd-only map
+    if (Low <= 2 && 2 < High) {
+        add_prime(2);
+    }
+
+    const uint64_t first_odd = std::max<uint64_t>(Low, 3) | 1;
+    if (first_odd >= High) {
+        chunk.Last = previous;
+        return chunk;
+    }
+
+    // Index i represents first_odd + 2i
+    const size_t size = (High - first_odd + 1) / 2;
+    std::vector<uint8_t> composite(size, 0);
+    for (const uint32_t base : BasePrimes) {
+        if (base == 2) {
+            continue;
+        }
+        const uint64_t p = base;
+        const uint64_t square = p * p;
+        if (square >= High) {
+            break;
+        }
+        // Find the first odd multiple of p in the segment, never below p^2
+        uint64_t start = square;
+        if (start < first_odd) {
+            start = (first_odd + p - 1) / p * p;
+            if ((start & 1) == 0) {
+                start += p;
+            }
+        }
+        for (uint64_t i = (start - first_odd) / 2; i < size; i += p) {
+            composite[i] = 1;
+        }
+    }
+
+    chunk.Gaps.reserve(size / 4);
+    for (size_t i = 0; i < size; ++i) {
+        if (!composite[i]) {
+            add_prime(first_odd + 2 * i);
+        }
+    }
+    chunk.Last = previous;
+    return chunk;
+}
+
+PrimeGapTail
+ScanPrimeGaps(
+    std::span<const uint8_t> Gaps,
+    const uint64_t Previous
+)
+{
+    PrimeGapTail tail;
+    tail.Last = Previous;
+    uint64_t gap = 0;
+    uint8_t shift = 0;
+    for (size_t i = 0; i < Gaps.size(); ++i) {
+        const uint8_t byte = Gaps[i];
+        gap |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        shift += 7;
+        if ((byte & 0x80) == 0) {
+            tail.Last += gap;
+            tail.Count++;
+            tail.Valid = i + 1;
+            gap = 0;
+            shift = 0;
+        }
+    }
+    return tail;
+}
+
+uint64_t
+PreviousPrime(
+    const uint64_t Value
+)
+{
+    if (Value <= 2) {
+        return 0;
+    }
+    // Sieve progressively wider windows below Value until one has a prime
+    uint64_t width = 256;
+    while (true) {
+        const uint64_t low = Value > width ? Value - width : 0;
+        uint64_t root = static_cast<uint64_t>(std::sqrt(static_cast<double>(Value))) + 1;
+        const auto chunk = SieveSegment(low, Value, SieveBasePrimes(root));
+        if (chunk.Count > 0) {
+            return chunk.Last;
+        }
+        width *= 2;
+    }
+}
+
+std::optional<PrimeGapEncoding>
+DetectOutputEncoding(
+    std::span<const uint8_t> Output,
+    const uint64_t Start
+)
+{
+    if (Output.empty()) {
+        return std::nullopt;
+    }
+    if (GetPrimeGapEncoding(Output) == PrimeGapEncoding::HalfGap) {
+        return PrimeGapEncoding::HalfGap;
+    }
+    if (Start == 0) {
+        // A whole half-gap output always starts with its header
+        return PrimeGapEncoding::Vle;
+    }
+    // Windows have no header, but both encodings lead with the first
+    // prime of the window, as a block base or as a gap from the prime
+    // below Start
+    auto is_first = [Start](const uint64_t Prime) {
+        return Prime >= Start && Prime - Start < kMaxWindowLead &&
+            PreviousPrime(Prime + 1) == Prime && PreviousPrime(Prime) < Start;
+    };
+    if (Output.size() >= sizeof(HalfGapBlockHeader)) {
+        HalfGapBlockHeader header{};
+        std::memcpy(&header, Output.data(), sizeof(header));
+        if (header.Count <= kHalfGapsPerBlock && is_first(header.Base)) {
+            return PrimeGapEncoding::HalfGap;
+        }
+    }
+    const uint64_t previous = PreviousPrime(Start);
+    const size_t end = std::ranges::find_if(Output, [](const uint8_t Byte) { return (Byte & 0x80) == 0; }) - Output.begin();
+    if (end < Output.size() && is_first(ScanPrimeGaps(Output.first(end + 1), previous).Last)) {
+        return PrimeGapEncoding::Vle;
+    }
+    return std::nullopt;
+}
+
+uint64_t
+PrimeUpperBound(
+    const size_t Count
+)
+{
+    // Rosser's bound p_n < n (ln n + ln ln n) holds for n >= 6
+    if (Count < 6) {
+        return 14;
+    }
+    // Saturates so that the bound plus one, as an exclusive end, still fits
+    const double n = static_cast<double>(Count);
+    const double bound = n * (std::log(n) + std::log(std::log(n)));
+    if (bound >= 0x1p64 - 4096) {
+        return UINT64_MAX - 1;
+    }
+    return static_cast<uint64_t>(bound) + 1;
+}
+
+uint64_t
+SievePrimeGaps(
+    const uint64_t Start,
+    const uint64_t End,
+    const uint64_t Previous,
+    const size_t MaxCount,
+    const PrimeGapWriter& Writer,
+    const size_t NumThreads
+)
+{
+    if (End <= Start) {
+        return Previous;
+    }
+
+    // Base primes only need to cover the square root of the last candidate
+    uint64_t root = static_cast<uint64_t>(std::sqrt(static_cast<double>(End - 1)));
+    while (root * root > End - 1) {
+        root--;
+    }
+    while ((root + 1) * (root + 1) <= End - 1) {
+        root++;
+    }
+    const std::vector<uint32_t> base_primes = SieveBasePrimes(root);
+
+    // Keep a couple of segments per thread in flight. Segments are
+    // collected strictly in order so the output is independent of timing.
+    const size_t in_flight = std::max<size_t>(NumThreads, 1) * 2;
+    std::deque<std::future<PrimeGapChunk>> pending;
+    uint64_t next_low = Start;
+    auto launch = [&]() {
+        const uint64_t low = next_low;
+        const uint64_t high = End - low > kSieveSegmentSize ? low + kSieveSegmentSize : End;
+        next_low = high;
+        pending.push_back(std::async(std::launch::async, [low, high, &base_primes]() {
+            return SieveSegment(low, high, base_primes);
+        }));
+    };
+    while (pending.size() < in_flight && next_low < End) {
+        launch();
+    }
+
+    uint64_t last = Previous;
+    size_t count = 0;
+    std::vector<uint8_t> stitched;
+    while (!pending.empty()) {
+        PrimeGapChunk chunk = pending.front().get();
+        pending.pop_front();
+        if (next_low < End) {
+            launch();
+        }
+        if (chunk.Count == 0) {
+            continue;
+        }
+
+        // The gap that crosses the segment boundary comes first
+        stitched.clear();
+        EncodeGap(stitched, chunk.First - last);
+
+        size_t take = chunk.Count;
+        if (MaxCount != 0 && count + take > MaxCount) {
+            take = MaxCount - count;
+        }
+        if (take == chunk.Count) {
+            stitched.insert(stitched.end(), chunk.Gaps.begin(), chunk.Gaps.end());
+            last = chunk.Last;
+        } else {
+            // Only part of this chunk is needed, walk the gaps to find the cut
+            size_t offset = 0;
+            last = chunk.First;
+            for (size_t i = 1; i < take; ++i) {
+                uint64_t gap = 0;
+                uint8_t shift = 0;
+                uint8_t byte;
+                do {
+                    byte = chunk.Gaps[offset++];
+                    gap |= static_cast<uint64_t>(byte & 0x7F) << shift;
+                    shift += 7;
+                } while ((byte & 0x80) != 0);
+                last += gap;
+            }
+            stitched.insert(stitched.end(), chunk.Gaps.begin(), chunk.Gaps.begin() + offset);
+        }
+        count += take;
+
+        if (!Writer(stitched, last, count) || (MaxCount != 0 && count >= MaxCount)) {
+            // Outstanding futures finish in their destructors
+            break;
+        }
+    }
+    return last;
+}
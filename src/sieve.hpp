@@ -0,0 +1,131 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <span>
+#include <thread>
+#include <vector>
+
+#include "primes.hpp"
+
+// Numbers covered by a single sieve segment. Only odd numbers are stored
+// so each segment uses half this many bytes, which keeps it in L2.
+constexpr uint64_t kSieveSegmentSize = 1ull << 21;
+
+// The primes found in one segment. Gaps holds the VLE-encoded gaps between
+// consecutive primes in the segment, starting after First. The gap leading
+// into First is only known once the previous segment is done, so it is
+// added when the chunks are stitched together.
+struct PrimeGapChunk {
+    uint64_t First = 0;
+    uint64_t Last = 0;
+    size_t Count = 0;
+    std::vector<uint8_t> Gaps;
+};
+
+// Where a VLE gap stream ends. Valid is the number of bytes that make up
+// complete gaps, anything after it is a partially written gap.
+struct PrimeGapTail {
+    uint64_t Last = 0;
+    size_t Count = 0;
+    size_t Valid = 0;
+};
+
+// Receives the stitched VLE stream in order, along with the last prime and
+// the total number of primes written so far. Returning false stops the sieve.
+using PrimeGapWriter = std::function<bool(
+    std::span<const uint8_t> Gaps,
+    const uint64_t LastPrime,
+    const size_t Count
+)>;
+
+// Packs a stream of primes into half-gap blocks. Blocks are appended to
+// the output as they fill, Finish writes out the final partial block.
+class HalfGapEncoder {
+public:
+    void
+    Add(
+        const uint64_t Prime,
+        std::vector<uint8_t>& Output
+    );
+
+    void
+    Finish(
+        std::vector<uint8_t>& Output
+    );
+
+private:
+    void
+    Flush(
+        std::vector<uint8_t>& Output
+    );
+
+    HalfGapBlockHeader m_Header{};
+    std::array<uint8_t, kHalfGapsPerBlock> m_HalfGaps{};
+    uint64_t m_Last = 0;
+    bool m_Open = false;
+};
+
+void
+AppendHalfGapHeader(
+    std::vector<uint8_t>& Output
+);
+
+PrimeGapTail
+ScanHalfGapBlocks(
+    std::span<const uint8_t> Blocks
+);
+
+void
+EncodeGap(
+    std::vector<uint8_t>& Output,
+    uint64_t Gap
+);
+
+std::vector<uint32_t>
+SieveBasePrimes(
+    const uint64_t Limit
+);
+
+PrimeGapChunk
+SieveSegment(
+    const uint64_t Low,
+    const uint64_t High,
+    std::span<const uint32_t> BasePrimes
+);
+
+PrimeGapTail
+ScanPrimeGaps(
+    std::span<const uint8_t> Gaps,
+    const uint64_t Previous
+);
+
+uint64_t
+PreviousPrime(
+    const uint64_t Value
+);
+
+// The encoding of an existing output for a window starting at Start, or
+// nullopt when it is empty or matches neither
+std::optional<PrimeGapEncoding>
+DetectOutputEncoding(
+    std::span<const uint8_t> Output,
+    const uint64_t Start
+);
+
+uint64_t
+PrimeUpperBound(
+    const size_t Count
+);
+
+uint64_t
+SievePrimeGaps(
+    const uint64_t Start,
+    const uint64_t End,
+    const uint64_t Previous,
+    const size_t MaxCount,
+    const PrimeGapWriter& Writer,
+    const size_t NumThreads = std::thread::hardware_concurrency()
+);
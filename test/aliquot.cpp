@@ -8,20 +8,42 @@
 TEST(Aliquot, SumOfDivisors)
 {
     mpz_class n = 10; // 1, 2, 5
-    auto sum = SumOfDivisors(n);
+    auto [sum, factors] = SumOfDivisors(n);
     EXPECT_EQ(sum, 8); // 1 + 2 + 5 = 8
+    EXPECT_EQ(factors.Product(), n);
     n = 8;
-    sum = SumOfDivisors(n); // 1, 2, 4
+    sum = std::get<0>(SumOfDivisors(n)); // 1, 2, 4
     EXPECT_EQ(sum, 7); // 1 + 2 + 4 = 7
+    n = 1; // No proper divisors
+    sum = std::get<0>(SumOfDivisors(n));
+    EXPECT_EQ(sum, 0);
+    n = 7; // A prime only has 1
+    sum = std::get<0>(SumOfDivisors(n));
+    EXPECT_EQ(sum, 1);
+}
+
+TEST(Aliquot, SumOfDivisorsMatchesEnumeration)
+{
+    for (uint64_t i = 2; i < 2000; ++i) {
+        const mpz_class n = i;
+        const auto [sum, factors] = SumOfDivisors(n);
+        mpz_class expected = 0;
+        for (const auto& divisor : factors.GetComposite()) {
+            if (divisor != n) {
+                expected += divisor;
+            }
+        }
+        EXPECT_EQ(sum, expected) << n;
+    }
 }
 
 TEST(Aliquot, AliquotSequence)
 {
     mpz_class n = 12; // 1, 2, 3, 4, 6
-    auto sequence = aliquot_sequence(n);
+    auto sequence = AliquotSequence(n);
     std::vector<mpz_class> expected = {16, 15, 9, 4, 3, 1};
     ASSERT_EQ(sequence.size(), expected.size());
     for (size_t i = 0; i < expected.size(); ++i) {
         EXPECT_EQ(sequence[i], expected[i]);
     }
-}
\ No newline at end of file
+}
@@ -123,4 +123,60 @@ TEST(Factors, Product)
     factors.AddFactor(5);
     mpz_class prod = factors.Product();
     EXPECT_EQ(prod, 60); // 2^2 * 3^1 * 5^1 = 60
-}
\ No newline at end of file
+}
+TEST(Factors, ParseFactorLine)
+{
+    mpz_class number;
+    PrimeFactors factors;
+    ASSERT_TRUE(ParseFactorLine("360 = 2^3 * 3^2 * 5", &number, &factors));
+    EXPECT_EQ(number, 360);
+    EXPECT_EQ(factors.CountOf(2), 3);
+    EXPECT_EQ(factors.CountOf(3), 2);
+    EXPECT_EQ(factors.CountOf(5), 1);
+    EXPECT_EQ(factors.Product(), number);
+
+    // The form GetString writes, without spaces and with a carriage return
+    ASSERT_TRUE(ParseFactorLine("1099532599387=1048583^1*1048589^1\r", &number, &factors));
+    EXPECT_EQ(number, mpz_class("1099532599387"));
+    EXPECT_EQ(factors.GetString(), "1048583^1 * 1048589^1");
+
+    EXPECT_FALSE(ParseFactorLine("", &number, &factors));
+    EXPECT_FALSE(ParseFactorLine("12", &number, &factors));
+    EXPECT_FALSE(ParseFactorLine("12 = ", &number, &factors));
+    EXPECT_FALSE(ParseFactorLine("12 = 2^2 *", &number, &factors));
+    EXPECT_FALSE(ParseFactorLine("12 = 2^0 * 3", &number, &factors));
+    EXPECT_FALSE(ParseFactorLine("12 = 2^2 x 3", &number, &factors));
+}
+
+TEST(Factors, Sigma)
+{
+    PrimeFactors factors;
+    EXPECT_EQ(factors.Sigma(), 1);
+    // 2^3 * 3^2 * 5 * 7 = 2520, sigma = 15 * 13 * 6 * 8
+    for (const uint64_t prime : {2, 2, 2, 3, 3, 5, 7}) {
+        factors.AddFactor(prime);
+    }
+    EXPECT_EQ(factors.Sigma(), 15 * 13 * 6 * 8);
+    mpz_class sum = 0;
+    for (const auto& composite : factors.GetComposite()) {
+        sum += composite;
+    }
+    EXPECT_EQ(factors.Sigma(), sum);
+
+    // Enough distinct primes for several levels of the product tree
+    PrimeFactors many;
+    mpz_class expected = 1;
+    mpz_class prime = 1048576;
+    for (size_t i = 0; i < 37; ++i) {
+        mpz_nextprime(prime.get_mpz_t(), prime.get_mpz_t());
+        many.AddFactor(prime, i % 3 + 1);
+        mpz_class term = 0;
+        mpz_class power = 1;
+        for (size_t k = 0; k <= i % 3 + 1; ++k) {
+            term += power;
+            power *= prime;
+        }
+        expected *= term;
+    }
+    EXPECT_EQ(many.Sigma(), expected);
+}
@@ -0,0 +1,944 @@
+#include <chrono>
+#include <filesystem>
+#include <sstream>
+#include <thread>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <gmpxx.h>
+#include <gtest/gtest.h>
+
+#include "asyncreader.hpp"
+#include "cacheserver.hpp"
+#include "primefactorcache.hpp"
+#include "recordsort.hpp"
+
+static std::filesystem::path
+TempCachePath(
+    const std::string& Name
+)
+{
+    std::filesystem::path path = std::filesystem::temp_directory_path() / ("aliquot_test_" + Name);
+    std::filesystem::remove_all(path);
+    return path;
+}
+
+static PrimeFactors
+MakeFactors(
+    const std::vector<uint64_t>& Primes
+)
+{
+    PrimeFactors factors;
+    for (const uint64_t prime : Primes) {
+        factors.AddFactor(prime);
+    }
+    return factors;
+}
+
+// Append Factors to the version 1 cache at Path, as the old factorgen did
+static void
+WriteLegacyRecord(
+    const std::filesystem::path& Path,
+    const PrimeFactors& Factors
+)
+{
+    std::filesystem::create_directories(Path / "index");
+    const uint64_t product = Factors.Product64();
+    IndexEntry<512> entry;
+    entry.product = product;
+    entry.num_factors = Factors.Size();
+    FILE* index = fopen(CacheSegment<>::IndexPath(Path, product & 0xFF).c_str(), "ab");
+    ASSERT_NE(index, nullptr);
+    fwrite(&entry, sizeof(entry), 1, index);
+    fclose(index);
+
+    std::vector<char> buffer(FactorRecordSize<512>(Factors.Size()));
+    FactorRecord<512>* record = reinterpret_cast<FactorRecord<512>*>(buffer.data());
+    record->product = product;
+    size_t i = 0;
+    for (const auto& [prime, count] : Factors.ToVector()) {
+        record->factors[i].value = prime;
+        record->factors[i].count = count;
+        i++;
+    }
+    FILE* data = fopen(CacheSegment<>::FactorPath(Path, Factors.Size()).c_str(), "ab");
+    ASSERT_NE(data, nullptr);
+    fwrite(buffer.data(), buffer.size(), 1, data);
+    fclose(data);
+}
+
+TEST(PrimeFactorCache, WriteThenLookup)
+{
+    const auto path = TempCachePath("lookup");
+    {
+        PrimeFactorCache cache(path.string());
+        cache.Write(MakeFactors({7, 11, 13}));
+        cache.Write(MakeFactors({13, 17, 17}));
+        cache.Write(MakeFactors({3, 5}));
+
+        // Writes are visible to the same handle straight away
+        auto found = cache.ProductExists(1001);
+        ASSERT_TRUE(found.has_value());
+        EXPECT_EQ(found->GetString(), "7^1 * 11^1 * 13^1");
+        EXPECT_FALSE(cache.ProductExists(1003).has_value());
+    }
+
+    // And to a fresh resident handle
+    PrimeFactorCache cache(path.string(), true);
+    auto found = cache.ProductExists(13 * 17 * 17);
+    ASSERT_TRUE(found.has_value());
+    EXPECT_EQ(found->CountOf(17), 2);
+    ASSERT_TRUE(cache.ProductExists(15).has_value());
+    EXPECT_FALSE(cache.ProductExists(17).has_value());
+    std::filesystem::remove_all(path);
+}
+
+TEST(PrimeFactorCache, ClosedCacheMisses)
+{
+    PrimeFactorCache cache("");
+    EXPECT_FALSE(cache.IsOpen());
+    EXPECT_FALSE(cache.ProductExists(1001).has_value());
+}
+
+TEST(PrimeFactorCache, RunsAndCompaction)
+{
+    const auto path = TempCachePath("runs");
+    std::vector<uint64_t> products;
+    {
+        PrimeFactorCache cache(path.string());
+        // Enough flushed runs to trigger a background compaction
+        for (uint64_t p = 3; p < 200; p += 2) {
+            for (uint64_t q = p; q < 200; q += 2) {
+                auto factors = MakeFactors({p, q});
+                products.push_back(factors.Product64());
+                cache.Write(factors);
+            }
+            cache.Flush();
+        }
+        for (const uint64_t product : products) {
+            ASSERT_TRUE(cache.ProductExists(product).has_value()) << product;
+        }
+    }
+    // Everything left in runs is found again after reopening
+    {
+        PrimeFactorCache cache(path.string());
+        for (const uint64_t product : products) {
+            ASSERT_TRUE(cache.ProductExists(product).has_value()) << product;
+        }
+        cache.Sort();
+    }
+    // Sort leaves a single base segment
+    EXPECT_TRUE(std::filesystem::is_empty(path / "runs"));
+    PrimeFactorCache cache(path.string());
+    for (const uint64_t product : products) {
+        auto found = cache.ProductExists(product);
+        ASSERT_TRUE(found.has_value()) << product;
+        EXPECT_EQ(found->Product64(), product);
+    }
+    EXPECT_FALSE(cache.ProductExists(2).has_value());
+    std::filesystem::remove_all(path);
+}
+
+TEST(PrimeFactorCache, BackgroundFlush)
+{
+    const auto path = TempCachePath("background");
+    // Several memtables' worth, so writes outrun the flusher
+    constexpr uint64_t count = 300000;
+    {
+        PrimeFactorCache cache(path.string());
+        for (uint64_t i = 1; i <= count; ++i) {
+            cache.Write(MakeFactors({3, i}));
+        }
+        // Found whether still queued or already flushed
+        cache.GetHotCache().Clear();
+        for (uint64_t i = 1; i <= count; i += 97) {
+            ASSERT_TRUE(cache.ProductExists(3 * i).has_value()) << i;
+        }
+    }
+    PrimeFactorCache cache(path.string());
+    for (uint64_t i = 1; i <= count; i += 97) {
+        ASSERT_TRUE(cache.ProductExists(3 * i).has_value()) << i;
+    }
+    EXPECT_FALSE(cache.ProductExists(3 * count + 3).has_value());
+    std::filesystem::remove_all(path);
+}
+
+TEST(PrimeFactorCache, BulkWriter)
+{
+    const auto path = TempCachePath("bulk");
+    constexpr uint64_t count = 50000;
+    {
+        PrimeFactorCache cache(path.string());
+        cache.Write(MakeFactors({3, 5}));
+        cache.Flush();
+
+        // A small budget spills enough segments for a heap merge
+        PrimeFactorCache<>::BulkWriter bulk(cache, 64 << 10);
+        std::vector<std::thread> threads;
+        for (uint64_t t = 0; t < 4; ++t) {
+            threads.emplace_back([&bulk, t]() {
+                for (uint64_t i = count - t; i > 0; i -= std::min<uint64_t>(i, 4)) {
+                    bulk.Add(MakeFactors({7, i}));
+                }
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        // A repeated key keeps its last factorization
+        bulk.Add(49, MakeFactors({7, 7}));
+        EXPECT_EQ(bulk.Records(), count + 1);
+        EXPECT_EQ(bulk.Finish(), count);
+        EXPECT_EQ(bulk.Finish(), 0);
+
+        EXPECT_TRUE(cache.ProductExists(15).has_value());
+        for (uint64_t i = 1; i <= count; i += 37) {
+            auto found = cache.ProductExists(7 * i);
+            ASSERT_TRUE(found.has_value()) << i;
+            EXPECT_EQ(found->Product(), 7 * i);
+        }
+    }
+    PrimeFactorCache cache(path.string());
+    EXPECT_EQ(cache.ProductExists(49)->CountOf(7), 2);
+    EXPECT_TRUE(cache.ProductExists(7 * count).has_value());
+    EXPECT_FALSE(cache.ProductExists(7 * count + 7).has_value());
+    // Spills are not left behind
+    size_t temps = 0;
+    for (const auto& entry : std::filesystem::directory_iterator(path / "runs")) {
+        temps += entry.path().filename().string().starts_with("tmp-");
+    }
+    EXPECT_EQ(temps, 0);
+    std::filesystem::remove_all(path);
+}
+
+TEST(PrimeFactorCache, ProductExistsBatch)
+{
+    const auto path = TempCachePath("batch");
+    const uint64_t wide = (uint64_t(1) << 61) - 1;
+    {
+        PrimeFactorCache cache(path.string());
+        for (uint64_t i = 1; i <= 20000; ++i) {
+            cache.Write(MakeFactors({11, i}));
+        }
+        cache.Write(MakeFactors({wide, 1000003}));
+        cache.Sort();
+        // A newer run overrides the base
+        cache.Write(MakeFactors({11, 2, 2}));
+        cache.Flush();
+    }
+    PrimeFactorCache cache(path.string());
+    cache.Write(MakeFactors({13, 17}));
+
+    std::vector<mpz_class> products;
+    for (uint64_t i = 40000; i >= 7; i -= 7) {
+        products.push_back(11 * i);
+        products.push_back(11 * i + 1);
+    }
+    products.push_back(44);
+    products.push_back(44);
+    products.push_back(221);
+    products.push_back(mpz_class(std::to_string(wide)) * 1000003);
+    const auto found = cache.ProductExistsBatch(products);
+    ASSERT_EQ(found.size(), products.size());
+    EXPECT_EQ(found[found.size() - 4]->CountOf(2), 2);
+    EXPECT_EQ(found[found.size() - 3]->CountOf(2), 2);
+    EXPECT_TRUE(found[found.size() - 2].has_value());
+    ASSERT_TRUE(found.back().has_value());
+    EXPECT_EQ(found.back()->Product(), products.back());
+
+    PrimeFactorCache check(path.string());
+    check.Write(MakeFactors({13, 17}));
+    for (size_t i = 0; i < products.size(); ++i) {
+        const auto expected = check.ProductExists(products[i]);
+        ASSERT_EQ(found[i].has_value(), expected.has_value()) << products[i];
+        if (expected.has_value()) {
+            EXPECT_EQ(found[i]->GetString(), expected->GetString()) << products[i];
+        }
+    }
+    std::filesystem::remove_all(path);
+}
+
+TEST(PrimeFactorCache, AsyncReader)
+{
+    const auto path = TempCachePath("async");
+    std::vector<uint8_t> contents(1 << 20);
+    for (size_t i = 0; i < contents.size(); ++i) {
+        contents[i] = static_cast<uint8_t>(i * 2654435761u >> 13);
+    }
+    ASSERT_TRUE(ReplaceFile(path, contents.data(), contents.size()));
+    MappedFile file;
+    ASSERT_TRUE(file.Open(path));
+
+    // More reads than the ring holds, as well as the pread fallback
+    for (const unsigned depth : {kAsyncReadDepth, 0u}) {
+        AsyncReader reader(depth);
+        if (depth == 0) {
+            EXPECT_FALSE(reader.UsesRing());
+        }
+        std::vector<std::vector<uint8_t>> buffers;
+        std::vector<ReadRequest> reads;
+        for (uint64_t i = 0; i < 1000; ++i) {
+            const uint64_t offset = (i * 7919 * 4099) % (contents.size() - 4096);
+            buffers.emplace_back(1 + i % 4096);
+            reads.push_back(ReadRequest{file.Fd(), offset, static_cast<uint32_t>(buffers.back().size()), buffers.back().data()});
+        }
+        ASSERT_TRUE(reader.Read(reads)) << depth;
+        for (const ReadRequest& read : reads) {
+            ASSERT_EQ(std::memcmp(read.Buffer, contents.data() + read.Offset, read.Size), 0) << depth;
+        }
+        // Reading past the end fails
+        uint8_t tail[16];
+        const ReadRequest past = {file.Fd(), contents.size() - 8, sizeof(tail), tail};
+        EXPECT_FALSE(reader.Read(std::span<const ReadRequest>(&past, 1))) << depth;
+    }
+    std::filesystem::remove(path);
+}
+
+TEST(PrimeFactorCache, MergeFrom)
+{
+    const auto first_path = TempCachePath("merge_first");
+    const auto second_path = TempCachePath("merge_second");
+    PrimeFactorCache first(first_path.string());
+    PrimeFactorCache second(second_path.string());
+    for (uint64_t i = 1; i <= 3000; ++i) {
+        first.Write(MakeFactors({3, i}));
+        second.Write(MakeFactors({5, i}));
+    }
+    // Where both have a key, the merged cache keeps its own
+    first.Write(MakeFactors({2, 2, 2}));
+    second.Write(MakeFactors({2, 4}));
+    first.Flush();
+    second.Sort();
+
+    std::vector<const CacheSegment<>*> others;
+    const auto held = second.Segments();
+    for (const auto& segment : held) {
+        others.push_back(segment.get());
+    }
+    first.MergeFrom(others);
+
+    const auto merged = first.Segments();
+    ASSERT_EQ(merged.size(), 1);
+    EXPECT_EQ(merged.front()->FileCursors().size(), first.GetShards());
+    first.GetHotCache().Clear();
+    EXPECT_EQ(first.ProductExists(8)->CountOf(2), 3);
+    EXPECT_TRUE(first.ProductExists(3 * 2999).has_value());
+    EXPECT_TRUE(first.ProductExists(5 * 2999).has_value());
+    // The 600 multiples of 15 up to 9000 are in both and kept once
+    EXPECT_EQ(merged.front()->Entries(), 3000 + 3000 - 600 + 1);
+    std::filesystem::remove_all(first_path);
+    std::filesystem::remove_all(second_path);
+}
+
+TEST(PrimeFactorCache, Stats)
+{
+    const auto path = TempCachePath("stats");
+    {
+        PrimeFactorCache cache(path.string());
+        for (uint64_t i = 1; i <= 1000; ++i) {
+            cache.Write(MakeFactors({7, i}));
+        }
+        cache.Flush();
+    }
+    PrimeFactorCache cache(path.string());
+    cache.Write(MakeFactors({11, 13}));
+    EXPECT_TRUE(cache.ProductExists(7 * 500).has_value());
+    EXPECT_TRUE(cache.ProductExists(7 * 500).has_value());
+    cache.GetHotCache().Clear();
+    EXPECT_TRUE(cache.ProductExists(143).has_value());
+    EXPECT_FALSE(cache.ProductExists(7 * 1001).has_value());
+    const std::vector<mpz_class> batch = {7, 14, 143, 7 * 1003};
+    cache.GetHotCache().Clear();
+    cache.ProductExistsBatch(batch);
+
+    const CacheStats& stats = cache.GetStats();
+    EXPECT_EQ(stats.Lookups(), 8);
+    EXPECT_EQ(stats.Hits(CacheTier::Hot), 1);
+    EXPECT_EQ(stats.Hits(CacheTier::Memtable), 2);
+    EXPECT_EQ(stats.Hits(CacheTier::Segment), 3);
+    EXPECT_EQ(stats.Hits(CacheTier::Miss), 2);
+    EXPECT_GT(stats.BytesRead(), 0);
+    EXPECT_EQ(stats.LookupLatency().Count(), 4);
+    EXPECT_EQ(stats.InsertLatency().Count(), 1);
+
+    std::ostringstream json;
+    cache.WriteStats(json);
+    EXPECT_NE(json.str().find("\"entries\":1000"), std::string::npos) << json.str();
+    EXPECT_NE(json.str().find("\"misses\":2"), std::string::npos) << json.str();
+    std::filesystem::remove_all(path);
+}
+
+TEST(PrimeFactorCache, Admission)
+{
+    using namespace std::chrono_literals;
+    const auto path = TempCachePath("admission");
+    PrimeFactorCache cache(path.string());
+    cache.SetAdmitThreshold(1ms);
+    auto on_disk = [&cache](const mpz_class& Product) {
+        cache.GetHotCache().Clear();
+        return cache.ProductExists(Product).has_value();
+    };
+
+    // Quick results stay in memory until they are offered again
+    cache.Admit(MakeFactors({2, 3}), FactorMethod::Linear, 10us);
+    EXPECT_TRUE(cache.GetHotCache().Get(6).has_value());
+    EXPECT_FALSE(on_disk(6));
+    cache.Admit(MakeFactors({2, 3}), FactorMethod::Linear, 10us);
+    EXPECT_TRUE(on_disk(6));
+
+    // Slow results are written straight away
+    cache.Admit(MakeFactors({5, 7}), FactorMethod::Wheel, 2ms);
+    EXPECT_TRUE(on_disk(35));
+
+    // A hit on a result held in memory writes it
+    cache.Admit(MakeFactors({11, 13}), FactorMethod::Linear, 10us);
+    auto hit = cache.ProductExists(143);
+    ASSERT_TRUE(hit.has_value());
+    cache.Admit(hit.value(), FactorMethod::Cache, 1us);
+    EXPECT_TRUE(on_disk(143));
+
+    // Other hits were already in the cache and are not written again
+    cache.Admit(MakeFactors({17, 19}), FactorMethod::Cache, 1us);
+    EXPECT_FALSE(on_disk(17 * 19));
+
+    const CacheStats& stats = cache.GetStats();
+    EXPECT_EQ(stats.Factorizations(FactorMethod::Linear), 3);
+    EXPECT_EQ(stats.Factorizations(FactorMethod::Wheel), 1);
+    EXPECT_EQ(stats.Factorizations(FactorMethod::Cache), 2);
+    EXPECT_EQ(stats.Admitted(), 3);
+    EXPECT_EQ(stats.Declined(), 2);
+    cache.Close();
+    std::filesystem::remove_all(path);
+}
+
+TEST(PrimeFactorCache, LatencyHistogram)
+{
+    LatencyHistogram histogram;
+    EXPECT_EQ(histogram.QuantileNanos(0.5), 0);
+    for (int i = 0; i < 90; ++i) {
+        histogram.Record(std::chrono::nanoseconds(100));
+    }
+    for (int i = 0; i < 10; ++i) {
+        histogram.Record(std::chrono::microseconds(100));
+    }
+    EXPECT_EQ(histogram.Count(), 100);
+    EXPECT_EQ(histogram.QuantileNanos(0.5), 128);
+    EXPECT_EQ(histogram.QuantileNanos(0.9), 128);
+    EXPECT_EQ(histogram.QuantileNanos(0.99), 131072);
+    EXPECT_EQ(histogram.MeanNanos(), 10090);
+}
+
+TEST(PrimeFactorCache, SharedDirectory)
+{
+    const auto path = TempCachePath("shared");
+    PrimeFactorCache first(path.string());
+    PrimeFactorCache second(path.string());
+    first.Write(MakeFactors({7, 11, 13}));
+    second.Write(MakeFactors({3, 5}));
+    first.Flush();
+    second.Flush();
+
+    // Pinning the newest version picks up the other handle's run
+    EXPECT_TRUE(first.Refresh());
+    EXPECT_TRUE(first.ProductExists(15).has_value());
+    EXPECT_FALSE(first.Refresh());
+
+    // A Sort in one handle removes files the other still has mapped
+    second.Refresh();
+    first.Sort();
+    EXPECT_TRUE(second.ProductExists(1001).has_value());
+    EXPECT_TRUE(second.Refresh());
+    second.GetHotCache().Clear();
+    EXPECT_TRUE(second.ProductExists(1001).has_value());
+    std::filesystem::remove_all(path);
+}
+
+TEST(PrimeFactorCache, AlternatingHandles)
+{
+    // Each handle keeps its own pin on a thread, so switching between
+    // them neither loses a version nor reads the other's segments
+    const auto first_path = TempCachePath("alternate_first");
+    const auto second_path = TempCachePath("alternate_second");
+    PrimeFactorCache second(second_path.string());
+    second.Write(MakeFactors({3, 5}));
+    second.Flush();
+    {
+        PrimeFactorCache first(first_path.string());
+        first.Write(MakeFactors({7, 11, 13}));
+        first.Flush();
+        for (int i = 0; i < 3; ++i) {
+            first.GetHotCache().Clear();
+            second.GetHotCache().Clear();
+            EXPECT_TRUE(first.ProductExists(1001).has_value());
+            EXPECT_FALSE(first.ProductExists(15).has_value());
+            EXPECT_TRUE(second.ProductExists(15).has_value());
+            EXPECT_FALSE(second.ProductExists(1001).has_value());
+        }
+    }
+
+    // The closed handle's pin goes once this thread repins
+    second.Write(MakeFactors({17, 19}));
+    second.Flush();
+    second.GetHotCache().Clear();
+    EXPECT_TRUE(second.ProductExists(323).has_value());
+    EXPECT_TRUE(second.ProductExists(15).has_value());
+    std::filesystem::remove_all(first_path);
+    std::filesystem::remove_all(second_path);
+}
+
+TEST(PrimeFactorCache, ConcurrentProcesses)
+{
+    const auto path = TempCachePath("processes");
+    PrimeFactorCache<>(path.string()).Close();
+    const uint64_t workers = 6;
+    std::vector<pid_t> children;
+    for (uint64_t w = 0; w < workers; ++w) {
+        const pid_t pid = fork();
+        ASSERT_GE(pid, 0);
+        if (pid == 0) {
+            // Many small runs so the workers race to publish and compact
+            PrimeFactorCache cache(path.string());
+            for (uint64_t p = 3 + 2 * w; p < 400; p += 2 * workers) {
+                cache.Write(MakeFactors({p, 1009}));
+                if (p % 5 == 0) {
+                    cache.Flush();
+                }
+            }
+            cache.Close();
+            _exit(0);
+        }
+        children.push_back(pid);
+    }
+    for (const pid_t pid : children) {
+        int status = 0;
+        waitpid(pid, &status, 0);
+        EXPECT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+
+    PrimeFactorCache cache(path.string());
+    for (uint64_t p = 3; p < 400; p += 2) {
+        ASSERT_TRUE(cache.ProductExists(p * 1009).has_value()) << p;
+    }
+    cache.Sort();
+    for (const auto& dir : std::filesystem::directory_iterator(path / "runs")) {
+        ADD_FAILURE() << "Left behind: " << dir.path();
+    }
+    std::filesystem::remove_all(path);
+}
+
+TEST(PrimeFactorCache, CacheDaemon)
+{
+    const auto path = TempCachePath("daemon");
+    const auto socket_path = TempCachePath("daemon.sock");
+    {
+        PrimeFactorCache cache(path.string());
+        CacheServer server(cache, socket_path);
+        std::thread serving([&server]() { server.Run(); });
+
+        PrimeFactorCache writer("");
+        writer.Connect(socket_path);
+        ASSERT_TRUE(writer.IsConnected());
+        writer.Write(MakeFactors({7, 11, 13}));
+        writer.Write(MakeFactors({3, 5}));
+        writer.Flush();
+
+        // A second client finds them through the daemon
+        PrimeFactorCache reader("");
+        reader.Connect(socket_path);
+        auto found = reader.ProductExists(1001);
+        ASSERT_TRUE(found.has_value());
+        EXPECT_EQ(found->GetString(), "7^1 * 11^1 * 13^1");
+        EXPECT_FALSE(reader.ProductExists(1003).has_value());
+
+        // Batched lookups see inserts the client has not sent yet, and the
+        // daemon drops records that do not match their key
+        CacheClient client(socket_path);
+        client.Insert(16, MakeFactors({3, 5}));
+        const std::vector<mpz_class> keys = {15, 16, 17};
+        auto results = client.Lookup(keys);
+        EXPECT_TRUE(results[0].has_value());
+        EXPECT_TRUE(results[1].has_value());
+        EXPECT_FALSE(results[2].has_value());
+        client.Flush();
+        EXPECT_FALSE(client.Lookup(16).has_value());
+
+        server.Stop();
+        serving.join();
+    }
+    EXPECT_FALSE(std::filesystem::exists(socket_path));
+
+    PrimeFactorCache cache(path.string());
+    EXPECT_TRUE(cache.ProductExists(1001).has_value());
+    EXPECT_TRUE(cache.ProductExists(15).has_value());
+    std::filesystem::remove_all(path);
+}
+
+TEST(PrimeFactorCache, SegmentFileRoundTrip)
+{
+    const auto path = TempCachePath("segment");
+    std::filesystem::create_directories(path);
+    const auto file = path / kCacheFileName;
+
+    // Keys past 2^64 take the multi-word varint path
+    std::vector<std::pair<mpz_class, PrimeFactors>> records;
+    mpz_class big_prime("340282366920938463463374607431768211507");
+    for (uint64_t p = 3; p < 400; p += 2) {
+        auto factors = MakeFactors({p, p, 7919});
+        if (p % 3 == 0) {
+            factors.AddFactor(big_prime);
+        }
+        records.emplace_back(factors.Product(), factors);
+    }
+    std::sort(records.begin(), records.end(), [](const auto& a, const auto& b) {
+        return a.first < b.first;
+    });
+    {
+        CacheFileWriter writer(file, 64);
+        for (const auto& [product, factors] : records) {
+            writer.Add(product, factors);
+        }
+        // Keys that go backwards or repeat would be coded wrongly
+        EXPECT_THROW(writer.Add(records.back().first, records.back().second), std::runtime_error);
+        EXPECT_THROW(writer.Add(records.front().first, records.front().second), std::runtime_error);
+        writer.Finish();
+    }
+
+    CacheFile segment;
+    ASSERT_TRUE(segment.Open(file));
+    EXPECT_EQ(segment.Records(), records.size());
+    for (const auto& [product, factors] : records) {
+        auto found = segment.Find(product);
+        ASSERT_TRUE(found.has_value()) << product;
+        EXPECT_EQ(found->Product(), product);
+        EXPECT_FALSE(segment.Find(product + 2).has_value());
+    }
+    EXPECT_FALSE(segment.Find(1).has_value());
+
+    CacheFile::Cursor cursor(segment);
+    for (const auto& [product, factors] : records) {
+        ASSERT_TRUE(cursor.Valid());
+        EXPECT_EQ(cursor.Key(), product);
+        cursor.Next();
+    }
+    EXPECT_FALSE(cursor.Valid());
+    std::filesystem::remove_all(path);
+}
+
+TEST(PrimeFactorCache, MigrateLegacyShards)
+{
+    const auto path = TempCachePath("legacy");
+
+    // Write a version 1 cache by hand, one record per factor file. The
+    // old factorgen wrote p * q and q * p, so keys may repeat.
+    std::vector<PrimeFactors> all = {
+        MakeFactors({7, 7}),
+        MakeFactors({11, 13}),
+        MakeFactors({13, 11}),
+        MakeFactors({3, 5, 7}),
+        MakeFactors({3, 5, 7}),
+    };
+    for (const auto& factors : all) {
+        WriteLegacyRecord(path, factors);
+    }
+
+    {
+        PrimeFactorCache cache(path.string());
+        for (const auto& factors : all) {
+            ASSERT_TRUE(cache.ProductExists(factors.Product64()).has_value());
+        }
+        cache.Write(MakeFactors({17, 19}));
+        cache.Sort();
+    }
+    const auto manifest = CacheManifest::Read(path);
+    ASSERT_TRUE(manifest.has_value());
+    EXPECT_TRUE(manifest->Runs.empty());
+    EXPECT_TRUE(std::filesystem::exists(path / manifest->Base / CacheFileName(0, kDefaultCacheShards)));
+    EXPECT_FALSE(std::filesystem::exists(path / "index"));
+    EXPECT_FALSE(std::filesystem::exists(CacheSegment<>::FactorPath(path, 2)));
+
+    all.push_back(MakeFactors({17, 19}));
+    PrimeFactorCache cache(path.string());
+    // Each repeated key is written once
+    size_t entries = 0;
+    for (const auto& segment : cache.Segments()) {
+        entries += segment->Entries();
+    }
+    EXPECT_EQ(entries, 4);
+    for (const auto& factors : all) {
+        auto found = cache.ProductExists(factors.Product64());
+        ASSERT_TRUE(found.has_value());
+        EXPECT_EQ(found->GetString(), factors.GetString());
+    }
+    std::filesystem::remove_all(path);
+}
+
+TEST(PrimeFactorCache, LegacySortFailure)
+{
+    const auto path = TempCachePath("legacy_failure");
+    WriteLegacyRecord(path, MakeFactors({3, 7}));
+    WriteLegacyRecord(path, MakeFactors({11, 13}));
+    // The sorted copy cannot be written where a directory is in its way
+    const auto factor_path = CacheSegment<>::FactorPath(path, 2);
+    std::filesystem::create_directories(factor_path.string() + ".tmp");
+
+    PrimeFactorCache cache(path.string());
+    EXPECT_THROW(cache.Sort(), std::runtime_error);
+    // The legacy files are kept and still serve lookups
+    EXPECT_TRUE(std::filesystem::exists(factor_path));
+    EXPECT_TRUE(std::filesystem::exists(path / "index"));
+    EXPECT_TRUE(cache.ProductExists(21).has_value());
+    EXPECT_TRUE(cache.ProductExists(143).has_value());
+    std::filesystem::remove_all(path);
+}
+
+TEST(PrimeFactorCache, WideKeys)
+{
+    const auto path = TempCachePath("wide");
+    // Products that agree in their low 64 bits must not collide
+    mpz_class big_prime("340282366920938463463374607431768211507");
+    mpz_class offset = mpz_class(1) << 64;
+    std::vector<PrimeFactors> all;
+    for (uint64_t p = 3; p < 500; p += 2) {
+        auto factors = MakeFactors({p, 7919});
+        factors.AddFactor(big_prime);
+        all.push_back(factors);
+    }
+    {
+        PrimeFactorCache cache(path.string());
+        cache.SetShards(5);
+        for (const auto& factors : all) {
+            cache.Write(factors);
+        }
+        cache.Flush();
+        cache.GetHotCache().Clear();
+        for (const auto& factors : all) {
+            ASSERT_TRUE(cache.ProductExists(factors.Product()).has_value());
+            EXPECT_FALSE(cache.ProductExists(factors.Product() + offset).has_value());
+        }
+        // Resharding the base on Sort
+        cache.SetShards(3);
+        cache.Sort();
+    }
+    EXPECT_TRUE(std::filesystem::exists(path / CacheManifest::Read(path)->Base / CacheFileName(2, 3)));
+    PrimeFactorCache cache(path.string());
+    for (const auto& factors : all) {
+        auto found = cache.ProductExists(factors.Product());
+        ASSERT_TRUE(found.has_value()) << factors.Product();
+        EXPECT_EQ(found->GetString(), factors.GetString());
+    }
+    std::filesystem::remove_all(path);
+}
+
+TEST(PrimeFactorCache, ShardedWriter)
+{
+    const auto path = TempCachePath("sharded");
+    std::filesystem::create_directories(path);
+    {
+        ShardedCacheWriter writer(path, 4);
+        for (uint64_t p = 3; p < 1000; p += 2) {
+            writer.Add(p * 3, MakeFactors({3, p}));
+        }
+        EXPECT_EQ(writer.Records(), 499);
+        writer.Finish();
+    }
+    // Every shard gets a fair share of the keys
+    for (size_t i = 0; i < 4; ++i) {
+        CacheFile shard;
+        ASSERT_TRUE(shard.Open(path / CacheFileName(i, 4)));
+        EXPECT_GT(shard.Records(), 499 / 8);
+    }
+    CacheSegment<> segment(path);
+    EXPECT_EQ(segment.Shards(), 4);
+    EXPECT_EQ(segment.Entries(), 499);
+    ASSERT_TRUE(segment.Find(3 * 997).has_value());
+    EXPECT_FALSE(segment.Find(3 * 1001).has_value());
+    std::filesystem::remove_all(path);
+}
+
+TEST(PrimeFactorCache, RecordSort)
+{
+    // Two word keys with a payload word, some only differing in the high
+    // word, and repeats that must keep their order
+    constexpr size_t record_size = 3 * sizeof(uint64_t);
+    std::vector<uint64_t> words;
+    uint64_t state = 12345;
+    for (uint64_t i = 0; i < 20000; ++i) {
+        state = state * 6364136223846793005ull + 1442695040888963407ull;
+        words.push_back(state % 1000);
+        words.push_back(state >> 62);
+        words.push_back(i);
+    }
+    std::vector<uint8_t> records(words.size() * sizeof(uint64_t));
+    std::memcpy(records.data(), words.data(), records.size());
+
+    auto check = [](const std::vector<uint8_t>& Sorted) {
+        std::vector<uint64_t> sorted(Sorted.size() / sizeof(uint64_t));
+        std::memcpy(sorted.data(), Sorted.data(), Sorted.size());
+        for (size_t i = 3; i < sorted.size(); i += 3) {
+            const auto previous = std::make_tuple(sorted[i - 2], sorted[i - 3], sorted[i - 1]);
+            const auto current = std::make_tuple(sorted[i + 1], sorted[i], sorted[i + 2]);
+            ASSERT_LT(previous, current) << i;
+        }
+    };
+    const std::vector<uint8_t> sorted = RadixSortRecords(records, record_size, 2);
+    ASSERT_EQ(sorted.size(), records.size());
+    check(sorted);
+
+    // A budget far below the file size sorts in chunks and merges them
+    const auto path = TempCachePath("recordsort");
+    std::filesystem::create_directories(path);
+    const auto file = path / "records.dat";
+    ASSERT_TRUE(ReplaceFile(file, records.data(), records.size()));
+    ASSERT_TRUE(SortRecordFile(file, record_size, 2, 64 << 10));
+    MappedFile map;
+    ASSERT_TRUE(map.Open(file));
+    EXPECT_TRUE(std::equal(map.Data().begin(), map.Data().end(), sorted.begin(), sorted.end()));
+    map.Close();
+    size_t files = 0;
+    for ([[maybe_unused]] const auto& entry : std::filesystem::directory_iterator(path)) {
+        files++;
+    }
+    EXPECT_EQ(files, 1);
+    std::filesystem::remove_all(path);
+}
+
+TEST(PrimeFactorCache, SnapshotExport)
+{
+    const auto path = TempCachePath("snapshot");
+    auto snapshot = path;
+    snapshot += ".snap";
+    std::vector<uint64_t> products;
+    {
+        PrimeFactorCache cache(path.string());
+        for (uint64_t p = 3; p < 300; p += 2) {
+            auto factors = MakeFactors({p, p + 2, 9973});
+            products.push_back(factors.Product64());
+            cache.Write(factors);
+        }
+        EXPECT_EQ(cache.ExportSnapshot(snapshot), products.size());
+    }
+
+    PrimeFactorCache cache(snapshot.string());
+    ASSERT_TRUE(cache.IsOpen());
+    for (const uint64_t product : products) {
+        auto found = cache.ProductExists(product);
+        ASSERT_TRUE(found.has_value()) << product;
+        EXPECT_EQ(found->Product64(), product);
+        EXPECT_FALSE(cache.ProductExists(product + 1).has_value());
+    }
+    // Snapshots are read-only, writes only reach the in-memory tier
+    cache.Write(MakeFactors({5, 7}));
+    EXPECT_TRUE(cache.ProductExists(35).has_value());
+    EXPECT_FALSE(PrimeFactorCache(snapshot.string()).ProductExists(35).has_value());
+    std::filesystem::remove_all(path);
+    std::filesystem::remove(snapshot);
+}
+
+TEST(PrimeFactorCache, SnapshotLargeRecords)
+{
+    const auto path = TempCachePath("snapshot_large");
+    mpz_class big_prime("340282366920938463463374607431768211507");
+    SnapshotWriter writer;
+    std::vector<PrimeFactors> all;
+    for (uint64_t p = 3; p < 100; p += 2) {
+        // Alternate records that fit in a slot with ones that overflow
+        auto factors = p % 4 == 1 ? MakeFactors({p, 11}) : MakeFactors({p, 13});
+        if (p % 4 == 3) {
+            factors.AddFactor(big_prime);
+        }
+        all.push_back(factors);
+    }
+    std::sort(all.begin(), all.end(), [](const auto& a, const auto& b) {
+        return a.Product() < b.Product();
+    });
+    for (const auto& factors : all) {
+        writer.Add(factors.Product(), factors);
+    }
+    writer.Finish(path);
+
+    CacheSnapshot snapshot;
+    ASSERT_TRUE(snapshot.Open(path));
+    EXPECT_EQ(snapshot.Keys(), all.size());
+    for (const auto& factors : all) {
+        auto found = snapshot.Find(factors.Product());
+        ASSERT_TRUE(found.has_value()) << factors.Product();
+        EXPECT_EQ(found->GetString(), factors.GetString());
+        EXPECT_FALSE(snapshot.Find(factors.Product() * 2).has_value());
+    }
+    std::filesystem::remove(path);
+}
+
+TEST(PrimeFactorCache, BloomFilter)
+{
+    const uint64_t keys = 100000;
+    std::vector<BloomBlock> filter(BloomBlockCount(keys));
+    std::memset(filter.data(), 0, filter.size() * sizeof(BloomBlock));
+    for (uint64_t i = 0; i < keys; ++i) {
+        BloomAdd(filter, HashKey(i * 2));
+    }
+    size_t false_positives = 0;
+    for (uint64_t i = 0; i < keys; ++i) {
+        ASSERT_TRUE(BloomMayContain(filter, HashKey(i * 2)));
+        false_positives += BloomMayContain(filter, HashKey(i * 2 + 1));
+    }
+    // About 1% at ten bits per key
+    EXPECT_LT(false_positives, keys / 50);
+    EXPECT_TRUE(BloomMayContain({}, HashKey(1)));
+}
+
+TEST(PrimeFactorCache, HotCacheBudget)
+{
+    HotFactorCache hot(kHotCacheShards * 4096);
+    for (uint64_t p = 3; p < 2000; p += 2) {
+        hot.Put(p * 7, MakeFactors({7, p}));
+    }
+    // Everything beyond the budget has been evicted
+    EXPECT_LE(hot.Bytes(), hot.GetBudget());
+    EXPECT_GT(hot.Entries(), 0);
+    EXPECT_LT(hot.Entries(), 999);
+
+    hot.Put(1001, MakeFactors({7, 11, 13}));
+    auto found = hot.Get(1001);
+    ASSERT_TRUE(found.has_value());
+    EXPECT_EQ(found->Product(), 1001);
+    EXPECT_FALSE(hot.Get(1003).has_value());
+    EXPECT_EQ(hot.Hits(), 1);
+    EXPECT_EQ(hot.Misses(), 1);
+
+    hot.SetBudget(0);
+    EXPECT_EQ(hot.Entries(), 0);
+}
+
+TEST(PrimeFactorCache, HotCacheThreads)
+{
+    HotFactorCache hot;
+    std::vector<std::thread> threads;
+    for (uint64_t t = 0; t < 8; ++t) {
+        threads.emplace_back([&hot, t]() {
+            for (uint64_t p = 3; p < 3000; p += 2) {
+                if (p % 8 == t) {
+                    hot.Put(p * 3, MakeFactors({3, p}));
+                }
+                hot.Get(p * 3);
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    EXPECT_EQ(hot.Hits() + hot.Misses(), 8 * 1499);
+    for (uint64_t p = 3; p < 3000; p += 2) {
+        auto found = hot.Get(p * 3);
+        ASSERT_TRUE(found.has_value());
+        EXPECT_EQ(found->Product(), p * 3);
+    }
+}
+
+TEST(PrimeFactorCache, HotTierWithoutPath)
+{
+    PrimeFactorCache cache("");
+    cache.Write(MakeFactors({7, 11, 13}));
+    EXPECT_TRUE(cache.ProductExists(1001).has_value());
+    EXPECT_EQ(cache.GetHotCache().Hits(), 1);
+}
@@ -1,8 +1,12 @@
 #include <gtest/gtest.h>
 
+#include <numeric>
+
 #include "isprime.hpp"
+#include "primecount.hpp"
 #include "primes.hpp"
 #include "primefactors.hpp"
+#include "sieve.hpp"
 
 TEST(Primes, GeneratePrimes) {
     auto gaps = GeneratePrimeGaps(100, false);
@@ -16,6 +20,182 @@ TEST(Primes, GeneratePrimes) {
     EXPECT_TRUE(gaps[5] == 2);  // gap 2 (11 to 13)
 }
 
+TEST(Primes, GeneratePrimesCount)
+{
+    // The 1000th prime is 7919
+    auto gaps = GeneratePrimeGaps(1000, true);
+    uint64_t prime = 0;
+    size_t count = 0;
+    size_t index = 0;
+    while (index < gaps.size()) {
+        uint64_t gap = 0;
+        uint8_t shift = 0;
+        uint8_t byte;
+        do {
+            byte = gaps[index++];
+            gap |= static_cast<uint64_t>(byte & 0x7F) << shift;
+            shift += 7;
+        } while ((byte & 0x80) != 0);
+        prime += gap;
+        count++;
+    }
+    EXPECT_EQ(count, 1000);
+    EXPECT_EQ(prime, 7919);
+}
+
+TEST(Sieve, SegmentStitching)
+{
+    // Sieving across several segments must produce the same stream
+    // as sieving the whole range in one go
+    const uint64_t end = 3 * kSieveSegmentSize + 17;
+    std::vector<uint8_t> stitched;
+    const uint64_t last = SievePrimeGaps(
+        0,
+        end,
+        0,
+        0,
+        [&stitched](std::span<const uint8_t> Gaps, const uint64_t, const size_t) {
+            stitched.insert(stitched.end(), Gaps.begin(), Gaps.end());
+            return true;
+        },
+        3
+    );
+
+    auto base = SieveBasePrimes(4096);
+    auto whole = SieveSegment(0, end, base);
+    std::vector<uint8_t> expected;
+    EncodeGap(expected, whole.First);
+    expected.insert(expected.end(), whole.Gaps.begin(), whole.Gaps.end());
+
+    EXPECT_EQ(last, whole.Last);
+    EXPECT_EQ(stitched, expected);
+
+    mpz_class next = last;
+    mpz_nextprime(next.get_mpz_t(), next.get_mpz_t());
+    EXPECT_GE(next, end);
+}
+
+TEST(Sieve, WindowsConcatenate)
+{
+    // [0, 1000) followed by [1000, 5000) must equal [0, 5000)
+    auto collect = [](const uint64_t Start, const uint64_t End) {
+        std::vector<uint8_t> gaps;
+        SievePrimeGaps(
+            Start,
+            End,
+            PreviousPrime(Start),
+            0,
+            [&gaps](std::span<const uint8_t> Gaps, const uint64_t, const size_t) {
+                gaps.insert(gaps.end(), Gaps.begin(), Gaps.end());
+                return true;
+            }
+        );
+        return gaps;
+    };
+    auto first = collect(0, 1000);
+    auto second = collect(1000, 5000);
+    first.insert(first.end(), second.begin(), second.end());
+    EXPECT_EQ(first, collect(0, 5000));
+    EXPECT_EQ(PreviousPrime(1000), 997);
+    EXPECT_EQ(PreviousPrime(2), 0);
+}
+
+TEST(Sieve, ScanTruncatedTail)
+{
+    auto gaps = GeneratePrimeGaps(100, false);
+    const size_t valid = gaps.size();
+    // A multi-byte gap that was only partially written
+    gaps.push_back(0x85);
+    auto tail = ScanPrimeGaps(gaps, 0);
+    EXPECT_EQ(tail.Last, 97);
+    EXPECT_EQ(tail.Count, 25);
+    EXPECT_EQ(tail.Valid, valid);
+}
+
+TEST(Primes, HalfGapEncoding)
+{
+    auto vle = GeneratePrimeGaps(200000, false);
+    std::vector<uint64_t> expected;
+    ForEachPrime(vle, [&expected](const uint64_t Prime) {
+        expected.push_back(Prime);
+        return true;
+    });
+
+    // Re-encode, forcing an oversized gap to exercise the escape
+    std::vector<uint8_t> store;
+    AppendHalfGapHeader(store);
+    HalfGapEncoder encoder;
+    for (const uint64_t prime : expected) {
+        encoder.Add(prime, store);
+    }
+    encoder.Add(expected.back() + 2000, store);
+    encoder.Finish(store);
+    expected.push_back(expected.back() + 2000);
+
+    EXPECT_EQ(GetPrimeGapEncoding(store), PrimeGapEncoding::HalfGap);
+    EXPECT_EQ((store.size() - kHalfGapHeaderSize) % kHalfGapBlockSize, 0);
+    std::vector<uint64_t> decoded;
+    ForEachPrime(store, [&decoded](const uint64_t Prime) {
+        decoded.push_back(Prime);
+        return true;
+    });
+    EXPECT_EQ(decoded, expected);
+
+    auto tail = ScanHalfGapBlocks(std::span<const uint8_t>(store).subspan(kHalfGapHeaderSize));
+    EXPECT_EQ(tail.Last, expected.back());
+    EXPECT_EQ(tail.Count + 1, expected.size());
+}
+
+TEST(Sieve, DetectOutputEncoding)
+{
+    auto vle = GeneratePrimeGaps(200000, false);
+    std::vector<uint8_t> half;
+    AppendHalfGapHeader(half);
+    HalfGapEncoder encoder;
+    ForEachPrime(vle, [&half, &encoder](const uint64_t Prime) {
+        encoder.Add(Prime, half);
+        return true;
+    });
+    encoder.Finish(half);
+    EXPECT_EQ(DetectOutputEncoding(vle, 0), PrimeGapEncoding::Vle);
+    EXPECT_EQ(DetectOutputEncoding(half, 0), PrimeGapEncoding::HalfGap);
+    EXPECT_EQ(DetectOutputEncoding({}, 0), std::nullopt);
+
+    // Windows have no file header, the first prime gives them away
+    std::vector<uint8_t> vle_window;
+    SievePrimeGaps(
+        1000,
+        5000,
+        PreviousPrime(1000),
+        0,
+        [&vle_window](std::span<const uint8_t> Gaps, const uint64_t, const size_t) {
+            vle_window.insert(vle_window.end(), Gaps.begin(), Gaps.end());
+            return true;
+        }
+    );
+    std::vector<uint8_t> half_window;
+    HalfGapEncoder window_encoder;
+    ForEachPrime(vle, [&half_window, &window_encoder](const uint64_t Prime) {
+        if (Prime >= 1000 && Prime < 5000) {
+            window_encoder.Add(Prime, half_window);
+        }
+        return Prime < 5000;
+    });
+    window_encoder.Finish(half_window);
+    EXPECT_EQ(DetectOutputEncoding(vle_window, 1000), PrimeGapEncoding::Vle);
+    EXPECT_EQ(DetectOutputEncoding(half_window, 1000), PrimeGapEncoding::HalfGap);
+    EXPECT_EQ(DetectOutputEncoding(vle_window, 2000), std::nullopt);
+
+    // Resuming with the wrong format must not take either file for the other
+    EXPECT_EQ(ScanHalfGapBlocks(vle).Valid, 0);
+    std::vector<uint8_t> corrupt(half.begin() + kHalfGapHeaderSize, half.end());
+    HalfGapBlockHeader header{};
+    std::memcpy(&header, corrupt.data() + kHalfGapBlockSize, sizeof(header));
+    header.Count = kHalfGapsPerBlock + 1;
+    std::memcpy(corrupt.data() + kHalfGapBlockSize, &header, sizeof(header));
+    EXPECT_EQ(ScanHalfGapBlocks(corrupt).Valid, kHalfGapBlockSize);
+}
+
 TEST(Primes, GetPrimeGaps)
 {
     // This will trigger a fallback, so use a small limit
@@ -32,7 +212,7 @@ TEST(Primes, PrimeFactorsSmall)
     mpz_class n = 100;
     auto factors = GetPrimeFactors(n);
     EXPECT_EQ(factors.Size(), 2); // 2^2 * 5^2
-    EXPECT_EQ(factors.count(), 4);
+    EXPECT_EQ(factors.Count(), 4);
     EXPECT_EQ(factors.CountOf(2), 2);
     EXPECT_EQ(factors.CountOf(5), 2);
 }
@@ -42,7 +222,7 @@ TEST(Primes, PrimeFactorsMedium)
     mpz_class n(65536); // 2^16
     auto factors = GetPrimeFactors(n);
     EXPECT_EQ(factors.Size(), 1);
-    EXPECT_EQ(factors.count(), 16);
+    EXPECT_EQ(factors.Count(), 16);
     EXPECT_EQ(factors.CountOf(2), 16);
 }
 
@@ -54,7 +234,7 @@ TEST(Primes, PrimeFactorsLarge)
     mpz_class n(131074); // 65537^1 * 2^1
     auto factors = GetPrimeFactors(n);
     EXPECT_EQ(factors.Size(), 2);
-    EXPECT_EQ(factors.count(), 2);
+    EXPECT_EQ(factors.Count(), 2);
     EXPECT_EQ(factors.CountOf(2), 1);
     EXPECT_EQ(factors.CountOf(65537), 1);
 }
@@ -68,7 +248,7 @@ TEST(Primes, PrimeFactorsVeryLarge)
     n *= 3;
     auto factors = GetPrimeFactors(n);
     EXPECT_EQ(factors.Size(), 3);
-    EXPECT_EQ(factors.count(), 3);
+    EXPECT_EQ(factors.Count(), 3);
     EXPECT_EQ(factors.CountOf(2), 1);
     EXPECT_EQ(factors.CountOf(3), 1);
     EXPECT_EQ(factors.CountOf(882377), 1);
@@ -106,6 +286,24 @@ TEST(Primes, GetPrimeIndex)
     EXPECT_EQ(large_index, 70000);
 }
 
+TEST(PrimeCount, PrimePi)
+{
+    EXPECT_EQ(PrimePi(0), 0);
+    EXPECT_EQ(PrimePi(2), 1);
+    EXPECT_EQ(PrimePi(100), 25);
+    EXPECT_EQ(PrimePi(1000000), 78498);
+    EXPECT_EQ(PrimePi(1000000000), 50847534);
+    EXPECT_EQ(PrimePi(10000000000ull), 455052511);
+}
+
+TEST(PrimeCount, NthPrime)
+{
+    EXPECT_EQ(NthPrime(1), 2);
+    EXPECT_EQ(NthPrime(1000), 7919);
+    EXPECT_EQ(NthPrime(1000000), 15485863);
+    EXPECT_EQ(NthPrime(100000000), 2038074743);
+}
+
 TEST(IsPrime, SmallPrimes)
 {
     auto gaps = GeneratePrimeGaps(100, false);
@@ -114,13 +312,13 @@ TEST(IsPrime, SmallPrimes)
         2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47
     };
     for (const auto& prime : small_primes) {
-        EXPECT_TRUE(is_prime.check(prime)) << "Failed for prime: " << prime;
+        EXPECT_TRUE(is_prime.Check(prime)) << "Failed for prime: " << prime;
     }
     std::vector<mpz_class> small_non_primes = {
         0, 1, 4, 6, 8, 9, 10, 12, 14, 15, 16, 18, 20
     };
     for (const auto& non_prime : small_non_primes) {
-        EXPECT_FALSE(is_prime.check(non_prime)) << "Failed for non-prime: " << non_prime;
+        EXPECT_FALSE(is_prime.Check(non_prime)) << "Failed for non-prime: " << non_prime;
     }
 }
 
@@ -132,13 +330,13 @@ TEST(IsPrime, LargePrimes)
         999983, 1000003, 1000033, 1000037, 1000039
     };
     for (const auto& prime : large_primes) {
-        EXPECT_TRUE(is_prime.check(prime)) << "Failed for prime: " << prime;
+        EXPECT_TRUE(is_prime.Check(prime)) << "Failed for prime: " << prime;
     }
     std::vector<mpz_class> large_non_primes = {
         1000000, 1000010, 1000020, 1000030
     };
     for (const auto& non_prime : large_non_primes) {
-        EXPECT_FALSE(is_prime.check(non_prime)) << "Failed for non-prime: " << non_prime;
+        EXPECT_FALSE(is_prime.Check(non_prime)) << "Failed for non-prime: " << non_prime;
     }
 }
 
@@ -148,12 +346,8 @@ TEST(Prime, WheelGeneration210)
     EXPECT_FALSE(wheel.empty());
     // The wheel should start with 1 and end at 211
     mpz_class current = 1;
-    for (auto gapword : wheel) {
-        for (size_t i = 0; i < kGapsPerWord; ++i) {
-            const uint64_t gap = gapword & kGapMask;
-            gapword >>= kBitsPerWheelGap;
-            current += gap;
-        }
+    for (const uint8_t increment : wheel) {
+        current += increment;
     }
     EXPECT_EQ(current, mpz_class(211));
 }
@@ -164,12 +358,8 @@ TEST(Prime, WheelGeneration2310)
     EXPECT_FALSE(wheel.empty());
     // The wheel should start with 1 and end at 2311
     mpz_class current = 1;
-    for (auto gapword : wheel) {
-        for (size_t i = 0; i < kGapsPerWord; ++i) {
-            const uint64_t gap = gapword & kGapMask;
-            gapword >>= kBitsPerWheelGap;
-            current += gap;
-        }
+    for (const uint8_t increment : wheel) {
+        current += increment;
     }
     EXPECT_EQ(current, mpz_class(2311));
 }
@@ -180,12 +370,8 @@ TEST(Prime, WheelGeneration510510)
     EXPECT_FALSE(wheel.empty());
     // The wheel should start with 1 and end at 510511
     mpz_class current = 1;
-    for (auto gapword : wheel) {
-        for (size_t i = 0; i < kGapsPerWord; ++i) {
-            const uint64_t gap = gapword & kGapMask;
-            gapword >>= kBitsPerWheelGap;
-            current += gap;
-        }
+    for (const uint8_t increment : wheel) {
+        current += increment;
     }
     EXPECT_EQ(current, mpz_class(510511));
 }
@@ -196,12 +382,8 @@ TEST(Prime, WheelGeneration30030)
     EXPECT_FALSE(wheel.empty());
     // The wheel should start with 1 and end at 30031
     mpz_class current = 1;
-    for (auto gapword : wheel) {
-        for (size_t i = 0; i < kGapsPerWord; ++i) {
-            const uint64_t gap = gapword & kGapMask;
-            gapword >>= kBitsPerWheelGap;
-            current += gap;
-        }
+    for (const uint8_t increment : wheel) {
+        current += increment;
     }
     EXPECT_EQ(current, mpz_class(30031));
 }
@@ -212,12 +394,8 @@ TEST(Prime, WheelGeneration9699690)
     EXPECT_FALSE(wheel.empty());
     // The wheel should start with 1 and end at 9699691
     mpz_class current = 1;
-    for (auto gapword : wheel) {
-        for (size_t i = 0; i < kGapsPerWord; ++i) {
-            const uint64_t gap = gapword & kGapMask;
-            gapword >>= kBitsPerWheelGap;
-            current += gap;
-        }
+    for (const uint8_t increment : wheel) {
+        current += increment;
     }
     EXPECT_EQ(current, mpz_class(9699691));
 }
@@ -228,12 +406,23 @@ TEST(Prime, WheelGeneration223092870)
     EXPECT_FALSE(wheel.empty());
     // The wheel should start with 1 and end at 223092871
     mpz_class current = 1;
-    for (auto gapword : wheel) {
-        for (size_t i = 0; i < kGapsPerWord; ++i) {
-            const uint64_t gap = gapword & kGapMask;
-            gapword >>= kBitsPerWheelGap;
-            current += gap;
-        }
+    for (const uint8_t increment : wheel) {
+        current += increment;
     }
     EXPECT_EQ(current, mpz_class(223092871));
+}
+
+TEST(Prime, WheelConstexprMatchesRuntime)
+{
+    // The compile time tables must visit exactly the coprime residues
+    static_assert(kWheel<30>.size() == 8);
+    static_assert(kWheel<30030>.size() == 5760);
+    auto wheel = GetWheel(30030);
+    uint64_t residue = 1;
+    for (const uint8_t increment : wheel) {
+        EXPECT_TRUE(std::gcd(residue, uint64_t(30030)) == 1) << residue;
+        residue += increment;
+    }
+    EXPECT_EQ(residue, 30031);
+    EXPECT_EQ(GetWheel(510510).size(), WheelTotient(510510));
 }
\ No newline at end of file